@@ -28,8 +28,33 @@ typedef struct nobita_target Nobita_Exe;
 typedef struct nobita_target Nobita_Shared_Lib;
 typedef struct nobita_target Nobita_Static_Lib;
 typedef struct nobita_target Nobita_CMD;
+typedef struct nobita_target Nobita_Config;
+
+/*
+ * The implementation uses pipe2, wait4, CPU sets and the like, which glibc
+ * only declares with _GNU_SOURCE and only if it's defined before the first
+ * libc header. So either include nobita.h first in the build file or define
+ * _GNU_SOURCE yourself. The build executable is compiled with
+ * '-ldl -pthread', which glibc older than 2.34 needs for dlopen and threads:
+ *
+ *     cc -o build build.c -ldl -pthread
+ */
+#if defined(NOBITA_IMPL) && !defined(_WIN32)
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "nobita.h: include it first or define _GNU_SOURCE before any header"
+#endif /* __GLIBC__ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+#endif /* NOBITA_IMPL */
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * What 'Nobita_Build_Add_Fn()' steps run, returns whether it succeeded
+ */
+typedef bool (*Nobita_Fn)(void *arg);
 
 enum nobita_argtype {
     NOBITA_T_CFLAGS,
@@ -43,6 +68,35 @@ enum nobita_build_tool {
     NOBITA_BT_MSVC,
 };
 
+enum nobita_action {
+    NOBITA_ACT_COMPILE,
+    NOBITA_ACT_LINK,
+    NOBITA_ACT_ARCHIVE,
+    NOBITA_ACT_CUSTOM_CMD,
+};
+
+enum nobita_linker {
+    NOBITA_LD_DEFAULT,
+    NOBITA_LD_BFD,
+    NOBITA_LD_GOLD,
+    NOBITA_LD_LLD,
+    NOBITA_LD_MOLD,
+    NOBITA_LD_AUTO,
+};
+
+enum nobita_lto {
+    NOBITA_LTO_NONE,
+    NOBITA_LTO_FULL,
+    NOBITA_LTO_THIN,
+};
+
+enum nobita_rebuild_profile {
+    NOBITA_RP_FAST,
+    NOBITA_RP_DEBUG,
+    NOBITA_RP_RELEASE,
+    NOBITA_RP_ASAN,
+};
+
 /**
  * The function that will be used to create build recipes
  * b is automatically supplied
@@ -51,11 +105,31 @@ extern void build(Nobita_Build *b);
 
 /**
  * The function that will rebuild the build file when it's source
- * the one denoted as 'build_file' is newer than the executable,
+ * the one denoted as 'build_file' or any header it includes is newer than
+ * the executable, the headers are tracked via a depfile kept in nobita-cache
+ *
+ * When a rebuild happens the current process is replaced by the new
+ * executable (via execv) so there's no second build process waiting around,
  * unfortunately this doesn't really work on windows
  */
 void Nobita_Try_Rebuild(Nobita_Build *b, const char *build_file);
 
+/**
+ * Sets the compile flags used by 'Nobita_Try_Rebuild()' via the following enums
+ * and must be called before it
+ *
+ * NOBITA_RP_FAST     no optimizations and no debug info, the default
+ *
+ * NOBITA_RP_DEBUG    no optimizations but with debug info
+ *
+ * NOBITA_RP_RELEASE  optimized, for build files that do heavy work themselves
+ *
+ * NOBITA_RP_ASAN     debug info and address sanitizer, the old behaviour
+ */
+void Nobita_Set_Rebuild_Profile(
+    Nobita_Build *b, enum nobita_rebuild_profile p
+);
+
 /**
  * If you've somehow allocated some pointers via malloc and it needs to be
  * alive after the build process then this will free that pointer later on
@@ -94,16 +168,283 @@ Nobita_Build_Add_Static_Lib(Nobita_Build *b, const char *name);
 Nobita_CMD *Nobita_Build_Add_CMD(Nobita_Build *b, const char *name);
 
 /**
- * Warning: Untested
- * This is supposed to add other build sources that use nobita
- * though I'm not so sure how this would behave yet.
+ * Adds a step that calls fn(arg) inside the build executable instead of
+ * starting a process, e.g. writing a version header or a checksum
+ *
+ * It runs on a thread and takes a process slot like any other job, so fn
+ * can run at the same time as other steps and shouldn't start processes
+ * itself (the build may reap them), it's a command so what it reads and
+ * writes are declared with
+ *
+ * 'Nobita_CMD_Add_Inputs()' and 'Nobita_CMD_Add_Outputs()'
+ *
+ * and it's skipped while they and the build itself are up to date, without
+ * outputs it always runs
+ */
+Nobita_CMD *
+Nobita_Build_Add_Fn(Nobita_Build *b, const char *name, Nobita_Fn fn, void *arg);
+
+/**
+ * Adds a config header, written to the include directory once all of it's
+ * checks ran (they all run at once like any other job) and only touched
+ * when a result changed, targets that depend on it wait for it and are
+ * recompiled when it changes
+ *
+ * Results are kept in the state file by the checks, the compiler (where
+ * it's found in PATH, it's size and modification time) and the flags, so
+ * they only run again when one of those changes, or with --recheck
+ *
+ * It's a target, so the build tool and flags for the checks are set with
+ * 'Nobita_Target_Set_Build_Tool()' and 'Nobita_Target_Add_Cflags()'
+ */
+Nobita_Config *Nobita_Build_Add_Config(Nobita_Build *b, const char *header);
+
+/** Defines define to 1 if header can be included */
+void Nobita_Check_Header(
+    Nobita_Config *c, const char *define, const char *header
+);
+
+/**
+ * Defines define to 1 if symbol (a function, variable or macro) is
+ * declared by header and links, header can be NULL to only check that a
+ * function links, it's declared as 'char symbol(void);' then
+ */
+void Nobita_Check_Symbol(
+    Nobita_Config *c, const char *define, const char *symbol,
+    const char *header
+);
+
+/** Defines define to 1 if code compiles */
+void Nobita_Try_Compile(
+    Nobita_Config *c, const char *define, const char *code
+);
+
+/** Defines define to 1 if pkg-config knows about package */
+void Nobita_Check_Pkg_Config(
+    Nobita_Config *c, const char *define, const char *package
+);
+
+/**
+ * Compiles and links the target with the flags pkg-config has for package,
+ * looked up by the config c which the target then depends on
+ */
+void Nobita_Target_Add_Pkg_Config(
+    struct nobita_target *t, Nobita_Config *c, const char *package
+);
+
+/**
+ * Adds the targets of another nobita build file into this build, it's
+ * compiled as a shared object (with NOBITA_SUBBUILD defined) and it's
+ * 'build()' is called right away so everything ends up in one graph
+ * sharing one process limit
  *
  * Just treat 'nobita_build_src' as something going from the same
- * directory as the executable
+ * directory as the executable, the sub build's globs and custom commands
+ * are relative to it's own directory
+ *
+ * The sub build's targets are namespaced after it's directory, so
+ * 'libs/foo/build.c' gives targets like 'foo::bar' and the returned
+ * command named 'foo' depends on all of them, what they make goes in
+ * 'foo' under the bin and lib directories, two sub builds of one build
+ * can't be in directories with the same name
+ *
+ * It's linked with -Bsymbolic so it's own functions are the ones it calls
+ * even when the build executable has one with the same name
+ *
+ * Windows still compiles and runs it as a separate process
  */
 Nobita_CMD *
 Nobita_Build_Add_Nobita(Nobita_Build *b, const char *nobita_build_src);
 
+/**
+ * Finds a target by name, names are looked up in b's namespace first
+ * then from the root build, a leading '::' only looks from the root,
+ * e.g. 'foo::bar' or '::app'
+ *
+ * Marks the build as failed if it doesn't exist
+ */
+struct nobita_target *
+Nobita_Build_Get_Target(Nobita_Build *b, const char *name);
+
+/**
+ * Adds a named pool that allows at most 'depth' processes of the actions
+ * assigned to it to run at once, on top of the usual process count
+ *
+ * Handy for links that eat a lot of memory, e.g. a 'link' pool of depth 2
+ */
+void Nobita_Build_Add_Pool(Nobita_Build *b, const char *name, size_t depth);
+
+/**
+ * Assigns every action of the following kind to the named pool, unless a
+ * target has picked it's own via 'Nobita_Target_Set_Pool()', NULL unassigns
+ *
+ * NOBITA_ACT_COMPILE      compiling a source to an object
+ *
+ * NOBITA_ACT_LINK         linking an executable or a shared library
+ *
+ * NOBITA_ACT_ARCHIVE      archiving a static library
+ *
+ * NOBITA_ACT_CUSTOM_CMD   running a custom command
+ */
+void Nobita_Build_Set_Action_Pool(
+    Nobita_Build *b, enum nobita_action a, const char *pool
+);
+
+/**
+ * Assigns the target's actions of the given kind to the named pool,
+ * e.g. a code generator command to a 'codegen' pool of depth 1
+ */
+void Nobita_Target_Set_Pool(
+    struct nobita_target *t, enum nobita_action a, const char *pool
+);
+
+/**
+ * Makes a static library a thin archive, it only points at it's objects
+ * instead of copying them in so it's quick to make, but that also means
+ * it's only good for libraries used inside this build (MSVC ignores it)
+ */
+void Nobita_Target_Set_Thin_Archive(struct nobita_target *t, bool thin);
+
+/**
+ * Compiles the C and C++ sources of a target in batches, each batch is a
+ * source in the cache dir that includes a few of them, so the headers
+ * they share are parsed once per batch instead of once per source
+ *
+ * Sources are grouped by how long they took to compile (or their size)
+ * and keep their batch from then on, so editing one only recompiles it's
+ * batch and a new source joins a batch that has room, targets with
+ * training runs are never batched
+ */
+void Nobita_Target_Set_Unity(struct nobita_target *t, bool unity);
+
+/**
+ * Compiles the target's out of date C and C++ sources that share flags and
+ * an object directory a few at a time with one compiler process, so tiny
+ * sources don't pay for a whole compiler start each, there are only as many
+ * per process as leaves every process some and up to NOBITA_COMPILE_GROUP
+ *
+ * GCC and clang run in the object directory for this, so paths in your own
+ * flags have to be absolute, sources with PGO or modules are left alone
+ */
+void Nobita_Target_Set_Batch_Compile(struct nobita_target *t, bool batch);
+
+/**
+ * Looks at the target's C and C++ sources by their tokens instead of their
+ * time, so an edit to only comments or whitespace in a source or a header
+ * it includes from the project doesn't recompile it, with debug info or a
+ * sanitizer on, or __LINE__ or assert in there, moving code to another
+ * line still does as the object would be different, and __DATE__ or
+ * __TIME__ always do
+ */
+void Nobita_Target_Set_Token_Hash(struct nobita_target *t, bool tokens);
+
+/**
+ * Keeps sources out of the unity batches, e.g. ones with static names
+ * that clash with another source, same patterns as in
+ * 'Nobita_Target_Add_Sources()'
+ */
+void Nobita_Target_Add_Unity_Exclude(struct nobita_target *t, ...);
+
+/**
+ * Precompiles a header for the target's C and C++ sources and includes it
+ * before anything else in them, it's remade when it's flags or any header
+ * it includes change and targets with the same header and flags share it
+ *
+ * GCC gets a .gch and clang a .pch with -include-pch, MSVC ignores it
+ */
+void Nobita_Target_Set_PCH(struct nobita_target *t, const char *header);
+
+/**
+ * Builds the target's C++ sources as C++20 modules, they're scanned for the
+ * modules they export and import and a module is compiled before whatever
+ * imports it, module interfaces can also be .cppm or .ixx sources and
+ * you still pass the -std flag yourself
+ *
+ * The scan is clang-scan-deps (clang 17 or later) or GCC 14's P1689 output
+ * when the compiler has it, otherwise the sources are read for their
+ * import and export lines, which doesn't see ones that come from macros
+ * or includes. A module can be imported from targets this one depends on,
+ * MSVC is not supported yet
+ */
+void Nobita_Target_Set_Modules(struct nobita_target *t, bool modules);
+
+/**
+ * Sets the linker every target links with unless it picked it's own,
+ * passed to the compiler driver as '-fuse-ld=' (MSVC ignores it)
+ *
+ * NOBITA_LD_DEFAULT       whatever the compiler uses by default
+ *
+ * NOBITA_LD_BFD           GNU ld
+ *
+ * NOBITA_LD_GOLD          GNU gold
+ *
+ * NOBITA_LD_LLD           LLVM lld
+ *
+ * NOBITA_LD_MOLD          mold
+ *
+ * NOBITA_LD_AUTO          the fastest of mold, lld and gold that works,
+ *                         or the default one if none of them do
+ *
+ * A linker that was asked for by name and doesn't work with the compiler
+ * fails the build instead of quietly falling back
+ */
+void Nobita_Build_Set_Linker(Nobita_Build *b, enum nobita_linker ld);
+
+/**
+ * Sets the linker of just this target, see 'Nobita_Build_Set_Linker()'
+ */
+void Nobita_Target_Set_Linker(struct nobita_target *t, enum nobita_linker ld);
+
+/**
+ * Compiles every target with '-gsplit-dwarf' so debug info goes into .dwo
+ * files next to the objects and the linker doesn't have to copy it, the
+ * links also get a '--gdb-index' if the linker has one (bfd doesn't),
+ * only does something with debug info on and is ignored by MSVC
+ */
+void Nobita_Build_Set_Split_Dwarf(Nobita_Build *b, bool split);
+
+/**
+ * Same as 'Nobita_Build_Set_Split_Dwarf()' for just this target
+ */
+void Nobita_Target_Set_Split_Dwarf(struct nobita_target *t, bool split);
+
+/**
+ * Turns on link time optimization for a target
+ *
+ * NOBITA_LTO_NONE         no LTO, the default
+ *
+ * NOBITA_LTO_FULL         the whole program is optimized as one module
+ *
+ * NOBITA_LTO_THIN         ThinLTO, modules are optimized in parallel and
+ *                         the results are cached in the target's cache dir
+ *                         so a link only redoes the modules that changed
+ *                         (GCC has no ThinLTO, it gets it's usual LTO which
+ *                         is already split up)
+ *
+ * The link may use up to 'jobs' threads (0 for the process count) and
+ * counts as that many processes while it runs, with GCC under a jobserver
+ * it asks the jobserver instead and ThinLTO gets one thread, MSVC only
+ * gets /GL
+ */
+void Nobita_Target_Set_LTO(
+    struct nobita_target *t, enum nobita_lto lto, size_t jobs
+);
+
+/**
+ * Adds a training run for profile guided optimization of an executable,
+ * the arguments are what an instrumented build of it is ran with, e.g.
+ *
+ * Nobita_Target_Add_Training(app, "--bench", "data/big.txt", NULL);
+ *
+ * Once a target has training runs it's instrumented build is made in it's
+ * cache dir, the runs go in parallel, their profiles are merged and the
+ * real build is compiled with them, sources are only recompiled when their
+ * own profile changed (LLVM has one profile for all of them) and the runs
+ * are only done again when the instrumented build or the arguments change,
+ * so files they read aren't tracked (MSVC isn't supported)
+ */
+void Nobita_Target_Add_Training(struct nobita_target *t, ...);
+
 /**
  * Sets the build tool via the following enums
  *
@@ -136,6 +477,44 @@ void Nobita_Target_Set_Build_Tool(
  */
 void Nobita_CMD_Add_Args(Nobita_CMD *c, ...);
 
+/**
+ * Reminder: Remember to add NULL at the end
+ *
+ * Declares the files a command reads, globs are expanded right away and a
+ * pattern that matches nothing is kept as is since another command may
+ * make it later on
+ *
+ * A command with outputs runs again when one of these is newer than it's
+ * outputs, unless their contents are still the ones it last ran with
+ */
+void Nobita_CMD_Add_Inputs(Nobita_CMD *c, ...);
+
+/**
+ * Reminder: Remember to add NULL at the end
+ *
+ * Declares the files a command makes, it's then skipped while they're all
+ * there, newer than it's inputs and made by the same arguments
+ *
+ * Any target with one of them as a source waits for the command, they
+ * don't have to exist yet when they're added with
+ *
+ * 'Nobita_Target_Add_Sources()'
+ */
+void Nobita_CMD_Add_Outputs(Nobita_CMD *c, ...);
+
+/**
+ * Watches which files the command (and anything it runs) opens, the ones
+ * it only reads are kept in the state file as it's inputs, so it's skipped
+ * on later runs until one of them changes without having to declare them
+ *
+ * It's done by preloading a small library that's built once into the
+ * cache, so it doesn't see statically linked programs, and the order
+ * against other targets still comes from 'Nobita_Target_Add_Deps()'
+ *
+ * Not supported on Windows, the command just runs every time there
+ */
+void Nobita_CMD_Set_Trace(Nobita_CMD *c, bool trace);
+
 /**
  * A way to run sprintf and it automatically adds them as arguments
  * to a target's cflags, ldflags, or cmd arguments
@@ -165,6 +544,28 @@ void Nobita_Target_Add_Cflags(struct nobita_target *t, ...);
  */
 void Nobita_Target_Add_Sources(struct nobita_target *t, ...);
 
+/**
+ * Reminder: Remember to add NULL at the end
+ *
+ * Embeds files (same patterns as in 'Nobita_Target_Add_Sources()') into the
+ * target, each one is assembled with .incbin into it's own object instead
+ * of being turned into a C array and compiled, and it's only assembled
+ * again when it's contents change
+ *
+ * header is written to the include directory, it declares for each file
+ *
+ * extern const unsigned char name[], name_end[];
+ *
+ * and a name_size macro, where name is the path as it was given with
+ * anything but letters and digits as '_', e.g. 'assets/logo.png' is
+ * assets_logo_png, a target has one header so the last one given is used
+ *
+ * Needs NOBITA_BT_GCC or NOBITA_BT_LLVM, MSVC's assembler has no .incbin
+ */
+void Nobita_Target_Add_Resources(
+    struct nobita_target *t, const char *header, ...
+);
+
 /**
  * Add link flags to your target, must be ended by NULL
  *
@@ -274,8 +675,9 @@ bool nobita_dir_exist(const char *path);
 #endif /* NOBITA_H */
 
 /* #define NOBITA_IMPL */
-#ifdef NOBITA_IMPL
+#if defined(NOBITA_IMPL) && !defined(NOBITA_SUBBUILD)
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -284,19 +686,40 @@ bool nobita_dir_exist(const char *path);
 
 #ifndef _WIN32
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef pid_t nobita_pid;
+#ifdef __linux__
+typedef cpu_set_t nobita_cpu_mask;
+#else
+typedef int nobita_cpu_mask;
+#endif /* __linux__ */
+typedef int nobita_pipe;
+#define NOBITA_PIPE_NONE -1
 #define NOBITA_PATHSEP "/"
 #define NOBITA_EXECUT_EXT ".elf"
 #define NOBITA_SHARED_EXT ".so"
 #define NOBITA_STATIC_EXT ".a"
 
+/* Where stat keeps the modification time down to nanoseconds */
+#if defined(__APPLE__)
+#define NOBITA_MTIM st_mtimespec
+#else
+#define NOBITA_MTIM st_mtim
+#endif /* __APPLE__ */
+
 #else
 
 #include <stdint.h>
@@ -305,6 +728,9 @@ typedef pid_t nobita_pid;
 #include <Windows.h>
 
 typedef HANDLE            nobita_pid;
+typedef DWORD_PTR         nobita_cpu_mask;
+typedef HANDLE            nobita_pipe;
+#define NOBITA_PIPE_NONE  NULL
 #define NOBITA_PATHSEP    "\\"
 #define NOBITA_EXECUT_EXT ".exe"
 #define NOBITA_SHARED_EXT ".dll"
@@ -312,6 +738,30 @@ typedef HANDLE            nobita_pid;
 
 #endif /* _WIN32 */
 
+#define NOBITA_ACT_COUNT (NOBITA_ACT_CUSTOM_CMD + 1)
+
+/* Commands longer than this many bytes get their arguments from a file */
+#ifndef NOBITA_RSP_THRESHOLD
+#define NOBITA_RSP_THRESHOLD 8192
+#endif /* NOBITA_RSP_THRESHOLD */
+
+/* At most this many sources are compiled by one process at once */
+#ifndef NOBITA_COMPILE_GROUP
+#define NOBITA_COMPILE_GROUP 16
+#endif /* NOBITA_COMPILE_GROUP */
+
+/* Unity batches are filled up to about this many seconds of compiling */
+#ifndef NOBITA_UNITY_BATCH
+#define NOBITA_UNITY_BATCH 2.0
+#endif /* NOBITA_UNITY_BATCH */
+
+enum nobita_pin {
+    NOBITA_PIN_NONE,
+    NOBITA_PIN_NUMA,
+    NOBITA_PIN_CORE,
+    NOBITA_PIN_LINK,
+};
+
 enum nobita_target_type {
     NOBITA_EXECUTABLE,
     NOBITA_SHARED_LIB,
@@ -324,11 +774,184 @@ struct nobita_header {
     char *header;
 };
 
+struct nobita_pool {
+    char *name;
+    size_t depth;
+    size_t running;
+};
+
+struct nobita_cpu_set {
+    nobita_cpu_mask mask;
+    size_t running;
+};
+
+struct nobita_rsp {
+    size_t buf_used;
+    size_t buf_size;
+    char *buf;
+};
+
+/* A profile's contents, hashed once it's final for the rest of the run */
+struct nobita_profile_hash {
+    char *path;
+    uint64_t hash;
+};
+
+struct nobita_linker_probe {
+    const char *cc;
+    enum nobita_linker ld;
+    bool works;
+};
+
+enum nobita_scanner {
+    NOBITA_SCAN_TEXT,
+    NOBITA_SCAN_GCC,
+    NOBITA_SCAN_CLANG,
+};
+
+struct nobita_scanner_probe {
+    const char *cxx;
+    enum nobita_scanner scanner;
+};
+
+enum nobita_probe_kind {
+    NOBITA_PROBE_HEADER,
+    NOBITA_PROBE_SYMBOL,
+    NOBITA_PROBE_COMPILE,
+    NOBITA_PROBE_PKG_CFLAGS,
+    NOBITA_PROBE_PKG_LIBS,
+};
+
+/* A check of a config, output is what pkg-config said */
+struct nobita_probe {
+    enum nobita_probe_kind kind;
+    const char *define;
+    const char *arg;
+    const char *symbol;
+    char key[17];
+    bool found;
+    char *output;
+};
+
+/* A C++ source of a target with modules, what it provides and imports */
+struct nobita_module_unit {
+    char *modmap;
+    char *bmi_dir;
+    char *name;
+    char *bmi;
+
+    size_t imports_used;
+    size_t imports_size;
+    char **imports;
+};
+
+struct nobita_job {
+    enum nobita_action action;
+    struct nobita_target *t;
+    const char *label;
+    const char *src;
+    const char *profile;
+    const char *depfile;
+    char *out;
+    void (*fn)(struct nobita_job *j);
+
+    size_t cmd_used;
+    size_t cmd_size;
+    char **cmd;
+
+    size_t inputs_used;
+    size_t inputs_size;
+    char **inputs;
+
+    size_t deps_used;
+    size_t deps_size;
+    struct nobita_job **deps;
+
+    size_t users_used;
+    size_t users_size;
+    struct nobita_job **users;
+
+    size_t group_used;
+    size_t group_size;
+    struct nobita_job **group;
+
+    struct nobita_module_unit *unit;
+    struct nobita_probe *probe;
+    char *rsp;
+    char *rsp_cmd[3];
+    char *trace;
+    char *env[3];
+    size_t traced_from;
+    char fingerprint[17];
+    char tokens[18];
+    char lto_jobs[48];
+
+    size_t index;
+    size_t waiting;
+    size_t rss;
+    size_t threads;
+    double cost;
+    double priority;
+    bool checked;
+    bool dirty;
+    bool ran;
+    bool done;
+    bool failed;
+};
+
+/* An in process step running on it's own thread */
+struct nobita_fn_run {
+#ifndef _WIN32
+    pthread_t thread;
+    int out;
+#endif /* _WIN32 */
+    Nobita_Fn fn;
+    void *arg;
+    bool ok;
+};
+
+struct nobita_proc {
+    nobita_pid pid;
+    struct nobita_fn_run *fn;
+    char *name;
+    char *key;
+    struct nobita_pool *pool;
+    struct nobita_job *job;
+    struct nobita_cpu_set *cpu_set;
+    size_t rss;
+    size_t threads;
+    double start;
+    bool killed;
+
+    nobita_pipe out;
+    size_t output_used;
+    size_t output_size;
+    char *output;
+};
+
+struct nobita_state_entry {
+    uint64_t hash;
+    char *kind;
+    char *key;
+    char *value;
+    bool used;
+};
+
 struct nobita_target {
     char *name;
-    bool built;
-    bool rebuilt;
+    bool planning;
     bool is_cpp;
+    bool thin_archive;
+    bool unity;
+    bool batch_compile;
+    bool token_hash;
+    bool split_dwarf;
+    bool trace;
+    Nobita_Fn fn;
+    void *fn_arg;
+    enum nobita_linker linker;
+    enum nobita_lto lto;
+    size_t lto_jobs;
     enum nobita_target_type target_type;
 
     struct {
@@ -347,6 +970,7 @@ struct nobita_target {
 
         char *ar;
         char *ar_opts;
+        char *ar_thin_opts;
     } comp_opts;
 
     size_t cflags_used;
@@ -381,10 +1005,63 @@ struct nobita_target {
     size_t deps_size;
     void **deps;
 
+    size_t unity_exclude_used;
+    size_t unity_exclude_size;
+    char **unity_exclude;
+
+    size_t trainings_used;
+    size_t trainings_size;
+    char ***trainings;
+    char *pgo_use[3];
+    char *pgo_profile;
+    struct nobita_job *pgo;
+
+    char *pch;
+    struct nobita_job *pch_jobs[2];
+
+    bool modules;
+    struct nobita_job *modules_job;
+
+    char *config;
+    size_t probes_used;
+    size_t probes_size;
+    struct nobita_probe *probes;
+
+    size_t compile_inputs_used;
+    size_t compile_inputs_size;
+    char **compile_inputs;
+
+    size_t link_inputs_used;
+    size_t link_inputs_size;
+    char **link_inputs;
+
+    size_t cmd_inputs_used;
+    size_t cmd_inputs_size;
+    char **cmd_inputs;
+
+    size_t cmd_outputs_used;
+    size_t cmd_outputs_size;
+    char **cmd_outputs;
+
+    const char *res_header;
+    size_t resources_used;
+    size_t resources_size;
+    char **resources;
+
+    struct nobita_pool *pools[NOBITA_ACT_COUNT];
+    struct nobita_job *gen;
+    struct nobita_job *job;
     struct nobita_build *b;
 };
 
 struct nobita_build {
+    struct nobita_build *root;
+    char *ns;
+
+    size_t subbuilds_used;
+    size_t subbuilds_size;
+    void **subbuilds;
+
     size_t deps_used;
     size_t deps_size;
     void **deps;
@@ -393,17 +1070,83 @@ struct nobita_build {
     size_t free_later_size;
     void **free_later;
 
-    size_t proc_queue_used;
-    size_t proc_queue_size;
-    nobita_pid *proc_queue;
+    size_t procs_used;
+    size_t procs_size;
+    struct nobita_proc *procs;
+    bool output_on_failure;
+
+#ifndef _WIN32
+    size_t polls_used;
+    size_t polls_size;
+    struct pollfd *polls;
+#endif /* _WIN32 */
 
-    size_t proc_names_used;
-    size_t proc_names_size;
-    char **proc_names;
+    size_t jobs_used;
+    size_t jobs_size;
+    struct nobita_job **jobs;
+
+    size_t ready_used;
+    size_t ready_size;
+    struct nobita_job **ready;
+
+    size_t keep_going;
+    size_t jobs_failed;
+    size_t jobs_skipped;
+
+    bool mem_check;
+    size_t mem_budget;
+    double max_load;
+    bool force;
+    bool recheck;
+
+    enum nobita_pin pin;
+    size_t pin_next;
+    size_t cpu_sets_used;
+    size_t cpu_sets_size;
+    struct nobita_cpu_set *cpu_sets;
+
+    enum nobita_linker linker;
+    bool split_dwarf;
+    size_t pchs_used;
+    size_t pchs_size;
+    struct nobita_job **pchs;
+    struct nobita_job *trace_job;
+    size_t scanner_probes_used;
+    size_t scanner_probes_size;
+    struct nobita_scanner_probe *scanner_probes;
+    size_t linker_probes_used;
+    size_t linker_probes_size;
+    struct nobita_linker_probe *linker_probes;
+
+    size_t profile_hashes_used;
+    size_t profile_hashes_size;
+    struct nobita_profile_hash *profile_hashes;
+
+    size_t state_used;
+    size_t state_size;
+    struct nobita_state_entry *state;
+    size_t state_index_size;
+    size_t *state_index;
+    char *state_path;
+    bool state_dirty;
+    bool state_prune;
+
+    size_t pools_used;
+    size_t pools_size;
+    struct nobita_pool **pools;
+    struct nobita_pool *action_pools[NOBITA_ACT_COUNT];
+
+    int js_read;
+    int js_write;
+    char *js_fifo;
+
+    size_t js_tokens_used;
+    size_t js_tokens_size;
+    char *js_tokens;
 
     int argc;
     char **argv;
-    bool was_self_rebuilt;
+    enum nobita_rebuild_profile rebuild_profile;
 
     char *ced;
     char *cwd;
@@ -416,14 +1159,96 @@ struct nobita_build {
 static struct nobita_target *
 nobita_build_add_target(struct nobita_build *b, const char *name);
 
-static nobita_pid nobita_proc_exec(char **cmd, char *joined_cmd);
-static int nobita_proc_wait(nobita_pid pid, bool pause);
+static nobita_pid
+nobita_proc_exec(
+    char **cmd, char *joined_cmd, const char *cwd, char **env,
+    const nobita_cpu_mask *mask, nobita_pipe *out
+);
 
-static void nobita_proc_append(struct nobita_build *b, char **cmd);
+static void nobita_proc_append(
+    struct nobita_build *b, char **cmd, struct nobita_target *t,
+    enum nobita_action action, const char *key
+);
+static void nobita_proc_start(
+    struct nobita_build *b, char **cmd, const char *cwd,
+    enum nobita_action action, struct nobita_pool *pool, size_t rss,
+    const char *key, struct nobita_job *j
+);
+static void
+nobita_job_done(struct nobita_build *b, struct nobita_job *j, bool ran);
+static void nobita_job_failed(struct nobita_build *b, struct nobita_job *j);
+static bool nobita_job_cmd_changed(struct nobita_job *j);
+static void nobita_glob_each(
+    const char *pattern, void (*fn)(const char *path, void *arg), void *arg
+);
+static struct nobita_pool *
+nobita_target_pool(struct nobita_target *t, enum nobita_action a);
 static void nobita_proc_wait_one(struct nobita_build *b);
 static void nobita_proc_wait_all(struct nobita_build *b);
+static bool nobita_proc_reap(struct nobita_build *b, bool pause);
+static void nobita_proc_poll(struct nobita_build *b, int timeout);
+static size_t nobita_mem_predict(
+    struct nobita_build *b, enum nobita_action action, const char *key
+);
+static bool nobita_mem_admit(struct nobita_build *b, size_t rss);
+static bool nobita_load_too_high(struct nobita_build *b);
+static size_t nobita_default_proc_count(void);
+static void nobita_pin_init(struct nobita_build *b);
+static struct nobita_cpu_set *
+nobita_pin_pick(struct nobita_build *b, enum nobita_action action);
+
+static const char *
+nobita_state_get(struct nobita_build *b, const char *kind, const char *key);
+#ifdef __GNUC__
+static void nobita_state_setf(
+    struct nobita_build *b, const char *kind, const char *key,
+    const char *fmt, ...
+) __attribute__((format(printf, 4, 5)));
+#else
+static void nobita_state_setf(
+    struct nobita_build *b, const char *kind, const char *key,
+    const char *fmt, ...
+);
+#endif /* __GNUC__ */
 
-static void nobita_build_target(struct nobita_target *t);
+static void nobita_jobserver_client_init(
+    struct nobita_build *b, bool proc_count_given
+);
+static void
+nobita_jobserver_server_init(struct nobita_build *b, const char *style);
+static bool nobita_jobserver_acquire(struct nobita_build *b);
+static void nobita_jobserver_release(struct nobita_build *b);
+static void nobita_jobserver_wait(struct nobita_build *b);
+static void nobita_jobserver_free(struct nobita_build *b);
+
+static void nobita_plan_target(struct nobita_target *t);
+static void nobita_run_jobs(struct nobita_build *b);
+static void nobita_run_bench(struct nobita_build *b, size_t rounds);
+static void nobita_job_free(struct nobita_job *j);
+static size_t nobita_file_size(const char *path);
+static double nobita_now(void);
+static bool nobita_target_is_named(struct nobita_target *t, const char *qn);
+static bool nobita_depfile_is_newer(const char *depfile, const char *output);
+static void nobita_group_done(
+    struct nobita_build *b, struct nobita_job *j, double took, bool killed
+);
+static void nobita_probe_done(
+    struct nobita_build *b, struct nobita_probe *p, bool found,
+    const char *output, size_t n
+);
+static void nobita_job_poison(struct nobita_build *b, struct nobita_job *j);
+static void nobita_trace_done(struct nobita_build *b, struct nobita_job *j);
+static const char *nobita_job_key(struct nobita_job *j);
+static void nobita_rsp_quote(
+    struct nobita_rsp *r, const char *arg, enum nobita_build_tool bt
+);
+static bool nobita_build_file_is_stale(
+    const char *src, const char *out, const char *depfile
+);
+static void nobita_compile_build_file(
+    struct nobita_build *b, const char *src, const char *out,
+    const char *depfile, bool shared
+);
 static char *nobita_getcwd(void);
 static char *nobita_getced(const char *arv0);
 static char *nobita_strdup(const char *);
@@ -501,7 +1326,7 @@ static size_t nobita_max_proc_count = 4;
 
 void Nobita_Free_Later(Nobita_Build *b, void *ptr)
 {
-    vector_append(b, free_later, ptr);
+    vector_append(b->root, free_later, ptr);
 }
 
 Nobita_Exe *Nobita_Build_Add_Exe(Nobita_Build *b, const char *name)
@@ -559,1043 +1384,7461 @@ Nobita_CMD *Nobita_Build_Add_CMD(Nobita_Build *b, const char *name)
 }
 
 Nobita_CMD *
-Nobita_Build_Add_Nobita(Nobita_Build *b, const char *nobita_build_src)
+Nobita_Build_Add_Fn(Nobita_Build *b, const char *name, Nobita_Fn fn, void *arg)
 {
-    char *exe =
-        nobita_strjoinl(NOBITA_PATHSEP, Nobita_GetCed(b), nobita_build_src);
-    *strrchr(exe, '.') = 0;
+    if (nobita_build_failed)
+        return NULL;
 
-    Nobita_CMD *run = Nobita_Build_Add_CMD(b, exe);
+    Nobita_CMD *c = nobita_build_add_target(b, name);
+    if (c == NULL)
+        return c;
 
-    if (nobita_is_a_newer(nobita_build_src, exe)) {
-        Nobita_CMD *cmd = Nobita_Build_Add_CMD(b, nobita_build_src);
-#if defined(__clang__)
-        Nobita_CMD_Add_Args(cmd, "clang", "-Wall", "-Wpedantic", "-Wextra",
-            "-O3", "-g", "-fsanitize=address", "-o", exe, nobita_build_src,
-            NULL
-        );
-#elif defined(__GNUC__)
-        Nobita_CMD_Add_Args(cmd, "gcc", "-Wall", "-Wpedantic", "-Wextra",
-            "-O3", "-g", "-fsanitize=address", "-o", exe, nobita_build_src,
-            NULL
-        );
-#else
-        Nobita_CMD_Add_Args(cmd, "cl", "/Wall", "/O2", "/Zi",
-            "/fsanitize=address", "-Fe:", exe, nobita_build_src,
-            NULL
-        );
-#endif
-        Nobita_Target_Add_Deps(run, cmd, NULL);
-    }
+    c->target_type = NOBITA_CUSTOM_CMD;
+    c->fn = fn;
+    c->fn_arg = arg;
+    vector_append(c, custom_cmd, nobita_strdup(name));
+    return c;
+}
 
-    Nobita_CMD_Add_Args(run, exe, NULL);
-    Nobita_Target_Add_Fmt_Arg(
-        run, NOBITA_T_CUSTOM_CMD, "%lu", nobita_max_proc_count
-    );
-    Nobita_CMD_Add_Args(run, b->prefix, NULL);
-    free(exe);
-    return run;
+Nobita_Config *Nobita_Build_Add_Config(Nobita_Build *b, const char *header)
+{
+    if (nobita_build_failed)
+        return NULL;
+
+    Nobita_Config *c = nobita_build_add_target(b, header);
+    if (c == NULL)
+        return c;
+
+    c->target_type = NOBITA_CUSTOM_CMD;
+    c->config = nobita_strjoinl(NOBITA_PATHSEP, b->include, header, NULL);
+    Nobita_Free_Later(b, c->config);
+    return c;
 }
 
-void Nobita_Target_Set_Build_Tool(
-    struct nobita_target *t, enum nobita_build_tool bt
+/* Adds a check to a config, the strings are copied */
+static void nobita_config_add(
+    Nobita_Config *c, enum nobita_probe_kind kind, const char *define,
+    const char *arg, const char *symbol
 )
 {
     if (nobita_build_failed)
         return;
 
-    t->comp_opts.bt = bt;
-    if (bt != NOBITA_BT_MSVC) {
-        Nobita_Target_Add_Fmt_Arg(t, NOBITA_T_LDFLAGS, "%s%s", "-L", t->b->lib);
-        Nobita_Target_Add_Fmt_Arg(
-            t, NOBITA_T_CFLAGS, "%s%s", "-I", t->b->include
-        );
-    } else {
-        vector_append(t, ldflags, "/link");
-        Nobita_Target_Add_Fmt_Arg(
-            t, NOBITA_T_CFLAGS, "%s%s", "/I", t->b->include
-        );
-        Nobita_Target_Add_Fmt_Arg(
-            t, NOBITA_T_LDFLAGS, "%s%s", "/LIBPATH:", t->b->lib
-        );
+    if (c == NULL || c->config == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Checks need a config target\n");
+        return;
     }
 
-    switch (bt) {
-    case NOBITA_BT_GCC:
-        t->comp_opts.as = "as";
-        t->comp_opts.cc = "gcc";
-        t->comp_opts.cxx = "g++";
-        t->comp_opts.to_exe = "-o";
-        t->comp_opts.to_obj = "-c";
-        t->comp_opts.rename_obj = NULL;
-        t->comp_opts.to_lib = "-shared";
+    struct nobita_probe p = {.kind = kind};
+    const char *strs[] = {define, arg, symbol};
+    const char **dest[] = {&p.define, &p.arg, &p.symbol};
+    for (size_t i = 0; i < 3; i++) {
+        char *copy = (strs[i] != NULL) ? nobita_strdup(strs[i]) : NULL;
+        Nobita_Free_Later(c->b, copy);
+        *dest[i] = copy;
+    }
 
-        t->comp_opts.inc_dir = "-I";
-        t->comp_opts.lib_dir = "-L";
+    vector_append(c, probes, p);
+}
 
-        t->comp_opts.ar = "ar";
-        t->comp_opts.ar_opts = "rcs";
-        break;
-    case NOBITA_BT_LLVM:
-        t->comp_opts.as = "llvm-as";
-        t->comp_opts.cc = "clang";
-        t->comp_opts.cxx = "clang++";
-        t->comp_opts.to_exe = "-o";
-        t->comp_opts.to_obj = "-c";
-        t->comp_opts.rename_obj = NULL;
-        t->comp_opts.to_lib = "-shared";
+void Nobita_Check_Header(
+    Nobita_Config *c, const char *define, const char *header
+)
+{
+    nobita_config_add(c, NOBITA_PROBE_HEADER, define, header, NULL);
+}
 
-        t->comp_opts.inc_dir = "-I";
-        t->comp_opts.lib_dir = "-L";
+void Nobita_Check_Symbol(
+    Nobita_Config *c, const char *define, const char *symbol,
+    const char *header
+)
+{
+    nobita_config_add(c, NOBITA_PROBE_SYMBOL, define, header, symbol);
+}
 
-        t->comp_opts.ar = "llvm-ar";
-        t->comp_opts.ar_opts = "rcs";
-        break;
-    case NOBITA_BT_MSVC:
-        t->comp_opts.as = "masm.exe";
-        t->comp_opts.cc = "cl.exe";
-        t->comp_opts.cxx = "cl.exe";
-        t->comp_opts.to_exe = "/Fe:";
-        t->comp_opts.to_obj = "/c";
-        t->comp_opts.rename_obj = "/Fo:";
-        t->comp_opts.to_lib = "/LD";
+void Nobita_Try_Compile(
+    Nobita_Config *c, const char *define, const char *code
+)
+{
+    nobita_config_add(c, NOBITA_PROBE_COMPILE, define, code, NULL);
+}
 
-        t->comp_opts.inc_dir = "/I";
-        t->comp_opts.lib_dir = "/LIBPATH:";
+void Nobita_Check_Pkg_Config(
+    Nobita_Config *c, const char *define, const char *package
+)
+{
+    nobita_config_add(c, NOBITA_PROBE_PKG_CFLAGS, define, package, NULL);
+    nobita_config_add(c, NOBITA_PROBE_PKG_LIBS, NULL, package, NULL);
+}
 
-        t->comp_opts.ar = "lib.exe";
-        t->comp_opts.ar_opts = "/OUT:";
-        break;
-    }
+/* Where a config keeps the flags pkg-config gave for a package */
+static char *
+nobita_config_pkg_file(Nobita_Config *c, const char *package, bool libs)
+{
+    char *name = nobita_strjoinl(
+        "", package, (libs) ? ".libs" : ".cflags", NULL
+    );
+
+    char *path = nobita_strjoinl(
+        NOBITA_PATHSEP, c->b->ced, "nobita-cache", c->name, "pkg", name, NULL
+    );
+
+    free(name);
+    return path;
 }
 
-void Nobita_Target_Add_Cflags(struct nobita_target *t, ...)
+void Nobita_Target_Add_Pkg_Config(
+    struct nobita_target *t, Nobita_Config *c, const char *package
+)
 {
     if (nobita_build_failed)
         return;
 
-    va_list va;
-    va_start(va, t);
+    bool checked = false;
+    for (size_t i = 0; c != NULL && i < c->probes_used; i++)
+        checked = checked || (c->probes[i].kind == NOBITA_PROBE_PKG_LIBS &&
+            strcmp(c->probes[i].arg, package) == 0);
 
-    char *arg = va_arg(va, char *);
-    while (arg != NULL) {
-        vector_append(t, cflags, arg);
-        arg = va_arg(va, char *);
+    if (!checked)
+        Nobita_Check_Pkg_Config(c, NULL, package);
+
+    for (size_t i = 0; i < 2 && !nobita_build_failed; i++) {
+        char *file = nobita_config_pkg_file(c, package, i == 1);
+        char *arg = nobita_strjoinl("", "@", file, NULL);
+        Nobita_Free_Later(t->b, file);
+        Nobita_Free_Later(t->b, arg);
+        if (i == 0) {
+            vector_append(t, cflags, arg);
+            vector_append(t, compile_inputs, file);
+        } else {
+            vector_append(t, ldflags, arg);
+            vector_append(t, link_inputs, file);
+        }
     }
 
-    va_end(va);
+    vector_append(t, deps, c);
 }
 
-void Nobita_Target_Add_Sources(struct nobita_target *t, ...)
+Nobita_CMD *
+Nobita_Build_Add_Nobita(Nobita_Build *b, const char *nobita_build_src)
 {
     if (nobita_build_failed)
-        return;
+        return NULL;
 
-    char *append_cache_dir = NULL;
-    switch (t->target_type) {
-        case NOBITA_EXECUTABLE:
-            append_cache_dir = "execut";
-            break;
-        case NOBITA_SHARED_LIB:
-            append_cache_dir = "shared";
-            break;
-        case NOBITA_STATIC_LIB:
-            append_cache_dir = "static";
-            break;
-        case NOBITA_CUSTOM_CMD:
-            append_cache_dir = "custom";
-            break;
+#ifdef _WIN32
+    char *exe =
+        nobita_strjoinl(NOBITA_PATHSEP, Nobita_GetCed(b), nobita_build_src, NULL);
+    *strrchr(exe, '.') = 0;
+
+    Nobita_CMD *run = Nobita_Build_Add_CMD(b, exe);
+
+    if (nobita_is_a_newer(nobita_build_src, exe)) {
+        Nobita_CMD *cmd = Nobita_Build_Add_CMD(b, nobita_build_src);
+        Nobita_CMD_Add_Args(cmd, "cl", "/Wall", "/O2", "/Zi",
+            "/fsanitize=address", "-Fe:", exe, nobita_build_src,
+            NULL
+        );
+        Nobita_Target_Add_Deps(run, cmd, NULL);
     }
 
-    va_list va;
-    va_start(va, t);
+    Nobita_CMD_Add_Args(run, exe, NULL);
+    Nobita_Target_Add_Fmt_Arg(
+        run, NOBITA_T_CUSTOM_CMD, "%zu", nobita_max_proc_count
+    );
+    Nobita_CMD_Add_Args(run, b->prefix, NULL);
+    free(exe);
+    return run;
+#else
+    struct nobita_build *root = b->root;
+    Nobita_CMD *group = NULL;
+    char *src = (nobita_build_src[0] == *NOBITA_PATHSEP)
+        ? nobita_strdup(nobita_build_src)
+        : nobita_strjoinl(NOBITA_PATHSEP, b->ced, nobita_build_src, NULL);
+    char *dir = nobita_strdup(src);
+    char *file = nobita_strdup(strrchr(src, *NOBITA_PATHSEP) + 1);
+    char *cwd = nobita_getcwd();
+    if (nobita_build_failed)
+        goto end;
 
-    char *arg = va_arg(va, char *);
-    while (arg != NULL) {
-#ifndef _WIN32
-        glob_t g;
-        if (glob(arg, 0, NULL, &g) != 0) {
+    nobita_dirname(dir);
+    char *ns = strrchr(dir, *NOBITA_PATHSEP);
+    ns = (ns == NULL) ? dir : ns + 1;
+    if (strrchr(file, '.') != NULL)
+        *strrchr(file, '.') = 0;
+
+    char *cache = nobita_strjoinl(NOBITA_PATHSEP, dir, "nobita-cache", NULL);
+    char *so = nobita_strjoinl(
+        "", cache, NOBITA_PATHSEP, file, NOBITA_SHARED_EXT, NULL
+    );
+    char *depfile = nobita_strjoinl("", so, ".d", NULL);
+    char *qns = (b->ns == NULL)
+        ? nobita_strdup(ns)
+        : nobita_strjoinl("::", b->ns, ns, NULL);
+
+    /* Another sub build in a directory of the same name would share it */
+    for (size_t i = 0; i < root->deps_used && qns != NULL; i++) {
+        struct nobita_target *t = root->deps[i];
+        if ((t->b->ns != NULL && strcmp(t->b->ns, qns) == 0) ||
+                nobita_target_is_named(t, qns)) {
             nobita_build_failed = true;
-            va_end(va);
             fprintf(stderr,
-                "\tNOBITA\tERROR: Glob error for pattern %s in add source "
-                "to target %s\n", arg, t->name
+                "\tNOBITA\tERROR: The nobita build %s would be namespaced "
+                "as %s, which is already taken\n", src, qns
             );
 
-            return;
+            break;
         }
+    }
 
-        for (size_t ii = 0; ii < g.gl_pathc; ii++) {
-            char *s = nobita_strjoinl(
-                NOBITA_PATHSEP, t->b->ced, g.gl_pathv[ii], NULL
-            );
-            char *o = nobita_strjoinl(
-                NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
-                append_cache_dir, g.gl_pathv[ii], NULL
-            );
-            char *i = strrchr(o, '.');
-            i[1]    = 'o';
-            i[2]    = 0;
+    if (nobita_build_failed)
+        goto free_paths;
+
+    if (nobita_build_file_is_stale(src, so, depfile)) {
+        nobita_mkdir_recursive(cache);
+        printf("\tLD\t%s\n", so);
+        nobita_compile_build_file(b, src, so, depfile, true);
+        if (nobita_build_failed)
+            goto free_paths;
+    }
 
-            vector_append(t, sources, s);
-            vector_append(t, objects, o);
-            nobita_dirname(o);
-            nobita_mkdir_recursive(o);
-            *strchr(o, 0) = *NOBITA_PATHSEP;
-        }
+    void *handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not load the nobita build %s (%s), the "
+            "build executable has to be linked with -rdynamic which "
+            "'Nobita_Try_Rebuild()' does\n", so, dlerror()
+        );
 
-        globfree(&g);
-#else
-        WIN32_FIND_DATAA d = {0};
-        HANDLE f = FindFirstFileA(arg, &d);
-        if (f == INVALID_HANDLE_VALUE) {
-            nobita_build_failed = true;
-            va_end(va);
-            fprintf(stderr,
-                "\tNOBITA\tERROR: The glob pattern %s for custom command %s is "
-                "invalid!\n", arg, t->name
-            );
+        goto free_paths;
+    }
 
-            return;
-        }
+    vector_append(root, subbuilds, handle);
+    void (*sub_build)(Nobita_Build *) = NULL;
+    *(void **)&sub_build = dlsym(handle, "build");
+    struct nobita_build *sub = calloc(1, sizeof(*sub));
+    if (sub_build == NULL || sub == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not set up the nobita build %s\n", src
+        );
 
-        char *argdir = nobita_strdup(arg);
-        nobita_dirname(argdir);
-        char *s = nobita_strjoinl(
-            NOBITA_PATHSEP, t->b->ced, argdir, d.cFileName, NULL
+        free(sub);
+        goto free_paths;
+    }
+
+    sub->root = root;
+    sub->ns = qns;
+    qns = NULL;
+    sub->ced = nobita_strdup(dir);
+    sub->cwd = sub->ced;
+    sub->prefix = root->prefix;
+    sub->include = root->include;
+    sub->bin = nobita_strjoinl(NOBITA_PATHSEP, b->bin, ns, NULL);
+    sub->lib = nobita_strjoinl(NOBITA_PATHSEP, b->lib, ns, NULL);
+    sub->argc = root->argc;
+    sub->argv = root->argv;
+    sub->rebuild_profile = root->rebuild_profile;
+    Nobita_Free_Later(root, sub);
+    Nobita_Free_Later(root, sub->ns);
+    Nobita_Free_Later(root, sub->ced);
+    Nobita_Free_Later(root, sub->bin);
+    Nobita_Free_Later(root, sub->lib);
+    if (nobita_build_failed)
+        goto free_paths;
+
+    /* It's outputs go in their own directories so the names can't clash */
+    nobita_mkdir_recursive(sub->bin);
+    nobita_mkdir_recursive(sub->lib);
+
+    /*
+     * The sub build's globs are relative to its own directory, and whatever
+     * it registers lands in the root's target list so it all shares one
+     * process queue
+     */
+    size_t first = root->deps_used;
+    if (chdir(dir) != 0) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not enter %s (%s)\n", dir, strerror(errno)
         );
-        vector_append(t, sources, s);
 
-        char *i = strrchr(d.cFileName, '.');
-        i[1]    = 'o';
-        i[2]    = 'b';
-        i[3]    = 'j';
-        i[4]    = 0;
-        char *o = nobita_strjoinl(
-            NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
-            append_cache_dir, argdir, d.cFileName, NULL
+        goto free_paths;
+    }
+
+    printf("\tNOBITA\tLOADING %s\n", sub->ns);
+    sub_build(sub);
+    if (chdir(cwd) != 0) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not go back to %s (%s)\n", cwd,
+            strerror(errno)
         );
-        vector_append(t, objects, o);
-        nobita_dirname(o);
-        nobita_mkdir_recursive(o);
-        *strchr(o, 0) = *NOBITA_PATHSEP;
 
-        while (FindNextFileA(f, &d)) {
-            char *s = nobita_strjoinl(
-                NOBITA_PATHSEP, t->b->ced, argdir, d.cFileName, NULL
-            );
-            vector_append(t, sources, s);
+        goto free_paths;
+    }
 
-            char *i = strrchr(d.cFileName, '.');
-            i[1]    = 'o';
-            i[2]    = 'b';
-            i[3]    = 'j';
-            i[4]    = 0;
-            char *o = nobita_strjoinl(
-                NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
-                append_cache_dir, argdir, d.cFileName, NULL
-            );
+    size_t last = root->deps_used;
 
-            vector_append(t, objects, o);
-            nobita_dirname(o);
-            nobita_mkdir_recursive(o);
-            *strchr(o, 0) = *NOBITA_PATHSEP;
-        }
+    group = Nobita_Build_Add_CMD(b, ns);
+    for (size_t i = first; i < last && !nobita_build_failed; i++)
+        vector_append(group, deps, root->deps[i]);
 
-        free(argdir);
-        CloseHandle(f);
+free_paths:
+    free(cache);
+    free(so);
+    free(depfile);
+    free(qns);
+end:
+    free(src);
+    free(dir);
+    free(file);
+    free(cwd);
+    return group;
 #endif /* _WIN32 */
+}
+
+static bool nobita_target_is_named(struct nobita_target *t, const char *qn)
+{
+    const char *ns = t->b->ns;
+    if (ns == NULL)
+        return strcmp(t->name, qn) == 0;
+
+    size_t len = strlen(ns);
+    return strncmp(qn, ns, len) == 0 && strncmp(qn + len, "::", 2) == 0 &&
+        strcmp(qn + len + 2, t->name) == 0;
+}
+
+struct nobita_target *
+Nobita_Build_Get_Target(Nobita_Build *b, const char *name)
+{
+    if (nobita_build_failed)
+        return NULL;
+
+    /* Relative names are looked up in b's namespace first, then the root's */
+    struct nobita_build *root = b->root;
+    bool absolute = strncmp(name, "::", 2) == 0;
+    char *local = (b->ns == NULL || absolute)
+        ? NULL
+        : nobita_strjoinl("::", b->ns, name, NULL);
+    const char *global = (absolute) ? name + 2 : name;
+
+    struct nobita_target *found = NULL;
+    for (size_t i = 0; i < root->deps_used && local != NULL; i++) {
+        if (nobita_target_is_named(root->deps[i], local)) {
+            found = root->deps[i];
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < root->deps_used && found == NULL; i++)
+        if (nobita_target_is_named(root->deps[i], global))
+            found = root->deps[i];
+
+    free(local);
+    if (found == NULL) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: There is no target named %s\n", name
+        );
+    }
+
+    return found;
+}
+
+
+static struct nobita_pool *
+nobita_build_find_pool(struct nobita_build *b, const char *name)
+{
+    if (name == NULL)
+        return NULL;
+
+    b = b->root;
+    for (size_t i = 0; i < b->pools_used; i++)
+        if (strcmp(b->pools[i]->name, name) == 0)
+            return b->pools[i];
+
+    nobita_build_failed = true;
+    fprintf(stderr, "\tNOBITA\tERROR: There is no pool named %s\n", name);
+    return NULL;
+}
+
+void Nobita_Build_Add_Pool(Nobita_Build *b, const char *name, size_t depth)
+{
+    if (nobita_build_failed)
+        return;
+
+    if (name == NULL || depth == 0) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: A pool needs a name and a depth above 0\n"
+        );
+
+        return;
+    }
+
+    struct nobita_pool *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Could not create pool %s\n", name);
+        return;
+    }
+
+    p->name = (char *)name;
+    p->depth = depth;
+    vector_append(b->root, pools, p);
+}
+
+void Nobita_Build_Set_Action_Pool(
+    Nobita_Build *b, enum nobita_action a, const char *pool
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    b->root->action_pools[a] = nobita_build_find_pool(b, pool);
+}
+
+void Nobita_Target_Set_Pool(
+    struct nobita_target *t, enum nobita_action a, const char *pool
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->pools[a] = nobita_build_find_pool(t->b, pool);
+}
+
+void Nobita_Target_Set_Thin_Archive(struct nobita_target *t, bool thin)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->thin_archive = thin;
+}
+
+void Nobita_Target_Set_PCH(struct nobita_target *t, const char *header)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->pch = nobita_strjoinl(NOBITA_PATHSEP, t->b->ced, header, NULL);
+    Nobita_Free_Later(t->b, t->pch);
+}
+
+void Nobita_Target_Set_Modules(struct nobita_target *t, bool modules)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->modules = modules;
+}
+
+void Nobita_Target_Set_Batch_Compile(struct nobita_target *t, bool batch)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->batch_compile = batch;
+}
+
+void Nobita_Target_Set_Token_Hash(struct nobita_target *t, bool tokens)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->token_hash = tokens;
+}
+
+void Nobita_Target_Set_Unity(struct nobita_target *t, bool unity)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->unity = unity;
+}
+
+static void nobita_unity_exclude_each(const char *path, void *arg)
+{
+    struct nobita_target *t = arg;
+    char *s = nobita_strjoinl(NOBITA_PATHSEP, t->b->ced, path, NULL);
+    vector_append(t, unity_exclude, s);
+    if (nobita_build_failed)
+        free(s);
+}
+
+void Nobita_Target_Add_Unity_Exclude(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, t);
+    for (char *arg = va_arg(va, char *); arg != NULL; arg = va_arg(va, char *))
+        nobita_glob_each(arg, nobita_unity_exclude_each, t);
+
+    va_end(va);
+}
+
+void Nobita_Build_Set_Linker(Nobita_Build *b, enum nobita_linker ld)
+{
+    if (nobita_build_failed)
+        return;
+
+    b->root->linker = ld;
+}
+
+void Nobita_Target_Set_Linker(struct nobita_target *t, enum nobita_linker ld)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->linker = ld;
+}
+
+void Nobita_Build_Set_Split_Dwarf(Nobita_Build *b, bool split)
+{
+    if (nobita_build_failed)
+        return;
+
+    b->root->split_dwarf = split;
+}
+
+void Nobita_Target_Set_Split_Dwarf(struct nobita_target *t, bool split)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->split_dwarf = split;
+}
+
+void Nobita_Target_Set_LTO(
+    struct nobita_target *t, enum nobita_lto lto, size_t jobs
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->lto = lto;
+    t->lto_jobs = jobs;
+}
+
+void Nobita_Target_Add_Training(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    if (t->target_type != NOBITA_EXECUTABLE) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Target %s is not an executable, it "
+            "can't have training runs\n", t->name
+        );
+
+        return;
+    }
+
+    va_list va;
+    size_t argc = 0;
+    va_start(va, t);
+    while (va_arg(va, char *) != NULL)
+        argc += 1;
+
+    va_end(va);
+
+    /* The first slot is for the instrumented executable */
+    char **argv = calloc(argc + 2, sizeof(*argv));
+    if (argv == NULL) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Could not add a training run to target "
+            "%s\n", t->name
+        );
+
+        return;
+    }
+
+    va_start(va, t);
+    for (size_t i = 0; i < argc; i++)
+        argv[i + 1] = va_arg(va, char *);
+
+    va_end(va);
+    vector_append(t, trainings, argv);
+    if (nobita_build_failed)
+        free(argv);
+}
+
+static struct nobita_pool *
+nobita_target_pool(struct nobita_target *t, enum nobita_action a)
+{
+    return (t->pools[a] != NULL) ? t->pools[a] : t->b->root->action_pools[a];
+}
+
+void Nobita_Target_Set_Build_Tool(
+    struct nobita_target *t, enum nobita_build_tool bt
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    t->comp_opts.bt = bt;
+    if (bt != NOBITA_BT_MSVC) {
+        Nobita_Target_Add_Fmt_Arg(t, NOBITA_T_LDFLAGS, "%s%s", "-L", t->b->lib);
+        Nobita_Target_Add_Fmt_Arg(
+            t, NOBITA_T_CFLAGS, "%s%s", "-I", t->b->include
+        );
+    } else {
+        vector_append(t, ldflags, "/link");
+        Nobita_Target_Add_Fmt_Arg(
+            t, NOBITA_T_CFLAGS, "%s%s", "/I", t->b->include
+        );
+        Nobita_Target_Add_Fmt_Arg(
+            t, NOBITA_T_LDFLAGS, "%s%s", "/LIBPATH:", t->b->lib
+        );
+    }
+
+    switch (bt) {
+    case NOBITA_BT_GCC:
+        t->comp_opts.as = "as";
+        t->comp_opts.cc = "gcc";
+        t->comp_opts.cxx = "g++";
+        t->comp_opts.to_exe = "-o";
+        t->comp_opts.to_obj = "-c";
+        t->comp_opts.rename_obj = NULL;
+        t->comp_opts.to_lib = "-shared";
+
+        t->comp_opts.inc_dir = "-I";
+        t->comp_opts.lib_dir = "-L";
+
+        t->comp_opts.ar = "ar";
+        t->comp_opts.ar_opts = "rcs";
+        t->comp_opts.ar_thin_opts = "rcsT";
+        break;
+    case NOBITA_BT_LLVM:
+        t->comp_opts.as = "llvm-as";
+        t->comp_opts.cc = "clang";
+        t->comp_opts.cxx = "clang++";
+        t->comp_opts.to_exe = "-o";
+        t->comp_opts.to_obj = "-c";
+        t->comp_opts.rename_obj = NULL;
+        t->comp_opts.to_lib = "-shared";
+
+        t->comp_opts.inc_dir = "-I";
+        t->comp_opts.lib_dir = "-L";
+
+        t->comp_opts.ar = "llvm-ar";
+        t->comp_opts.ar_opts = "rcs";
+        t->comp_opts.ar_thin_opts = "rcsT";
+        break;
+    case NOBITA_BT_MSVC:
+        t->comp_opts.as = "masm.exe";
+        t->comp_opts.cc = "cl.exe";
+        t->comp_opts.cxx = "cl.exe";
+        t->comp_opts.to_exe = "/Fe:";
+        t->comp_opts.to_obj = "/c";
+        t->comp_opts.rename_obj = "/Fo:";
+        t->comp_opts.to_lib = "/LD";
+
+        t->comp_opts.inc_dir = "/I";
+        t->comp_opts.lib_dir = "/LIBPATH:";
+
+        t->comp_opts.ar = "lib.exe";
+        t->comp_opts.ar_opts = "/OUT:";
+        t->comp_opts.ar_thin_opts = NULL;
+        break;
+    }
+}
+
+void Nobita_Target_Add_Cflags(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, t);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+        vector_append(t, cflags, arg);
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+/* The name of the directory a target type keeps it's objects in */
+static const char *nobita_cache_kind(enum nobita_target_type type)
+{
+    switch (type) {
+        case NOBITA_EXECUTABLE:
+            return "execut";
+        case NOBITA_SHARED_LIB:
+            return "shared";
+        case NOBITA_STATIC_LIB:
+            return "static";
+        case NOBITA_CUSTOM_CMD:
+            return "custom";
+    }
+
+    return "custom";
+}
+
+/* The command that declared path as one of it's outputs, if any */
+static Nobita_CMD *nobita_output_maker(struct nobita_build *b, const char *path)
+{
+    b = b->root;
+    for (size_t i = 0; i < b->deps_used; i++) {
+        Nobita_CMD *c = b->deps[i];
+        for (size_t ii = 0; ii < c->cmd_outputs_used; ii++)
+            if (strcmp(c->cmd_outputs[ii], path) == 0)
+                return c;
+    }
+
+    return NULL;
+}
+
+/*
+ * A source that's made by a command is added even if it doesn't exist yet,
+ * and the target then waits for the command
+ */
+static bool nobita_source_made(struct nobita_target *t, const char *path)
+{
+    char *s = nobita_strjoinl(NOBITA_PATHSEP, t->b->ced, path, NULL);
+    Nobita_CMD *c = (s != NULL) ? nobita_output_maker(t->b, s) : NULL;
+    free(s);
+    if (c == NULL || c == t)
+        return c != NULL;
+
+    for (size_t i = 0; i < t->deps_used; i++)
+        if (t->deps[i] == c)
+            return true;
+
+    vector_append(t, deps, c);
+    return true;
+}
+
+void Nobita_Target_Add_Sources(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    const char *append_cache_dir = nobita_cache_kind(t->target_type);
+
+    va_list va;
+    va_start(va, t);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+#ifndef _WIN32
+        glob_t g;
+        int err = glob(arg, 0, NULL, &g);
+        if (err == GLOB_NOMATCH && nobita_source_made(t, arg)) {
+            globfree(&g);
+            err = glob(arg, GLOB_NOCHECK, NULL, &g);
+        }
+
+        if (err != 0) {
+            nobita_build_failed = true;
+            va_end(va);
+            fprintf(stderr,
+                "\tNOBITA\tERROR: Glob error for pattern %s in add source "
+                "to target %s\n", arg, t->name
+            );
+
+            return;
+        }
+
+        for (size_t ii = 0; ii < g.gl_pathc; ii++) {
+            nobita_source_made(t, g.gl_pathv[ii]);
+            char *s = nobita_strjoinl(
+                NOBITA_PATHSEP, t->b->ced, g.gl_pathv[ii], NULL
+            );
+            char *o = nobita_strjoinl(
+                NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+                append_cache_dir, g.gl_pathv[ii], NULL
+            );
+            char *i = strrchr(o, '.');
+            i[1]    = 'o';
+            i[2]    = 0;
+
+            vector_append(t, sources, s);
+            vector_append(t, objects, o);
+            nobita_dirname(o);
+            nobita_mkdir_recursive(o);
+            *strchr(o, 0) = *NOBITA_PATHSEP;
+        }
+
+        globfree(&g);
+#else
+        WIN32_FIND_DATAA d = {0};
+        HANDLE f = FindFirstFileA(arg, &d);
+        if (f == INVALID_HANDLE_VALUE && nobita_source_made(t, arg)) {
+            char *s = nobita_strjoinl(NOBITA_PATHSEP, t->b->ced, arg, NULL);
+            char *obj = nobita_strjoinl("", arg, "obj", NULL);
+            strcpy(strrchr(obj, '.') + 1, "obj");
+            char *o = nobita_strjoinl(
+                NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+                append_cache_dir, obj, NULL
+            );
+            free(obj);
+            vector_append(t, sources, s);
+            vector_append(t, objects, o);
+            nobita_dirname(o);
+            nobita_mkdir_recursive(o);
+            *strchr(o, 0) = *NOBITA_PATHSEP;
+            arg = va_arg(va, char *);
+            continue;
+        }
+
+        if (f == INVALID_HANDLE_VALUE) {
+            nobita_build_failed = true;
+            va_end(va);
+            fprintf(stderr,
+                "\tNOBITA\tERROR: The glob pattern %s for custom command %s is "
+                "invalid!\n", arg, t->name
+            );
+
+            return;
+        }
+
+        char *argdir = nobita_strdup(arg);
+        nobita_dirname(argdir);
+        char *s = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->ced, argdir, d.cFileName, NULL
+        );
+        vector_append(t, sources, s);
+
+        char *i = strrchr(d.cFileName, '.');
+        i[1]    = 'o';
+        i[2]    = 'b';
+        i[3]    = 'j';
+        i[4]    = 0;
+        char *o = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+            append_cache_dir, argdir, d.cFileName, NULL
+        );
+        vector_append(t, objects, o);
+        nobita_dirname(o);
+        nobita_mkdir_recursive(o);
+        *strchr(o, 0) = *NOBITA_PATHSEP;
+
+        while (FindNextFileA(f, &d)) {
+            char *s = nobita_strjoinl(
+                NOBITA_PATHSEP, t->b->ced, argdir, d.cFileName, NULL
+            );
+            vector_append(t, sources, s);
+
+            char *i = strrchr(d.cFileName, '.');
+            i[1]    = 'o';
+            i[2]    = 'b';
+            i[3]    = 'j';
+            i[4]    = 0;
+            char *o = nobita_strjoinl(
+                NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+                append_cache_dir, argdir, d.cFileName, NULL
+            );
+
+            vector_append(t, objects, o);
+            nobita_dirname(o);
+            nobita_mkdir_recursive(o);
+            *strchr(o, 0) = *NOBITA_PATHSEP;
+        }
+
+        free(argdir);
+        CloseHandle(f);
+#endif /* _WIN32 */
+
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+static void nobita_resource_each(const char *path, void *arg)
+{
+    struct nobita_target *t = arg;
+    char *res = nobita_strdup(path);
+    vector_append(t, resources, res);
+    if (nobita_build_failed)
+        free(res);
+}
+
+void Nobita_Target_Add_Resources(
+    struct nobita_target *t, const char *header, ...
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    char *copy = nobita_strdup(header);
+    Nobita_Free_Later(t->b, copy);
+    t->res_header = copy;
+    va_list va;
+    va_start(va, header);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+        size_t before = t->resources_used;
+        nobita_glob_each(arg, nobita_resource_each, t);
+        if (t->resources_used == before && !nobita_build_failed) {
+            nobita_build_failed = true;
+            fprintf(stderr,
+                "\tNOBITA\tERROR: No resource matches %s in target %s\n",
+                arg, t->name
+            );
+        }
+
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+void Nobita_Target_Add_LDflags(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, t);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+        vector_append(t, ldflags, arg);
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+void Nobita_Target_Add_Deps(struct nobita_target *t, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, t);
+
+    struct nobita_target *arg = va_arg(va, struct nobita_target *);
+    while (arg != NULL) {
+        vector_append(t, deps, arg);
+        arg = va_arg(va, struct nobita_target *);
+    }
+
+    va_end(va);
+}
+
+void Nobita_CMD_Add_Args(Nobita_CMD *c, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, c);
+
+    char *arg = va_arg(va, char *);
+#ifndef _WIN32
+    while (arg != NULL) {
+        glob_t g;
+        if (glob(arg, GLOB_NOCHECK, NULL, &g) != 0) {
+            nobita_build_failed = true;
+            va_end(va);
+            fprintf(stderr,
+                "\tNOBITA\tERROR: The glob pattern %s for custom command %s is "
+                "invalid!\n", arg, c->name
+            );
+
+            return;
+        }
+
+        for (size_t i = 0; i < g.gl_pathc; i++)
+            vector_append(c, custom_cmd, g.gl_pathv[i]);
+
+        free(g.gl_pathv);
+        arg = va_arg(va, char *);
+    }
+#else
+    while (arg != NULL) {
+        WIN32_FIND_DATAA d = {0};
+        HANDLE f = FindFirstFileA(arg, &d);
+        if (f == INVALID_HANDLE_VALUE) {
+            vector_append(c, custom_cmd, nobita_strdup(arg));
+            arg = va_arg(va, char *);
+            continue;
+        } else {
+            char *argdir = nobita_strdup(arg);
+            nobita_dirname(argdir);
+            vector_append(
+                c, custom_cmd,
+                nobita_strjoinl(NOBITA_PATHSEP, argdir, d.cFileName, NULL)
+            );
+            free(argdir);
+        }
+
+        char *argdir = nobita_strdup(arg);
+        nobita_dirname(argdir);
+        while (FindNextFileA(f, &d))
+            vector_append(
+                c, custom_cmd,
+                nobita_strjoinl(NOBITA_PATHSEP, argdir, d.cFileName, NULL)
+            );
+
+        free(argdir);
+        CloseHandle(f);
+        arg = va_arg(va, char *);
+    }
+#endif /* _WIN32 */
+
+    va_end(va);
+}
+
+/* Adds a declared input or output of a command, made relative to it's build */
+static void nobita_cmd_add_file(Nobita_CMD *c, bool output, const char *path)
+{
+    char *file = nobita_strjoinl(NOBITA_PATHSEP, c->b->ced, path, NULL);
+    if (file == NULL)
+        return;
+
+    if (output) {
+        vector_append(c, cmd_outputs, file);
+        nobita_dirname(file);
+        nobita_mkdir_recursive(file);
+        *strchr(file, 0) = *NOBITA_PATHSEP;
+    } else {
+        vector_append(c, cmd_inputs, file);
+    }
+
+    if (nobita_build_failed)
+        free(file);
+}
+
+void Nobita_CMD_Add_Inputs(Nobita_CMD *c, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, c);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL && !nobita_build_failed) {
+#ifndef _WIN32
+        glob_t g;
+        if (glob(arg, GLOB_NOCHECK, NULL, &g) != 0) {
+            nobita_build_failed = true;
+            fprintf(stderr,
+                "\tNOBITA\tERROR: The glob pattern %s for the inputs of "
+                "custom command %s is invalid!\n", arg, c->name
+            );
+
+            break;
+        }
+
+        for (size_t i = 0; i < g.gl_pathc; i++)
+            nobita_cmd_add_file(c, false, g.gl_pathv[i]);
+
+        globfree(&g);
+#else
+        WIN32_FIND_DATAA d = {0};
+        HANDLE f = FindFirstFileA(arg, &d);
+        if (f == INVALID_HANDLE_VALUE) {
+            nobita_cmd_add_file(c, false, arg);
+            arg = va_arg(va, char *);
+            continue;
+        }
+
+        char *argdir = nobita_strdup(arg);
+        nobita_dirname(argdir);
+        do {
+            char *path = nobita_strjoinl(
+                NOBITA_PATHSEP, argdir, d.cFileName, NULL
+            );
+            if (path != NULL)
+                nobita_cmd_add_file(c, false, path);
+
+            free(path);
+        } while (FindNextFileA(f, &d));
+
+        free(argdir);
+        FindClose(f);
+#endif /* _WIN32 */
+
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+void Nobita_CMD_Add_Outputs(Nobita_CMD *c, ...)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, c);
+
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+        nobita_cmd_add_file(c, true, arg);
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+void Nobita_CMD_Set_Trace(Nobita_CMD *c, bool trace)
+{
+    if (nobita_build_failed)
+        return;
+
+#ifndef _WIN32
+    c->trace = trace;
+#else
+    if (trace)
+        fprintf(stderr,
+            "\tNOBITA\tWARNING: Tracing custom command %s is not supported "
+            "on Windows, it runs every time\n", c->name
+        );
+#endif /* _WIN32 */
+}
+
+void Nobita_Target_Add_Fmt_Arg(
+        struct nobita_target *t, enum nobita_argtype a, const char *fmt, ...
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    va_list va;
+    va_start(va, fmt);
+    int64_t arglen = vsnprintf(NULL, 0, fmt, va) + 1;
+    va_end(va);
+
+    char *arg = malloc(arglen * sizeof(char));
+    if (arg == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Failed to add formatted arg to target %s\n",
+            t->name
+        );
+        return;
+    }
+
+    va_start(va, fmt);
+    vsprintf(arg, fmt, va);
+    va_end(va);
+
+    switch (a) {
+    case NOBITA_T_CFLAGS:
+        vector_append(t, cflags, arg);
+        Nobita_Free_Later(t->b, arg);
+        break;
+    case NOBITA_T_LDFLAGS:
+        vector_append(t, ldflags, arg);
+        Nobita_Free_Later(t->b, arg);
+        break;
+    case NOBITA_T_CUSTOM_CMD:
+        vector_append(t, custom_cmd, arg);
+        break;
+    default:
+      break;
+    }
+}
+
+void Nobita_Try_Rebuild(Nobita_Build *b, const char *build_file)
+{
+#ifdef _WIN32
+    printf("Self-rebuilds are not supported on windows...\n");
+    return;
+#else
+    /* Sub builds are rebuilt and loaded by 'Nobita_Build_Add_Nobita()' */
+    if (nobita_build_failed || b != b->root)
+        return;
+
+    /* Set just before exec so a clock skewed header can't cause an exec loop */
+    if (getenv("NOBITA_SELF_REBUILT") != NULL) {
+        unsetenv("NOBITA_SELF_REBUILT");
+        return;
+    }
+
+    char *build_exe = b->argv[0];
+    char *exe_name = strrchr(build_exe, *NOBITA_PATHSEP);
+    exe_name = (exe_name == NULL) ? build_exe : exe_name + 1;
+
+    char *cache = nobita_strjoinl(NOBITA_PATHSEP, b->ced, "nobita-cache", NULL);
+    char *depname = nobita_strjoinl("", exe_name, ".d", NULL);
+    char *depfile = nobita_strjoinl(NOBITA_PATHSEP, cache, depname, NULL);
+    char *new_exe = nobita_strjoinl("", build_exe, ".new", NULL);
+    if (nobita_build_failed ||
+            !nobita_build_file_is_stale(build_file, build_exe, depfile))
+        goto end;
+
+    nobita_mkdir_recursive(cache);
+    printf("\tLD\t%s\n", build_exe);
+    nobita_compile_build_file(b, build_file, new_exe, depfile, false);
+    if (nobita_build_failed)
+        goto end;
+
+    /*
+     * Renaming over the running executable is fine, the old inode
+     * stays alive until this process is replaced below
+     */
+    if (rename(new_exe, build_exe) != 0) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not move %s to %s (%s)\n",
+            new_exe, build_exe, strerror(errno)
+        );
+
+        goto end;
+    }
+
+    printf("\tEXEC\t%s\n", build_exe);
+    fflush(stdout);
+    fflush(stderr);
+    setenv("NOBITA_SELF_REBUILT", "1", 1);
+    execvp(build_exe, b->argv);
+    unsetenv("NOBITA_SELF_REBUILT");
+
+    nobita_build_failed = true;
+    fprintf(stderr,
+        "\tNOBITA\tERROR: Could not replace the build process with %s (%s)\n",
+        build_exe, strerror(errno)
+    );
+
+end:
+    free(cache);
+    free(depname);
+    free(depfile);
+    free(new_exe);
+#endif /* _WIN32 */
+}
+
+void Nobita_Set_Rebuild_Profile(
+    Nobita_Build *b, enum nobita_rebuild_profile p
+)
+{
+    b->root->rebuild_profile = p;
+}
+
+/*
+ * Without a depfile there's no telling what else the build file includes
+ * so it's stale until it has one
+ */
+static bool nobita_build_file_is_stale(
+    const char *src, const char *out, const char *depfile
+)
+{
+    return !nobita_file_exist(depfile) ||
+        !nobita_is_a_newer(out, src) ||
+        !nobita_is_a_newer(out, __FILE__) ||
+        nobita_depfile_is_newer(depfile, out);
+}
+
+static void nobita_compile_build_file(
+    struct nobita_build *b, const char *src, const char *out,
+    const char *depfile, bool shared
+)
+{
+    struct nobita_target e = {0};
+    vector_init(&e, full_cmd);
+#if defined(__clang__)
+    vector_append(&e, full_cmd, "clang");
+#else
+    vector_append(&e, full_cmd, "gcc");
+#endif
+    vector_append(&e, full_cmd, "-Wall");
+    vector_append(&e, full_cmd, "-Wpedantic");
+    vector_append(&e, full_cmd, "-Wextra");
+    switch (b->root->rebuild_profile) {
+    case NOBITA_RP_FAST:
+        vector_append(&e, full_cmd, "-O0");
+        break;
+    case NOBITA_RP_DEBUG:
+        vector_append(&e, full_cmd, "-O0");
+        vector_append(&e, full_cmd, "-g");
+        break;
+    case NOBITA_RP_RELEASE:
+        vector_append(&e, full_cmd, "-O2");
+        break;
+    case NOBITA_RP_ASAN:
+        vector_append(&e, full_cmd, "-O1");
+        vector_append(&e, full_cmd, "-g");
+        vector_append(&e, full_cmd, "-fsanitize=address");
+        break;
+    }
+
+    /*
+     * Sub builds only carry the header part and resolve the Nobita_*
+     * functions against the build executable, hence -rdynamic there
+     */
+    if (shared) {
+        vector_append(&e, full_cmd, "-shared");
+        vector_append(&e, full_cmd, "-fPIC");
+#ifndef __APPLE__
+        vector_append(&e, full_cmd, "-Wl,-Bsymbolic");
+#endif /* __APPLE__ */
+        vector_append(&e, full_cmd, "-DNOBITA_SUBBUILD");
+    } else {
+        vector_append(&e, full_cmd, "-rdynamic");
+    }
+
+    vector_append(&e, full_cmd, "-MMD");
+    vector_append(&e, full_cmd, "-MF");
+    vector_append(&e, full_cmd, (char *)depfile);
+    vector_append(&e, full_cmd, "-o");
+    vector_append(&e, full_cmd, (char *)out);
+    vector_append(&e, full_cmd, (char *)src);
+    if (!shared) {
+        vector_append(&e, full_cmd, "-ldl");
+        vector_append(&e, full_cmd, "-pthread");
+    }
+
+    vector_append(&e, full_cmd, NULL);
+    nobita_proc_append(b, e.full_cmd, NULL, NOBITA_ACT_LINK, out);
+    nobita_proc_wait_all(b);
+    vector_free(&e, full_cmd);
+}
+
+void Nobita_Target_Add_Headers(
+    struct nobita_target *t, const char *parent, ...
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    if (parent == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: When adding header files to a target, the parent "
+            "dir should not be NULL (target: %s)\n", t->name
+        );
+
+        return;
+    }
+
+    struct nobita_header h;
+    h.parent = (char *)parent;
+    if (t->b != t->b->root && parent[0] != *NOBITA_PATHSEP) {
+        h.parent = nobita_strjoinl(NOBITA_PATHSEP, t->b->ced, parent, NULL);
+        Nobita_Free_Later(t->b, h.parent);
+    }
+
+    va_list va;
+    va_start(va, parent);
+    char *arg = va_arg(va, char *);
+    while (arg != NULL) {
+        h.header = arg;
+        vector_append(t, headers, h);
+        arg = va_arg(va, char *);
+    }
+
+    va_end(va);
+}
+
+char *Nobita_GetCwd(Nobita_Build *b)
+{
+    return b->cwd;
+}
+
+char *Nobita_GetCed(Nobita_Build *b)
+{
+    return b->ced;
+}
+
+char *Nobita_GetPrefix(Nobita_Build *b)
+{
+    return b->prefix;
+}
+
+char *Nobita_GetInclude(Nobita_Build *b)
+{
+    return b->include;
+}
+
+char *Nobita_GetBin(Nobita_Build *b)
+{
+    return b->bin;
+}
+
+char *Nobita_GetLib(Nobita_Build *b)
+{
+    return b->lib;
+}
+
+static struct nobita_target *
+nobita_build_add_target(struct nobita_build *b, const char *name)
+{
+    if (nobita_build_failed)
+        return NULL;
+
+    if (name == NULL) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: A target's name should not be NULL\n"
+        );
+
+        return NULL;
+    }
+
+    struct nobita_target *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Could not create target %s\n", name);
+        return NULL;
+    }
+
+    t->name = (char *)name;
+    vector_init(t, cflags);
+    vector_init(t, sources);
+    vector_init(t, objects);
+    vector_init(t, ldflags);
+    vector_init(t, full_cmd);
+    vector_init(t, custom_cmd);
+    vector_init(t, headers);
+    vector_init(t, deps);
+    vector_init(t, unity_exclude);
+    vector_init(t, trainings);
+    vector_init(t, probes);
+    vector_init(t, compile_inputs);
+    vector_init(t, link_inputs);
+    vector_init(t, cmd_inputs);
+    vector_init(t, cmd_outputs);
+    vector_init(t, resources);
+
+    vector_append(b->root, deps, t);
+    t->b = b;
+    return t;
+}
+
+#ifndef _WIN32
+/*
+ * A pipe the processes started later don't inherit, without pipe2 there's
+ * a moment where another thread starting a process could still get it
+ */
+static int nobita_pipe_open(int fds[2])
+{
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__)
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1)
+        return -1;
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif /* __linux__ */
+}
+#endif /* _WIN32 */
+
+/* env is a NULL ended list of 'NAME=value' added to the process' own */
+static nobita_pid
+nobita_proc_exec(
+    char **cmd, char *joined_cmd, const char *cwd, char **env,
+    const nobita_cpu_mask *mask, nobita_pipe *out
+)
+{
+    nobita_pid id = (nobita_pid)-1;
+    *out = NOBITA_PIPE_NONE;
+    if (nobita_build_failed)
+        return id;
+
+#ifndef _WIN32
+    /* Both stdout and stderr go to one pipe so their order is kept */
+    int fds[2] = {-1, -1};
+    if (nobita_pipe_open(fds) == -1) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Creating a pipe for the process\n'%s'\n"
+            "Failed!\n", joined_cmd
+        );
+
+        return id;
+    }
+
+    id = fork();
+    if (id == -1) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Creating the process\n'%s'\nFailed!\n",
+            joined_cmd
+        );
+
+        close(fds[0]);
+        close(fds[1]);
+        return id;
+    }
+
+    if (id == 0) {
+        if (cwd != NULL && chdir(cwd) != 0)
+            exit(errno);
+
+        for (size_t i = 0; env != NULL && env[i] != NULL; i++)
+            putenv(env[i]);
+
+        /* Pinning is only a hint, the command still runs if it fails */
+#ifdef __linux__
+        if (mask != NULL)
+            sched_setaffinity(0, sizeof(*mask), mask);
+#else
+        (void)mask;
+#endif /* __linux__ */
+
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execvp(*cmd, cmd);
+        exit(errno);
+    } else {
+        close(fds[1]);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        *out = fds[0];
+        return id;
+    }
+#else
+    (void)env;
+    STARTUPINFO s = {0};
+    PROCESS_INFORMATION p = {0};
+    SECURITY_ATTRIBUTES sa = {0};
+    HANDLE r = NULL;
+    HANDLE w = NULL;
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = true;
+    if (!CreatePipe(&r, &w, &sa, 0)) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Creating a pipe for the process\n'%s'\n"
+            "Failed!\n", joined_cmd
+        );
+
+        return id;
+    }
+
+    SetHandleInformation(r, HANDLE_FLAG_INHERIT, 0);
+    s.cb = sizeof(s);
+    s.dwFlags = STARTF_USESTDHANDLES;
+    s.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    s.hStdOutput = w;
+    s.hStdError = w;
+
+    DWORD flags = (mask != NULL) ? CREATE_SUSPENDED : 0;
+    bool created = CreateProcessA(
+        NULL, joined_cmd, NULL, NULL, true, flags, NULL, cwd, &s, &p
+    );
+
+    CloseHandle(w);
+    if (!created) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Creating the process\n'%s'\nFailed!\n",
+            joined_cmd
+        );
+
+        CloseHandle(r);
+        return id;
+    } else {
+        if (mask != NULL) {
+            SetProcessAffinityMask(p.hProcess, *mask);
+            ResumeThread(p.hThread);
+        }
+
+        CloseHandle(p.hThread);
+        *out = r;
+        return p.hProcess;
+    }
+#endif /* _WIN32 */
+}
+
+/*
+ * Keeps what a process wrote, this doesn't go through vector_append as
+ * the output of a process that failed is needed the most after a failure
+ */
+static void nobita_proc_keep(struct nobita_proc *p, const char *buf, size_t n)
+{
+    if (p->output_used + n > p->output_size) {
+        size_t size = (p->output_used + n) * 2;
+        char *data = realloc(p->output, size);
+        if (data == NULL)
+            return;
+
+        p->output = data;
+        p->output_size = size;
+    }
+
+    memcpy(p->output + p->output_used, buf, n);
+    p->output_used += n;
+}
+
+/*
+ * Reads what a process wrote so far, returns false once it's closed, last
+ * closes it anyway as whatever it started may still hold it open
+ */
+static bool nobita_proc_drain(struct nobita_proc *p, bool last)
+{
+    if (p->out == NOBITA_PIPE_NONE)
+        return false;
+
+    char buf[4096];
+#ifndef _WIN32
+    for (;;) {
+        ssize_t n = read(p->out, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && !last)
+            return true;
+        else if (n <= 0)
+            break;
+
+        nobita_proc_keep(p, buf, (size_t)n);
+    }
+
+    close(p->out);
+#else
+    DWORD avail = 0;
+    DWORD n = 0;
+    while (PeekNamedPipe(p->out, NULL, 0, NULL, &avail, NULL)) {
+        if (avail == 0 && !last)
+            return true;
+        else if (avail == 0)
+            break;
+
+        if (avail > sizeof(buf))
+            avail = sizeof(buf);
+
+        if (!ReadFile(p->out, buf, avail, &n, NULL) || n == 0)
+            break;
+
+        nobita_proc_keep(p, buf, n);
+    }
+
+    CloseHandle(p->out);
+#endif /* _WIN32 */
+
+    p->out = NOBITA_PIPE_NONE;
+    return false;
+}
+
+/*
+ * Runs a command to the end on the side without showing what it wrote,
+ * for asking tools what they can do, returns whether it succeeded
+ */
+static bool nobita_proc_probe(char **cmd)
+{
+    struct nobita_proc p;
+    memset(&p, 0, sizeof(p));
+    char *joined = nobita_strjoinv(" ", cmd);
+    if (joined == NULL)
+        return false;
+
+    p.pid = nobita_proc_exec(cmd, joined, NULL, NULL, NULL, &p.out);
+    free(joined);
+    if (p.pid == (nobita_pid)-1)
+        return false;
+
+    bool ok = false;
+#ifndef _WIN32
+    while (p.out != NOBITA_PIPE_NONE) {
+        struct pollfd pfd = {.fd = p.out, .events = POLLIN};
+        poll(&pfd, 1, -1);
+        nobita_proc_drain(&p, false);
+    }
+
+    int status = 0;
+    while (waitpid(p.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+
+    ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+#else
+    while (WaitForSingleObject(p.pid, 50) == WAIT_TIMEOUT)
+        nobita_proc_drain(&p, false);
+
+    nobita_proc_drain(&p, true);
+    DWORD code = EXIT_FAILURE;
+    GetExitCodeProcess(p.pid, &code);
+    CloseHandle(p.pid);
+    ok = code == EXIT_SUCCESS;
+#endif /* _WIN32 */
+
+    free(p.output);
+    return ok;
+}
+
+/*
+ * Waits up to timeout milliseconds for any process to write something and
+ * reads it, so they never block on a full pipe while we wait for them
+ */
+static void nobita_proc_poll(struct nobita_build *b, int timeout)
+{
+#ifndef _WIN32
+    /* Not vector_append, this has to keep working after a failure */
+    if (b->polls_size < b->procs_used) {
+        void *data = realloc(b->polls, b->procs_used * sizeof(*b->polls));
+        if (data == NULL)
+            return;
+
+        b->polls = data;
+        b->polls_size = b->procs_used;
+    }
+
+    b->polls_used = 0;
+    for (size_t i = 0; i < b->procs_used; i++) {
+        if (b->procs[i].out == NOBITA_PIPE_NONE)
+            continue;
+
+        b->polls[b->polls_used].fd = b->procs[i].out;
+        b->polls[b->polls_used].events = POLLIN;
+        b->polls[b->polls_used].revents = 0;
+        b->polls_used += 1;
+    }
+
+    if (b->polls_used == 0 || poll(b->polls, b->polls_used, timeout) <= 0)
+        return;
+
+    for (size_t i = 0, ii = 0; i < b->procs_used; i++) {
+        if (b->procs[i].out == NOBITA_PIPE_NONE)
+            continue;
+
+        if (b->polls[ii++].revents != 0)
+            nobita_proc_drain(&b->procs[i], false);
+    }
+#else
+    (void)timeout;
+    for (size_t i = 0; i < b->procs_used; i++)
+        nobita_proc_drain(&b->procs[i], false);
+#endif /* _WIN32 */
+}
+
+static void nobita_proc_append(
+    struct nobita_build *b, char **cmd, struct nobita_target *t,
+    enum nobita_action action, const char *key
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    /* Sub builds run their commands from their own directory */
+    const char *cwd = (b != b->root) ? b->ced : NULL;
+    struct nobita_pool *pool = (t != NULL) ? nobita_target_pool(t, action) : NULL;
+    size_t rss = nobita_mem_predict(b, action, key);
+    b = b->root;
+
+    /*
+     * With a jobserver every process past the first needs a token, waiting
+     * on our own processes hands their tokens back, and so does a full pool
+     * or a lack of memory as processes that are running have to finish first
+     */
+    while (!nobita_build_failed) {
+        bool full = b->procs_used >= nobita_max_proc_count ||
+            (pool != NULL && pool->running >= pool->depth) ||
+            !nobita_mem_admit(b, rss) || nobita_load_too_high(b);
+        if (!full && nobita_jobserver_acquire(b))
+            break;
+
+        if (full || b->js_read < 0)
+            nobita_proc_wait_one(b);
+        else
+            nobita_jobserver_wait(b);
+    }
+
+    nobita_proc_start(b, cmd, cwd, action, pool, rss, key, NULL);
+}
+
+/* Starts a process that was already let through, j is the job it runs */
+static void nobita_proc_start(
+    struct nobita_build *b, char **cmd, const char *cwd,
+    enum nobita_action action, struct nobita_pool *pool, size_t rss,
+    const char *key, struct nobita_job *j
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    b = b->root;
+    struct nobita_proc p = {0};
+    p.name = nobita_strjoinv(" ", cmd);
+    p.key = (key != NULL) ? nobita_strdup(key) : NULL;
+    p.pool = pool;
+    p.job = j;
+    p.cpu_set = nobita_pin_pick(b, action);
+    p.rss = rss;
+    p.threads = (j != NULL) ? j->threads : 1;
+    p.start = nobita_now();
+    if (p.name == NULL)
+        nobita_build_failed = true;
+
+    p.pid = nobita_proc_exec(
+        cmd, p.name, cwd, (j != NULL) ? j->env : NULL,
+        (p.cpu_set != NULL) ? &p.cpu_set->mask : NULL, &p.out
+    );
+    vector_append(b, procs, p);
+    if (nobita_build_failed) {
+        if (p.out != NOBITA_PIPE_NONE)
+            nobita_proc_drain(&p, true);
+
+        free(p.name);
+        free(p.key);
+        vector_free(&p, output);
+        return;
+    }
+
+    if (pool != NULL)
+        pool->running += 1;
+
+    if (p.cpu_set != NULL)
+        p.cpu_set->running += 1;
+}
+
+/*
+ * Removes the i'th process from the queue once it's done, exited tells if
+ * it exited by itself with a successful exit code and peak_rss is in KiB
+ */
+static void
+nobita_proc_done(struct nobita_build *b, size_t i, bool exited, size_t peak_rss)
+{
+    struct nobita_proc *p = &b->procs[i];
+    nobita_proc_drain(p, true);
+
+    /* A check failing is an answer, what it wrote is only kept for it */
+    if (p->job != NULL && p->job->probe != NULL) {
+        nobita_probe_done(b, p->job->probe, exited, p->output, p->output_used);
+        p->output_used = 0;
+        exited = true;
+    }
+
+    /* All of a process' output comes out at once when it's done */
+    if (p->output_used > 0 && (!exited || !b->output_on_failure)) {
+        printf("\tOUT\t%s\n", (p->key != NULL) ? p->key : p->name);
+        fwrite(p->output, 1, p->output_used, stdout);
+        if (p->output[p->output_used - 1] != '\n')
+            printf("\n");
+
+        fflush(stdout);
+    }
+
+    if (!exited && p->job != NULL) {
+        fprintf(
+            stderr, "\tNOBITA\tERROR: A process did not exit sucessfully\n"
+        );
+
+        fprintf(stderr, "\tNOBITA\tCmd: %s\n", p->name);
+    } else if (!exited) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr,
+            "\tNOBITA\tERROR: A process did not exit sucessfully, "
+            "marking build as failed\n"
+        );
+
+        fprintf(stderr, "\tNOBITA\tCmd: %s\n", p->name);
+    } else if (p->key != NULL) {
+        nobita_state_setf(b, "time", p->key, "%.3f", nobita_now() - p->start);
+        if (peak_rss > 0)
+            nobita_state_setf(b, "rss", p->key, "%zu", peak_rss);
+    }
+
+    if (p->pool != NULL)
+        p->pool->running -= 1;
+
+    if (p->cpu_set != NULL)
+        p->cpu_set->running -= 1;
+
+    struct nobita_job *j = p->job;
+    double took = nobita_now() - p->start;
+    bool killed = p->killed;
+    free(p->name);
+    free(p->key);
+    vector_free(p, output);
+    b->procs[i] = b->procs[b->procs_used - 1];
+    b->procs_used -= 1;
+    nobita_jobserver_release(b);
+    if (j != NULL && exited && j->trace != NULL)
+        nobita_trace_done(b, j);
+
+    if (j != NULL && j->group_used > 0)
+        nobita_group_done(b, j, took, killed);
+    else if (j != NULL && exited)
+        nobita_job_done(b, j, true);
+    else if (j != NULL)
+        nobita_job_failed(b, j);
+}
+
+/* Runs a step's function, closing it's pipe is what tells it's done */
+#ifndef _WIN32
+static void *nobita_fn_main(void *data)
+{
+    struct nobita_fn_run *r = data;
+    r->ok = r->fn(r->arg);
+    close(r->out);
+    return NULL;
+}
+#else
+static DWORD WINAPI nobita_fn_main(LPVOID data)
+{
+    struct nobita_fn_run *r = data;
+    r->ok = r->fn(r->arg);
+    return 0;
+}
+#endif /* _WIN32 */
+
+/*
+ * Starts an in process step on a thread, it's kept with the processes so
+ * it's waited for, limited and counted the same way
+ */
+static void nobita_fn_start(
+    struct nobita_build *b, struct nobita_job *j, struct nobita_pool *pool
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    b = b->root;
+    struct nobita_proc p = {0};
+    p.name = nobita_strdup(j->t->name);
+    p.key = nobita_strdup(nobita_job_key(j));
+    p.pool = pool;
+    p.job = j;
+    p.threads = 1;
+    p.start = nobita_now();
+    p.out = NOBITA_PIPE_NONE;
+    p.fn = calloc(1, sizeof(*p.fn));
+    bool started = false;
+    if (p.fn != NULL) {
+        p.fn->fn = j->t->fn;
+        p.fn->arg = j->t->fn_arg;
+#ifndef _WIN32
+        int fds[2] = {-1, -1};
+        if (nobita_pipe_open(fds) == 0) {
+            p.fn->out = fds[1];
+            started = pthread_create(
+                &p.fn->thread, NULL, nobita_fn_main, p.fn
+            ) == 0;
+
+            if (!started)
+                close(fds[1]);
+
+            p.out = fds[0];
+            fcntl(p.out, F_SETFL, fcntl(p.out, F_GETFL) | O_NONBLOCK);
+        }
+#else
+        p.pid = CreateThread(NULL, 0, nobita_fn_main, p.fn, 0, NULL);
+        started = p.pid != NULL;
+#endif /* _WIN32 */
+    }
+
+    if (!started) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Could not start a thread for %s\n",
+            j->t->name
+        );
+    }
+
+    vector_append(b, procs, p);
+    if (nobita_build_failed) {
+        if (p.out != NOBITA_PIPE_NONE)
+            nobita_proc_drain(&p, true);
+
+#ifndef _WIN32
+        if (started)
+            pthread_join(p.fn->thread, NULL);
+#else
+        if (started) {
+            WaitForSingleObject(p.pid, INFINITE);
+            CloseHandle(p.pid);
+        }
+#endif /* _WIN32 */
+
+        free(p.fn);
+        free(p.name);
+        free(p.key);
+        vector_free(&p, output);
+        return;
+    }
+
+    if (pool != NULL)
+        pool->running += 1;
+}
+
+/* Reaps a step whose thread is done, returns whether there was one */
+static bool nobita_fn_reap(struct nobita_build *b)
+{
+    for (size_t i = 0; i < b->procs_used; i++) {
+        struct nobita_fn_run *r = b->procs[i].fn;
+#ifndef _WIN32
+        if (r == NULL || b->procs[i].out != NOBITA_PIPE_NONE)
+            continue;
+
+        pthread_join(r->thread, NULL);
+#else
+        if (r == NULL || WaitForSingleObject(b->procs[i].pid, 0) !=
+                WAIT_OBJECT_0)
+            continue;
+
+        CloseHandle(b->procs[i].pid);
+#endif /* _WIN32 */
+
+        bool ok = r->ok;
+        free(r);
+        b->procs[i].fn = NULL;
+        nobita_proc_done(b, i, ok, 0);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Reaps at most one finished process, pause makes it wait for one,
+ * returns whether a process was reaped
+ */
+static bool nobita_proc_reap(struct nobita_build *b, bool pause)
+{
+    b = b->root;
+#ifndef _WIN32
+    while (b->procs_used > 0) {
+        if (nobita_fn_reap(b))
+            return true;
+
+        /*
+         * Only the processes started here are waited for, the ones a fn
+         * step starts on it's thread are it's own to wait for
+         */
+        bool reading = false;
+        bool closed = false;
+        for (size_t i = 0; i < b->procs_used; i++) {
+            reading = reading || b->procs[i].out != NOBITA_PIPE_NONE;
+            if (b->procs[i].fn != NULL)
+                continue;
+
+            closed = closed || b->procs[i].out == NOBITA_PIPE_NONE;
+
+            int status = 0;
+            struct rusage ru;
+            memset(&ru, 0, sizeof(ru));
+            nobita_pid pid = wait4(b->procs[i].pid, &status, WNOHANG, &ru);
+            if (pid == 0 || (pid == -1 && errno == EINTR))
+                continue;
+
+            /* Someone else waited for it, so how it went isn't known */
+            b->procs[i].killed = pid > 0 && WIFSIGNALED(status);
+            nobita_proc_done(
+                b, i,
+                pid > 0 && WIFEXITED(status) &&
+                    WEXITSTATUS(status) == EXIT_SUCCESS,
+                (size_t)ru.ru_maxrss
+            );
+
+            return true;
+        }
+
+        /*
+         * Nothing exited yet, read their output meanwhile, a process closing
+         * it's end usually means it's exiting, so it's looked at again soon
+         */
+        nobita_proc_poll(b, (!pause) ? 0 : (closed) ? 1 : 100);
+        if (!pause)
+            return false;
+
+        if (!reading)
+            poll(NULL, 0, 1);
+    }
+#else
+    while (b->procs_used > 0) {
+        HANDLE h[MAXIMUM_WAIT_OBJECTS];
+        DWORD n = 0;
+        if (nobita_fn_reap(b))
+            return true;
+
+        nobita_proc_poll(b, 0);
+        for (size_t i = 0; i < b->procs_used; i++) {
+            if (b->procs[i].fn != NULL ||
+                    WaitForSingleObject(b->procs[i].pid, 0) != WAIT_OBJECT_0) {
+                if (n < MAXIMUM_WAIT_OBJECTS)
+                    h[n++] = b->procs[i].pid;
+
+                continue;
+            }
+
+            DWORD code = EXIT_FAILURE;
+            GetExitCodeProcess(b->procs[i].pid, &code);
+            CloseHandle(b->procs[i].pid);
+            nobita_proc_done(b, i, code == EXIT_SUCCESS, 0);
+            return true;
+        }
+
+        if (!pause)
+            return false;
+
+        /* Pipes can't be waited on with processes, so check them often */
+        WaitForMultipleObjects(n, h, false, 50);
+    }
+#endif /* _WIN32 */
+
+    return false;
+}
+
+static void nobita_proc_wait_one(struct nobita_build *b)
+{
+    if (!nobita_build_failed)
+        nobita_proc_reap(b, true);
+}
+
+static void nobita_proc_wait_all(struct nobita_build *b)
+{
+    b = b->root;
+    while (b->procs_used > 0)
+        nobita_proc_reap(b, true);
+}
+
+#ifndef _WIN32
+/*
+ * Finds the directory of this process' cgroup for the given controller,
+ * returns 1 or 2 for the cgroup version it found or 0 if there's none
+ */
+static int nobita_cgroup_dir(const char *controller, char *dir, size_t len)
+{
+    char line[4096];
+    int version = 0;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        char *controllers = strchr(line, ':');
+        char *path = (controllers != NULL) ? strchr(++controllers, ':') : NULL;
+        if (path == NULL)
+            continue;
+
+        *path++ = 0;
+        if (*controllers == 0 && version == 0) {
+            snprintf(dir, len, "/sys/fs/cgroup%s", path);
+            version = 2;
+            continue;
+        }
+
+        /* A v1 controller wins as hybrid setups leave v2 without them */
+        for (char *c = strtok(controllers, ","); c != NULL;
+                c = strtok(NULL, ",")) {
+            if (strcmp(c, controller) == 0) {
+                snprintf(dir, len, "/sys/fs/cgroup/%s%s", controller, path);
+                fclose(f);
+                return 1;
+            }
+        }
+    }
+
+    fclose(f);
+    return version;
+}
+
+/* Reads the first two numbers of a cgroup file, 'max' counts as none */
+static int nobita_cgroup_read(
+    const char *dir, const char *file, unsigned long long *a,
+    unsigned long long *b
+)
+{
+    char *path = nobita_strjoinl(NOBITA_PATHSEP, dir, file, NULL);
+    FILE *f = (path != NULL) ? fopen(path, "r") : NULL;
+    free(path);
+    if (f == NULL)
+        return 0;
+
+    int read = fscanf(f, "%llu %llu", a, b);
+    fclose(f);
+    return (read > 0) ? read : 0;
+}
+#endif /* _WIN32 */
+
+/*
+ * Available memory in KiB, the smaller of MemAvailable and what's left
+ * under the cgroup's memory limit, SIZE_MAX if neither can be read
+ */
+static size_t nobita_mem_available(void)
+{
+    size_t avail = SIZE_MAX;
+#ifndef _WIN32
+    char line[4096];
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL)
+            if (sscanf(line, "MemAvailable: %zu kB", &avail) == 1)
+                break;
+
+        fclose(f);
+    }
+
+    char dir[4096];
+    unsigned long long max = 0;
+    unsigned long long current = 0;
+    unsigned long long unused = 0;
+    bool limited = false;
+    switch (nobita_cgroup_dir("memory", dir, sizeof(dir))) {
+    case 1:
+        limited = nobita_cgroup_read(dir, "memory.limit_in_bytes", &max, &unused);
+        nobita_cgroup_read(dir, "memory.usage_in_bytes", &current, &unused);
+        break;
+    case 2:
+        limited = nobita_cgroup_read(dir, "memory.max", &max, &unused);
+        nobita_cgroup_read(dir, "memory.current", &current, &unused);
+        break;
+    }
+
+    if (limited) {
+        size_t left = (current < max) ? (size_t)((max - current) / 1024) : 0;
+        avail = (left < avail) ? left : avail;
+    }
+#endif /* _WIN32 */
+
+    return avail;
+}
+
+/*
+ * The default process count, the CPUs this process may run on capped by
+ * the cgroup's CPU quota
+ */
+static size_t nobita_default_proc_count(void)
+{
+    size_t count = 0;
+#ifndef _WIN32
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        count = CPU_COUNT(&set);
+#endif /* __linux__ */
+
+    if (count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (online > 0) ? (size_t)online : 4;
+    }
+
+    char dir[4096];
+    unsigned long long quota = 0;
+    unsigned long long period = 0;
+    int read = 0;
+    switch (nobita_cgroup_dir("cpu", dir, sizeof(dir))) {
+    case 1:
+        read = nobita_cgroup_read(dir, "cpu.cfs_quota_us", &quota, &period);
+        read += nobita_cgroup_read(dir, "cpu.cfs_period_us", &period, &quota);
+        break;
+    case 2:
+        read = nobita_cgroup_read(dir, "cpu.max", &quota, &period);
+        break;
+    }
+
+    /* A negative v1 quota reads as a huge number, same as no quota */
+    if (read == 2 && period > 0 && quota / period < count) {
+        size_t cpus = (size_t)((quota + period - 1) / period);
+        count = (cpus > 0) ? cpus : 1;
+    }
+#else
+    count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    count = (count > 0) ? count : 4;
+#endif /* _WIN32 */
+
+    return count;
+}
+
+/*
+ * Whether the load average is over what was given with -l, with at least
+ * one process running there's no point starting more on a busy host
+ */
+static bool nobita_load_too_high(struct nobita_build *b)
+{
+#ifndef _WIN32
+    double load = 0;
+    if (b->max_load <= 0 || b->procs_used == 0 || getloadavg(&load, 1) != 1)
+        return false;
+
+    return load > b->max_load;
+#else
+    (void)b;
+    return false;
+#endif /* _WIN32 */
+}
+
+#ifdef __linux__
+/* Adds the CPUs of a list like '0-3,8-11' to mask */
+static void nobita_cpu_list_parse(const char *list, cpu_set_t *mask)
+{
+    while (*list != 0) {
+        char *end = NULL;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+        if (end == list)
+            break;
+
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, mask);
+
+        list = (*end == ',') ? end + 1 : end;
+        if (*list == '\n')
+            break;
+    }
+}
+#endif /* __linux__ */
+
+/*
+ * Splits the CPUs this process may use into the sets processes get pinned
+ * to, one set per NUMA node or one per CPU for the core policy
+ */
+static void nobita_pin_init(struct nobita_build *b)
+{
+    if (b->pin == NOBITA_PIN_NONE)
+        return;
+
+    struct nobita_cpu_set set;
+    memset(&set, 0, sizeof(set));
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+
+    glob_t g;
+    if (b->pin != NOBITA_PIN_CORE &&
+            glob("/sys/devices/system/node/node[0-9]*/cpulist", 0, NULL, &g)
+            == 0) {
+        for (size_t i = 0; i < g.gl_pathc; i++) {
+            char list[4096] = {0};
+            FILE *f = fopen(g.gl_pathv[i], "r");
+            if (f == NULL)
+                continue;
+
+            if (fgets(list, sizeof(list), f) != NULL) {
+                CPU_ZERO(&set.mask);
+                nobita_cpu_list_parse(list, &set.mask);
+                CPU_AND(&set.mask, &set.mask, &allowed);
+                if (CPU_COUNT(&set.mask) > 0)
+                    vector_append(b, cpu_sets, set);
+            }
+
+            fclose(f);
+        }
+
+        globfree(&g);
+    }
+
+    if (b->pin == NOBITA_PIN_CORE) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed))
+                continue;
+
+            CPU_ZERO(&set.mask);
+            CPU_SET(cpu, &set.mask);
+            vector_append(b, cpu_sets, set);
+        }
+    } else if (b->cpu_sets_used == 0) {
+        set.mask = allowed;
+        vector_append(b, cpu_sets, set);
+    }
+#elif defined(_WIN32)
+    DWORD_PTR allowed = 0;
+    DWORD_PTR system = 0;
+    ULONG highest = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &allowed, &system))
+        return;
+
+    if (b->pin != NOBITA_PIN_CORE && GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG node = 0; node <= highest; node++) {
+            ULONGLONG mask = 0;
+            if (!GetNumaNodeProcessorMask((UCHAR)node, &mask))
+                continue;
+
+            set.mask = (DWORD_PTR)mask & allowed;
+            if (set.mask != 0)
+                vector_append(b, cpu_sets, set);
+        }
+    }
+
+    if (b->pin == NOBITA_PIN_CORE) {
+        for (size_t cpu = 0; cpu < sizeof(allowed) * 8; cpu++) {
+            set.mask = allowed & ((DWORD_PTR)1 << cpu);
+            if (set.mask != 0)
+                vector_append(b, cpu_sets, set);
+        }
+    } else if (b->cpu_sets_used == 0) {
+        set.mask = allowed;
+        vector_append(b, cpu_sets, set);
+    }
+#else
+    fprintf(
+        stderr,
+        "\tNOBITA\tWARNING: Pinning is only done on Linux and Windows, "
+        "processes will run where the system puts them\n"
+    );
+    return;
+#endif /* __linux__ */
+
+    if (b->pin == NOBITA_PIN_LINK && b->cpu_sets_used < 2)
+        fprintf(
+            stderr,
+            "\tNOBITA\tWARNING: There's only one NUMA node, link processes "
+            "will share it with the rest\n"
+        );
+}
+
+/*
+ * Which set of CPUs a process should be pinned to, the one with the least
+ * processes running on it going round robin on ties, with the link policy
+ * links get the last NUMA node to themselves and everything else the rest
+ */
+static struct nobita_cpu_set *
+nobita_pin_pick(struct nobita_build *b, enum nobita_action action)
+{
+    if (b->pin == NOBITA_PIN_NONE || b->cpu_sets_used == 0)
+        return NULL;
+
+    size_t count = b->cpu_sets_used;
+    if (b->pin == NOBITA_PIN_LINK && count > 1) {
+        if (action == NOBITA_ACT_LINK)
+            return &b->cpu_sets[count - 1];
+
+        count -= 1;
+    }
+
+    struct nobita_cpu_set *best = NULL;
+    for (size_t i = 0; i < count; i++) {
+        struct nobita_cpu_set *set =
+            &b->cpu_sets[(b->pin_next + i) % count];
+        if (best == NULL || set->running < best->running)
+            best = set;
+    }
+
+    b->pin_next += 1;
+    return best;
+}
+
+/*
+ * Predicted peak RSS in KiB of an action, from the last time it ran or a
+ * rough guess for it's kind if it never ran before
+ */
+static size_t nobita_mem_predict(
+    struct nobita_build *b, enum nobita_action action, const char *key
+)
+{
+    const char *rss = (key != NULL) ? nobita_state_get(b, "rss", key) : NULL;
+    size_t kib = 0;
+    if (rss != NULL && sscanf(rss, "%zu", &kib) == 1)
+        return kib;
+
+    switch (action) {
+    case NOBITA_ACT_COMPILE:
+        return 256 * 1024;
+    case NOBITA_ACT_LINK:
+        return 1024 * 1024;
+    case NOBITA_ACT_ARCHIVE:
+        return 64 * 1024;
+    case NOBITA_ACT_CUSTOM_CMD:
+        return 128 * 1024;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether a process predicted to peak at rss KiB fits right now, what's
+ * running is held against the memory that was available when the queue
+ * was last empty since it may not have peaked yet, and a lone process is
+ * always let through
+ */
+static bool nobita_mem_admit(struct nobita_build *b, size_t rss)
+{
+    if (!b->mem_check)
+        return true;
+
+    if (b->procs_used == 0) {
+        b->mem_budget = nobita_mem_available();
+        return true;
+    }
+
+    size_t committed = rss;
+    for (size_t i = 0; i < b->procs_used; i++)
+        committed += b->procs[i].rss;
+
+    return committed <= b->mem_budget && rss <= nobita_mem_available();
+}
+
+#define NOBITA_HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, chain calls by passing the previous result as h */
+static uint64_t nobita_hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/*
+ * Reads a whole file into a null terminated buffer that you have to free,
+ * len can be NULL
+ */
+static char *nobita_read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *buf = (size >= 0) ? malloc(size + 1) : NULL;
+    if (buf == NULL || fread(buf, 1, size, f) != (size_t)size) {
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+
+    fclose(f);
+    buf[size] = 0;
+    if (len != NULL)
+        *len = size;
+
+    return buf;
+}
+
+/*
+ * The build state is what nobita remembers between runs (peak memory of
+ * actions and such), kept as 'kind\tkey\tvalue' lines in
+ * nobita-cache/nobita-state of the root build
+ */
+static uint64_t nobita_state_hash(const char *kind, const char *key)
+{
+    uint64_t h = nobita_hash(NOBITA_HASH_INIT, kind, strlen(kind) + 1);
+    return nobita_hash(h, key, strlen(key));
+}
+
+/*
+ * Entries are found through an open addressing index of their hashes, it's
+ * slots hold the entry's position plus one so zero is an empty slot
+ */
+static void nobita_state_index(struct nobita_build *b, size_t i)
+{
+    size_t mask = b->state_index_size - 1;
+    size_t slot = (size_t)b->state[i].hash & mask;
+    while (b->state_index[slot] != 0)
+        slot = (slot + 1) & mask;
+
+    b->state_index[slot] = i + 1;
+}
+
+/* Indexes the last entry, the index is grown to stay at most half full */
+static void nobita_state_index_last(struct nobita_build *b)
+{
+    if (b->state_used * 2 <= b->state_index_size) {
+        nobita_state_index(b, b->state_used - 1);
+        return;
+    }
+
+    size_t size = (b->state_index_size > 0) ? b->state_index_size * 2 : 256;
+    size_t *index = calloc(size, sizeof(*index));
+    if (index == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Out of memory\n");
+        return;
+    }
+
+    free(b->state_index);
+    b->state_index = index;
+    b->state_index_size = size;
+    for (size_t i = 0; i < b->state_used; i++)
+        nobita_state_index(b, i);
+}
+
+/* Finds an entry, which marks it as still in use so it's saved again */
+static struct nobita_state_entry *
+nobita_state_find(struct nobita_build *b, const char *kind, const char *key)
+{
+    b = b->root;
+    if (b->state_index_size == 0)
+        return NULL;
+
+    uint64_t h = nobita_state_hash(kind, key);
+    size_t mask = b->state_index_size - 1;
+    for (size_t slot = (size_t)h & mask; b->state_index[slot] != 0;
+            slot = (slot + 1) & mask) {
+        struct nobita_state_entry *e = &b->state[b->state_index[slot] - 1];
+        if (e->hash == h && strcmp(e->kind, kind) == 0 &&
+                strcmp(e->key, key) == 0) {
+            e->used = true;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* Adds an entry that isn't there yet, value is taken over */
+static void nobita_state_add(
+    struct nobita_build *b, const char *kind, const char *key, char *value,
+    bool used
+)
+{
+    struct nobita_state_entry n;
+    n.hash = nobita_state_hash(kind, key);
+    n.kind = nobita_strdup(kind);
+    n.key = nobita_strdup(key);
+    n.value = value;
+    n.used = used;
+    vector_append(b, state, n);
+    if (nobita_build_failed) {
+        free(n.kind);
+        free(n.key);
+        free(n.value);
+        return;
+    }
+
+    nobita_state_index_last(b);
+}
+
+static const char *
+nobita_state_get(struct nobita_build *b, const char *kind, const char *key)
+{
+    struct nobita_state_entry *e = nobita_state_find(b, kind, key);
+    return (e != NULL) ? e->value : NULL;
+}
+
+static void nobita_state_set(
+    struct nobita_build *b, const char *kind, const char *key,
+    const char *value
+)
+{
+    if (nobita_build_failed)
+        return;
+
+    b = b->root;
+    struct nobita_state_entry *e = nobita_state_find(b, kind, key);
+    if (e != NULL && strcmp(e->value, value) == 0)
+        return;
+
+    char *v = nobita_strdup(value);
+    if (v == NULL)
+        return;
+
+    b->state_dirty = true;
+    if (e != NULL) {
+        free(e->value);
+        e->value = v;
+        return;
+    }
+
+    nobita_state_add(b, kind, key, v, true);
+}
+
+static void nobita_state_setf(
+    struct nobita_build *b, const char *kind, const char *key,
+    const char *fmt, ...
+)
+{
+    char value[256];
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(value, sizeof(value), fmt, va);
+    va_end(va);
+    nobita_state_set(b, kind, key, value);
+}
+
+/*
+ * Tabs and newlines separate the state's fields and lines, so they're
+ * written as '\t' and '\n' and backslashes as '\\'
+ */
+static void nobita_state_escape(FILE *f, const char *s, char end)
+{
+    for (; *s != 0; s++) {
+        if (*s == '\\' || *s == '\t' || *s == '\n')
+            fputc('\\', f);
+
+        fputc((*s == '\t') ? 't' : (*s == '\n') ? 'n' : *s, f);
+    }
+
+    fputc(end, f);
+}
+
+static void nobita_state_unescape(char *s)
+{
+    char *out = s;
+    for (; *s != 0; s++) {
+        if (*s == '\\' && (s[1] == 't' || s[1] == 'n' || s[1] == '\\')) {
+            s++;
+            *out++ = (*s == 't') ? '\t' : (*s == 'n') ? '\n' : '\\';
+        } else {
+            *out++ = *s;
+        }
+    }
+
+    *out = 0;
+}
+
+static void nobita_state_load(struct nobita_build *b)
+{
+    b->state_path = nobita_strjoinl(
+        NOBITA_PATHSEP, b->ced, "nobita-cache", "nobita-state", NULL
+    );
+
+    char *buf = (b->state_path != NULL)
+        ? nobita_read_file(b->state_path, NULL)
+        : NULL;
+
+    if (buf == NULL)
+        return;
+
+    char *line = buf;
+    while (*line != 0 && !nobita_build_failed) {
+        char *end = line + strcspn(line, "\n");
+        bool last = *end == 0;
+        *end = 0;
+
+        char *key = strchr(line, '\t');
+        char *value = (key != NULL) ? strchr(key + 1, '\t') : NULL;
+        if (value != NULL) {
+            *key++ = 0;
+            *value++ = 0;
+            nobita_state_unescape(line);
+            nobita_state_unescape(key);
+            nobita_state_unescape(value);
+            nobita_state_add(b, line, key, nobita_strdup(value), false);
+        }
+
+        if (last)
+            break;
+
+        line = end + 1;
+    }
+
+    free(buf);
+}
+
+/*
+ * Writes the state out, after a build that went through every job what
+ * wasn't looked at is left out as it's for things that no longer exist
+ */
+static void nobita_state_save(struct nobita_build *b)
+{
+    for (size_t i = 0; i < b->state_used && b->state_prune; i++)
+        b->state_dirty = b->state_dirty || !b->state[i].used;
+
+    if (!b->state_dirty || b->state_path == NULL)
+        return;
+
+    /* Not nobita_strjoinl, what did finish is worth keeping after a failure */
+    size_t len = strlen(b->state_path) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    if (tmp != NULL)
+        snprintf(tmp, len, "%s.tmp", b->state_path);
+
+    FILE *f = (tmp != NULL) ? fopen(tmp, "wb") : NULL;
+    if (f == NULL) {
+        fprintf(stderr,
+            "\tNOBITA\tWARNING: Could not save the build state to %s\n",
+            b->state_path
+        );
+
+        free(tmp);
+        return;
+    }
+
+    for (size_t i = 0; i < b->state_used; i++) {
+        if (b->state_prune && !b->state[i].used)
+            continue;
+
+        nobita_state_escape(f, b->state[i].kind, '\t');
+        nobita_state_escape(f, b->state[i].key, '\t');
+        nobita_state_escape(f, b->state[i].value, '\n');
+    }
+
+    fclose(f);
+#ifdef _WIN32
+    remove(b->state_path);
+#endif /* _WIN32 */
+    rename(tmp, b->state_path);
+    free(tmp);
+    b->state_dirty = false;
+}
+
+static void nobita_state_free(struct nobita_build *b)
+{
+    for (size_t i = 0; i < b->state_used; i++) {
+        free(b->state[i].kind);
+        free(b->state[i].key);
+        free(b->state[i].value);
+    }
+
+    vector_free(b, state);
+    free(b->state_index);
+    free(b->state_path);
+}
+
+#ifndef _WIN32
+/*
+ * Opens the read end of a jobserver pipe or fifo as a separate non-blocking
+ * file description so reads can't block and it doesn't change the mode for
+ * everyone else sharing the jobserver
+ */
+static int nobita_jobserver_open_read(int fd, const char *fifo)
+{
+    char proc_fd[64];
+    if (fifo == NULL) {
+        snprintf(proc_fd, sizeof(proc_fd), "/proc/self/fd/%d", fd);
+        fifo = proc_fd;
+    }
+
+    int rfd = open(fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    return (rfd != -1) ? rfd : fd;
+}
+#endif /* _WIN32 */
+
+/*
+ * Joins the jobserver from MAKEFLAGS if there is one, both the
+ * '--jobserver-auth=fifo:PATH' and the older 'R,W' pipe styles
+ */
+static void nobita_jobserver_client_init(
+    struct nobita_build *b, bool proc_count_given
+)
+{
+    b->js_read = -1;
+    b->js_write = -1;
+#ifndef _WIN32
+    const char *flags = getenv("MAKEFLAGS");
+    if (flags == NULL)
+        return;
+
+    const char *auth = NULL;
+    const char *opts[] = {"--jobserver-auth=", "--jobserver-fds="};
+    for (size_t i = 0; i < 2 && auth == NULL; i++) {
+        for (const char *s = strstr(flags, opts[i]); s != NULL;
+                s = strstr(s + 1, opts[i]))
+            auth = s + strlen(opts[i]);
+    }
+
+    if (auth == NULL)
+        return;
+
+    size_t len = strcspn(auth, " ");
+    int rfd = -1;
+    int wfd = -1;
+    if (strncmp(auth, "fifo:", 5) == 0) {
+        char *fifo = malloc(len - 4);
+        if (fifo == NULL)
+            return;
+
+        memcpy(fifo, auth + 5, len - 5);
+        fifo[len - 5] = 0;
+        rfd = nobita_jobserver_open_read(-1, fifo);
+        wfd = (rfd != -1) ? open(fifo, O_WRONLY | O_CLOEXEC) : -1;
+        free(fifo);
+    } else if (sscanf(auth, "%d,%d", &rfd, &wfd) == 2) {
+        /* make only hands the fds to recipes marked with '+' or $(MAKE) */
+        if (fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1) {
+            rfd = -1;
+            wfd = -1;
+        } else {
+            rfd = nobita_jobserver_open_read(rfd, NULL);
+        }
+    }
+
+    if (rfd == -1 || wfd == -1) {
+        fprintf(stderr,
+            "\tNOBITA\tWARNING: The jobserver in MAKEFLAGS is unavailable, "
+            "using the process count instead\n"
+        );
+
+        return;
+    }
+
+    b->js_read = rfd;
+    b->js_write = wfd;
+
+    size_t jobs = 0;
+    for (const char *s = strstr(flags, "-j"); s != NULL; s = strstr(s + 1, "-j"))
+        if (s == flags || s[-1] == ' ')
+            sscanf(s + 2, "%zu", &jobs);
+
+    printf("\tNOBITA\tJOBSERVER  = %.*s\n", (int)len, auth);
+    if (!proc_count_given && jobs > 0) {
+        nobita_max_proc_count = jobs;
+        printf("\tNOBITA\tPROC_COUNT = %zu\n", nobita_max_proc_count);
+    }
+#else
+    (void)proc_count_given;
+#endif /* _WIN32 */
+}
+
+/*
+ * Makes this build the jobserver for it's children (make, nested nobita
+ * or anything else that understands MAKEFLAGS), style is "fifo" or "pipe"
+ */
+static void
+nobita_jobserver_server_init(struct nobita_build *b, const char *style)
+{
+#ifndef _WIN32
+    if (b->js_read != -1)
+        return;
+
+    int fds[2] = {-1, -1};
+    char *auth = NULL;
+    if (strcmp(style, "fifo") == 0) {
+        char pid[32];
+        snprintf(pid, sizeof(pid), "jobserver-%d", (int)getpid());
+        char *cache = nobita_strjoinl(
+            NOBITA_PATHSEP, b->ced, "nobita-cache", NULL
+        );
+        b->js_fifo = nobita_strjoinl(NOBITA_PATHSEP, cache, pid, NULL);
+        nobita_mkdir_recursive(cache);
+        free(cache);
+        if (b->js_fifo == NULL)
+            return;
+
+        if (mkfifo(b->js_fifo, 0600) == 0) {
+            fds[0] = nobita_jobserver_open_read(-1, b->js_fifo);
+            fds[1] = open(b->js_fifo, O_WRONLY | O_CLOEXEC);
+        }
+
+        auth = nobita_strjoinl("", "--jobserver-auth=fifo:", b->js_fifo, NULL);
+    } else if (strcmp(style, "pipe") == 0) {
+        char a[128];
+        if (pipe(fds) == 0) {
+            snprintf(a, sizeof(a),
+                "--jobserver-auth=%d,%d --jobserver-fds=%d,%d",
+                fds[0], fds[1], fds[0], fds[1]
+            );
+            fds[0] = nobita_jobserver_open_read(fds[0], NULL);
+        }
+
+        auth = nobita_strdup(a);
+    } else {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Unknown jobserver style %s, it's either fifo or "
+            "pipe\n", style
+        );
+
+        return;
+    }
+
+    if (fds[0] == -1 || fds[1] == -1 || auth == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Could not create the jobserver\n");
+        free(auth);
+        return;
+    }
+
+    /* A token that didn't make it in would be one process less for good */
+    for (size_t i = 1; i < nobita_max_proc_count; i++) {
+        ssize_t n = write(fds[1], "+", 1);
+        if (n == 1)
+            continue;
+
+        if (n == -1 && errno == EINTR) {
+            i--;
+            continue;
+        }
+
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: Could not fill the jobserver (%s)\n",
+            strerror(errno)
+        );
+
+        close(fds[0]);
+        close(fds[1]);
+        free(auth);
+        return;
+    }
+
+    char jobs[32];
+    snprintf(jobs, sizeof(jobs), "-j%zu", nobita_max_proc_count);
+    const char *flags = getenv("MAKEFLAGS");
+    char *makeflags = (flags == NULL || *flags == 0)
+        ? nobita_strjoinl(" ", jobs, auth, NULL)
+        : nobita_strjoinl(" ", flags, jobs, auth, NULL);
+
+    if (makeflags != NULL)
+        setenv("MAKEFLAGS", makeflags, 1);
+
+    b->js_read = fds[0];
+    b->js_write = fds[1];
+    printf("\tNOBITA\tJOBSERVER  = %s\n", auth);
+    free(makeflags);
+    free(auth);
+#else
+    (void)b;
+    (void)style;
+    printf("\tNOBITA\tThe jobserver is not supported on windows...\n");
+#endif /* _WIN32 */
+}
+
+/*
+ * Takes a job slot, the first process runs on the implicit token,
+ * returns false if there's no token available right now
+ */
+static bool nobita_jobserver_acquire(struct nobita_build *b)
+{
+    if (b->js_read == -1 || b->procs_used == 0)
+        return true;
+
+#ifndef _WIN32
+    char token = 0;
+    struct pollfd p = {.fd = b->js_read, .events = POLLIN};
+    if (poll(&p, 1, 0) <= 0 || read(b->js_read, &token, 1) != 1)
+        return false;
+
+    vector_append(b, js_tokens, token);
+#endif /* _WIN32 */
+
+    return true;
+}
+
+/* Gives back the tokens the processes still running don't need */
+static void nobita_jobserver_release(struct nobita_build *b)
+{
+#ifndef _WIN32
+    size_t keep = (b->procs_used > 0) ? b->procs_used - 1 : 0;
+    while (b->js_tokens_used > keep) {
+        char token = b->js_tokens[b->js_tokens_used - 1];
+        if (write(b->js_write, &token, 1) == -1 && errno == EINTR)
+            continue;
+
+        b->js_tokens_used -= 1;
+    }
+#else
+    (void)b;
+#endif /* _WIN32 */
+}
+
+/* Waits a bit for either a token or one of our processes to finish */
+static void nobita_jobserver_wait(struct nobita_build *b)
+{
+#ifndef _WIN32
+    struct pollfd p = {.fd = b->js_read, .events = POLLIN};
+    poll(&p, 1, 50);
+    nobita_proc_reap(b, false);
+#else
+    nobita_proc_wait_one(b);
+#endif /* _WIN32 */
+}
+
+static void nobita_jobserver_free(struct nobita_build *b)
+{
+#ifndef _WIN32
+    nobita_jobserver_release(b);
+    if (b->js_read != -1)
+        close(b->js_read);
+
+    if (b->js_write != -1)
+        close(b->js_write);
+
+    if (b->js_fifo != NULL)
+        unlink(b->js_fifo);
+#endif /* _WIN32 */
+
+    free(b->js_fifo);
+    vector_free(b, js_tokens);
+}
+
+void nobita_mkdir_recursive(const char *path)
+{
+    if (nobita_build_failed)
+        return;
+
+    char *p2 = nobita_strdup(path);
+    if (p2 == NULL) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr,
+            "\tNOBITA\tERROR: Could not copy path '%s' for mkdir recursive\n",
+            path
+        );
+        return;
+    }
+
+    size_t len = strlen(p2);
+    for (size_t i = 1; i < len; i++) {
+        if (p2[i] == *NOBITA_PATHSEP) {
+            p2[i] = 0;
+
+            if (!nobita_dir_exist(p2)) {
+                printf("\tMKDIR\t%s\n", p2);
+                mkdir(p2, 0777);
+            }
+
+            p2[i] = *NOBITA_PATHSEP;
+        }
+    }
+
+    if (!nobita_dir_exist(p2)) {
+        printf("\tMKDIR\t%s\n", p2);
+        mkdir(p2, 0777);
+    }
+
+    free(p2);
+}
+
+bool nobita_is_a_newer(const char *a, const char *b)
+{
+    if (!nobita_file_exist(b))
+        return true;
+    else if (!nobita_file_exist(a))
+        return false;
+
+#ifndef _WIN32
+    struct stat s_a, s_b;
+    memset(&s_a, 0, sizeof(s_a));
+    memset(&s_b, 0, sizeof(s_b));
+    stat(a, &s_a);
+    stat(b, &s_b);
+    if (s_a.NOBITA_MTIM.tv_sec != s_b.NOBITA_MTIM.tv_sec)
+        return (s_a.NOBITA_MTIM.tv_sec > s_b.NOBITA_MTIM.tv_sec);
+
+    return (s_a.NOBITA_MTIM.tv_nsec > s_b.NOBITA_MTIM.tv_nsec);
+#else
+    WIN32_FILE_ATTRIBUTE_DATA s_a, s_b;
+    memset(&s_a, 0, sizeof(s_a));
+    memset(&s_b, 0, sizeof(s_b));
+    GetFileAttributesExA(a, GetFileExInfoStandard, &s_a);
+    GetFileAttributesExA(b, GetFileExInfoStandard, &s_b);
+    return CompareFileTime(&s_a.ftLastWriteTime, &s_b.ftLastWriteTime) == 1;
+#endif /* _WIN32 */
+}
+
+/*
+ * Reads the prerequisites of a make style depfile (the ones gcc and clang
+ * write with -MMD), the paths point into d->buf so free it when done
+ */
+struct nobita_depfile {
+    char *buf;
+
+    size_t deps_used;
+    size_t deps_size;
+    char **deps;
+};
+
+static bool nobita_depfile_read(const char *depfile, struct nobita_depfile *d)
+{
+    memset(d, 0, sizeof(*d));
+    FILE *f = fopen(depfile, "rb");
+    if (f == NULL)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *raw = malloc(len + 1);
+    d->buf = malloc(len + 1);
+    if (raw == NULL || d->buf == NULL || fread(raw, 1, len, f) != (size_t)len) {
+        fclose(f);
+        free(raw);
+        return false;
+    }
+
+    fclose(f);
+    raw[len] = 0;
+    vector_init(d, deps);
+
+    char *r = raw;
+    char *w = d->buf;
+    bool in_target = true;
+    while (*r != 0 && !nobita_build_failed) {
+        if (r[0] == '\\' && (r[1] == '\n' || r[1] == '\r')) {
+            r += (r[1] == '\r' && r[2] == '\n') ? 3 : 2;
+            continue;
+        }
+
+        if (*r == ' ' || *r == '\t' || *r == '\r' || *r == '\n') {
+            in_target = in_target || *r == '\n';
+            r++;
+            continue;
+        }
+
+        char *start = w;
+        while (*r != 0 && *r != ' ' && *r != '\t' && *r != '\r' &&
+                *r != '\n') {
+            if (r[0] == '\\' && (r[1] == '\n' || r[1] == '\r'))
+                break;
+
+            if (r[0] == '\\' && (r[1] == ' ' || r[1] == '#')) {
+                *w++ = r[1];
+                r += 2;
+            } else if (r[0] == '$' && r[1] == '$') {
+                *w++ = '$';
+                r += 2;
+            } else {
+                *w++ = *r++;
+            }
+        }
+
+        *w++ = 0;
+        if (in_target) {
+            /* Everything up to the 'target:' word is the rule's target */
+            in_target = w[-2] != ':';
+            continue;
+        }
+
+        vector_append(d, deps, start);
+    }
+
+    free(raw);
+    return !nobita_build_failed;
+}
+
+static void nobita_depfile_free(struct nobita_depfile *d)
+{
+    free(d->buf);
+    vector_free(d, deps);
+    d->buf = NULL;
+}
+
+/*
+ * True if any of the prerequisites in the depfile is newer than output
+ * or if the depfile can't be read at all
+ */
+static bool nobita_depfile_is_newer(const char *depfile, const char *output)
+{
+    struct nobita_depfile d;
+    if (!nobita_depfile_read(depfile, &d)) {
+        nobita_depfile_free(&d);
+        return true;
+    }
+
+    bool newer = false;
+    for (size_t i = 0; i < d.deps_used && !newer; i++)
+        newer = !nobita_file_exist(d.deps[i]) ||
+            nobita_is_a_newer(d.deps[i], output);
+
+    nobita_depfile_free(&d);
+    return newer;
+}
+
+bool nobita_file_exist(const char *path)
+{
+#ifndef _WIN32
+    struct stat buf;
+    if (stat(path, &buf) == -1)
+        return false;
+
+    return !S_ISDIR(buf.st_mode);
+#else
+    WIN32_FILE_ATTRIBUTE_DATA s;
+    memset(&s, 0, sizeof(s));
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &s) == 0)
+        return false;
+
+    return !(s.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+#endif /* _WIN32 */
+}
+
+bool nobita_dir_exist(const char *path)
+{
+#ifndef _WIN32
+    struct stat buf;
+    if (stat(path, &buf) == -1)
+        return false;
+
+    return S_ISDIR(buf.st_mode);
+#else
+    WIN32_FILE_ATTRIBUTE_DATA s;
+    memset(&s, 0, sizeof(s));
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &s) == 0)
+        return false;
+
+    return (s.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+#endif /* _WIN32 */
+}
+
+static size_t nobita_file_size(const char *path)
+{
+#ifndef _WIN32
+    struct stat buf;
+    if (stat(path, &buf) == -1)
+        return 0;
+
+    return (size_t)buf.st_size;
+#else
+    WIN32_FILE_ATTRIBUTE_DATA s;
+    memset(&s, 0, sizeof(s));
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &s) == 0)
+        return 0;
+
+    return (size_t)(((uint64_t)s.nFileSizeHigh << 32) | s.nFileSizeLow);
+#endif /* _WIN32 */
+}
+
+/* Seconds from some fixed point, only good for measuring how long it took */
+static double nobita_now(void)
+{
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)GetTickCount64() / 1000.0;
+#endif /* _WIN32 */
+}
+
+/* Whether a source is C++, module interfaces included */
+static bool nobita_is_cpp(const char *ext)
+{
+    return strcmp(ext, ".cpp") == 0 || strcmp(ext, ".cc") == 0 ||
+        strcmp(ext, ".cppm") == 0 || strcmp(ext, ".ixx") == 0;
+}
+
+static void nobita_module_unit_free(struct nobita_module_unit *m)
+{
+    if (m == NULL)
+        return;
+
+    for (size_t i = 0; i < m->imports_used; i++)
+        free(m->imports[i]);
+
+    vector_free(m, imports);
+    free(m->modmap);
+    free(m->bmi_dir);
+    free(m->name);
+    free(m->bmi);
+    free(m);
+}
+
+static struct nobita_job *nobita_job_new(
+    struct nobita_target *t, enum nobita_action action, const char *label,
+    const char *out
+)
+{
+    if (nobita_build_failed)
+        return NULL;
+
+    struct nobita_build *b = t->b->root;
+    struct nobita_job *j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Could not create a job for target %s\n",
+            t->name
+        );
+
+        return NULL;
+    }
+
+    j->action = action;
+    j->t = t;
+    j->label = label;
+    j->out = (out != NULL) ? nobita_strdup(out) : NULL;
+    j->index = b->jobs_used;
+    j->threads = 1;
+    vector_init(j, cmd);
+    vector_init(j, inputs);
+    vector_init(j, deps);
+    vector_init(j, users);
+    vector_init(j, group);
+    vector_append(b, jobs, j);
+    if (nobita_build_failed) {
+        free(j->out);
+        vector_free(j, cmd);
+        vector_free(j, deps);
+        vector_free(j, users);
+        vector_free(j, group);
+        free(j);
+        return NULL;
+    }
+
+    return j;
+}
+
+static void nobita_job_add_dep(struct nobita_job *j, struct nobita_job *dep)
+{
+    if (j == NULL || dep == NULL || nobita_build_failed)
+        return;
+
+    vector_append(j, deps, dep);
+    vector_append(dep, users, j);
+    j->waiting += 1;
+}
+
+/* What the state file knows this job by, it's output if it has one */
+static const char *nobita_job_key(struct nobita_job *j)
+{
+    return (j->out != NULL) ? j->out : j->t->name;
+}
+
+static void nobita_job_free(struct nobita_job *j)
+{
+    nobita_module_unit_free(j->unit);
+    free(j->out);
+    free(j->rsp);
+    free(j->trace);
+    free(j->env[0]);
+    free(j->env[1]);
+    vector_free(j, cmd);
+    vector_free(j, inputs);
+    vector_free(j, deps);
+    vector_free(j, users);
+    vector_free(j, group);
+    free(j);
+}
+
+/* Copies a target's headers once everything it depends on is done */
+static void nobita_copy_headers(struct nobita_job *j)
+{
+    struct nobita_target *t = j->t;
+    for (size_t i = 0; i < t->headers_used; i++) {
+        char *parent = t->headers[i].parent;
+        char *header = t->headers[i].header;
+        char *src = nobita_strjoinl(NOBITA_PATHSEP, parent, header, NULL);
+        char *dest = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->include, header, NULL
+        );
+
+        nobita_dirname(dest);
+        nobita_mkdir_recursive(dest);
+        *strchr(dest, 0) = *NOBITA_PATHSEP;
+
+        if (nobita_is_a_newer(src, dest))
+            nobita_cp(dest, src);
+
+        free(src);
+        free(dest);
+    }
+}
+
+/* What a target's sources are compiled with for it's kind of LTO */
+static const char *nobita_lto_flag(struct nobita_target *t)
+{
+    switch (t->comp_opts.bt) {
+    case NOBITA_BT_GCC:
+        return "-flto";
+    case NOBITA_BT_LLVM:
+        return (t->lto == NOBITA_LTO_THIN) ? "-flto=thin" : "-flto=full";
+    case NOBITA_BT_MSVC:
+        return "/GL";
+    }
+
+    return NULL;
+}
+
+static bool nobita_target_split_dwarf(struct nobita_target *t)
+{
+    return t->comp_opts.bt != NOBITA_BT_MSVC &&
+        (t->split_dwarf || t->b->root->split_dwarf);
+}
+
+/* Where GCC keeps the profile of an object, next to it as a .gcda */
+static char *nobita_gcda(const char *obj)
+{
+    const char *dot = strrchr(obj, '.');
+    size_t len = (dot != NULL) ? (size_t)(dot - obj) : strlen(obj);
+    char *gcda = malloc(len + sizeof(".gcda"));
+    if (gcda == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Out of memory\n");
+        return NULL;
+    }
+
+    memcpy(gcda, obj, len);
+    memcpy(gcda + len, ".gcda", sizeof(".gcda"));
+    return gcda;
+}
+
+/*
+ * The object of the instrumented build for one of the target's objects,
+ * it's path in the target's pgo dir instead of it's usual cache dir
+ */
+static char *nobita_pgo_object(struct nobita_target *t, const char *obj)
+{
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+        nobita_cache_kind(t->target_type), NULL
+    );
+    char *pgo = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "pgo", NULL
+    );
+
+    char *gen = NULL;
+    if (dir != NULL && pgo != NULL && strncmp(obj, dir, strlen(dir)) == 0)
+        gen = nobita_strjoinl("", pgo, obj + strlen(dir), NULL);
+
+    free(dir);
+    free(pgo);
+    return gen;
+}
+
+/*
+ * Writes a generated source only if it changed, so what includes it isn't
+ * recompiled for nothing, returns whether it did
+ */
+static bool nobita_write_changed(const char *path, const char *buf, size_t n)
+{
+    size_t old_len = 0;
+    char *old = nobita_read_file(path, &old_len);
+    bool changed = old == NULL || old_len != n || memcmp(old, buf, n) != 0;
+    if (changed) {
+        FILE *f = fopen(path, "wb");
+        if (f != NULL) {
+            fwrite(buf, 1, n, f);
+            fclose(f);
+        } else {
+            nobita_build_failed = true;
+            fprintf(stderr, "\tNOBITA\tERROR: Could not write %s\n", path);
+        }
+    }
+
+    free(old);
+    return changed;
+}
+
+/*
+ * Adds the job that precompiles a target's header for C or C++ sources,
+ * it sits in a directory named after the hash of everything that has to
+ * match for a compile to use it, so targets where all of it matches share
+ * one job, GCC finds the .gch next to a stub header that includes the
+ * real one and uses the stub itself if the .gch doesn't fit
+ */
+static void nobita_plan_pch(struct nobita_target *t, bool cpp)
+{
+    if (t->pch == NULL || t->comp_opts.bt == NOBITA_BT_MSVC ||
+            nobita_build_failed)
+        return;
+
+    struct nobita_job tmp = {0};
+    vector_init(&tmp, cmd);
+    vector_append(&tmp, cmd, (cpp) ? t->comp_opts.cxx : t->comp_opts.cc);
+    vector_append_vector(&tmp, cmd, t, cflags);
+    if (nobita_target_split_dwarf(t))
+        vector_append(&tmp, cmd, "-gsplit-dwarf");
+
+    if (t->lto != NOBITA_LTO_NONE)
+        vector_append(&tmp, cmd, (char *)nobita_lto_flag(t));
+
+    vector_append(&tmp, cmd, "-x");
+    vector_append(&tmp, cmd, (cpp) ? "c++-header" : "c-header");
+
+    uint64_t h = nobita_hash(NOBITA_HASH_INIT, t->pch, strlen(t->pch) + 1);
+    for (size_t i = 0; i < tmp.cmd_used && !nobita_build_failed; i++)
+        h = nobita_hash(h, tmp.cmd[i], strlen(tmp.cmd[i]) + 1);
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016" PRIx64, h);
+    const char *base = strrchr(t->pch, *NOBITA_PATHSEP);
+    base = (base != NULL) ? base + 1 : t->pch;
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", "pch", hash, NULL
+    );
+    char *stub = nobita_strjoinl(NOBITA_PATHSEP, dir, base, NULL);
+    char *out = nobita_strjoinl("", stub,
+        (t->comp_opts.bt == NOBITA_BT_GCC) ? ".gch" : ".pch", NULL
+    );
+    char *depfile = nobita_strjoinl("", stub, ".d", NULL);
+    struct nobita_build *b = t->b->root;
+    for (size_t i = 0; i < b->pchs_used && out != NULL; i++) {
+        if (strcmp(b->pchs[i]->out, out) == 0) {
+            t->pch_jobs[cpp] = b->pchs[i];
+            nobita_job_add_dep(b->pchs[i], t->gen);
+        }
+    }
+
+    struct nobita_job *j = NULL;
+    if (t->pch_jobs[cpp] == NULL && depfile != NULL) {
+        char *line = nobita_strjoinl("", "#include \"", t->pch, "\"\n", NULL);
+        nobita_mkdir_recursive(dir);
+        if (line != NULL)
+            nobita_write_changed(stub, line, strlen(line));
+
+        free(line);
+        j = nobita_job_new(t, NOBITA_ACT_COMPILE, (cpp) ? "CXX" : "CC", out);
+    }
+
+    if (j != NULL) {
+        Nobita_Free_Later(t->b, stub);
+        Nobita_Free_Later(t->b, depfile);
+        j->src = stub;
+        j->depfile = depfile;
+        vector_append_vector(j, cmd, &tmp, cmd);
+        vector_append(j, cmd, t->comp_opts.to_exe);
+        vector_append(j, cmd, j->out);
+        vector_append(j, cmd, "-MMD");
+        vector_append(j, cmd, "-MF");
+        vector_append(j, cmd, depfile);
+        vector_append(j, cmd, stub);
+        vector_append(j, cmd, NULL);
+        nobita_job_add_dep(j, t->gen);
+        vector_append(b, pchs, j);
+        t->pch_jobs[cpp] = j;
+    } else {
+        free(stub);
+        free(depfile);
+    }
+
+    vector_free(&tmp, cmd);
+    free(dir);
+    free(out);
+}
+
+/*
+ * The scanner a C++ compiler has for modules, only asked once per compiler,
+ * one that can't be found falls back to reading the sources
+ */
+static enum nobita_scanner nobita_target_scanner(struct nobita_target *t)
+{
+    struct nobita_build *b = t->b->root;
+    const char *cxx = t->comp_opts.cxx;
+    for (size_t i = 0; i < b->scanner_probes_used; i++)
+        if (strcmp(b->scanner_probes[i].cxx, cxx) == 0)
+            return b->scanner_probes[i].scanner;
+
+#ifndef _WIN32
+    char *null = "/dev/null";
+#else
+    char *null = "NUL";
+#endif /* _WIN32 */
+
+    enum nobita_scanner scanner = NOBITA_SCAN_TEXT;
+    if (t->comp_opts.bt == NOBITA_BT_LLVM) {
+        char *cmd[] = {"clang-scan-deps", "--version", NULL};
+        if (nobita_proc_probe(cmd))
+            scanner = NOBITA_SCAN_CLANG;
+    } else {
+        char *file = nobita_strjoinl("", "-fdeps-file=", null, NULL);
+        char *cmd[] = {
+            (char *)cxx, "-std=c++20", "-fmodules-ts", "-fdeps-format=p1689r5",
+            file, "-fdeps-target=probe.o", "-E", "-x", "c++", null, "-o", null,
+            NULL
+        };
+
+        if (file != NULL && nobita_proc_probe(cmd))
+            scanner = NOBITA_SCAN_GCC;
+
+        free(file);
+    }
+
+    struct nobita_scanner_probe probe = {cxx, scanner};
+    vector_append(b, scanner_probes, probe);
+    return scanner;
+}
+
+/*
+ * Adds the job that writes what a C++ source of a target with modules
+ * provides and imports as P1689 next to it's object, it's depfile makes it
+ * look again when a header changes
+ */
+static void nobita_plan_scan(
+    struct nobita_target *t, enum nobita_scanner scanner, const char *src,
+    const char *obj
+)
+{
+    char *ddi = nobita_strjoinl("", obj, ".ddi", NULL);
+    struct nobita_job *j = (ddi != NULL)
+        ? nobita_job_new(t, NOBITA_ACT_COMPILE, "SCAN", ddi) : NULL;
+
+    free(ddi);
+    if (j == NULL)
+        return;
+
+    const char *ext = strrchr(src, '.');
+    bool interface = strcmp(ext, ".cppm") == 0 || strcmp(ext, ".ixx") == 0;
+    char *depfile = nobita_strjoinl("", j->out, ".d", NULL);
+    Nobita_Free_Later(t->b, depfile);
+    j->src = src;
+    j->depfile = depfile;
+    if (scanner == NOBITA_SCAN_CLANG) {
+        vector_append(j, cmd, "clang-scan-deps");
+        vector_append(j, cmd, "-format=p1689");
+        vector_append(j, cmd, "-o");
+        vector_append(j, cmd, j->out);
+        vector_append(j, cmd, "--");
+        vector_append(j, cmd, t->comp_opts.cxx);
+        vector_append_vector(j, cmd, t, cflags);
+        if (strcmp(ext, ".ixx") == 0) {
+            vector_append(j, cmd, "-x");
+            vector_append(j, cmd, "c++-module");
+        }
+
+        vector_append(j, cmd, "-c");
+        vector_append(j, cmd, (char *)src);
+        vector_append(j, cmd, "-o");
+        vector_append(j, cmd, (char *)obj);
+    } else {
+        char *file = nobita_strjoinl("", "-fdeps-file=", j->out, NULL);
+        char *target = nobita_strjoinl("", "-fdeps-target=", obj, NULL);
+        char *pre = nobita_strjoinl("", j->out, ".i", NULL);
+        Nobita_Free_Later(t->b, file);
+        Nobita_Free_Later(t->b, target);
+        Nobita_Free_Later(t->b, pre);
+        vector_append(j, cmd, t->comp_opts.cxx);
+        vector_append_vector(j, cmd, t, cflags);
+        vector_append(j, cmd, "-fmodules-ts");
+        if (interface) {
+            vector_append(j, cmd, "-x");
+            vector_append(j, cmd, "c++");
+        }
+
+        vector_append(j, cmd, "-E");
+        vector_append(j, cmd, (char *)src);
+        vector_append(j, cmd, "-fdeps-format=p1689r5");
+        vector_append(j, cmd, file);
+        vector_append(j, cmd, target);
+        vector_append(j, cmd, "-o");
+        vector_append(j, cmd, pre);
+    }
+
+    vector_append(j, cmd, "-MT");
+    vector_append(j, cmd, j->out);
+    vector_append(j, cmd, "-MD");
+    vector_append(j, cmd, "-MF");
+    vector_append(j, cmd, depfile);
+    vector_append(j, cmd, NULL);
+    nobita_job_add_dep(j, t->gen);
+    nobita_job_add_dep(t->modules_job, j);
+}
+
+/* Skips a JSON string from it's opening quote */
+static const char *nobita_json_skip(const char *c)
+{
+    for (c++; *c != 0 && *c != '"'; c++)
+        if (*c == '\\' && c[1] != 0)
+            c++;
+
+    return (*c == '"') ? c + 1 : c;
+}
+
+/* Where the JSON array or object that starts at c ends */
+static const char *nobita_json_end(const char *c)
+{
+    size_t depth = 0;
+    while (*c != 0) {
+        if (*c == '"') {
+            c = nobita_json_skip(c);
+            continue;
+        }
+
+        if (*c == '[' || *c == '{')
+            depth += 1;
+        else if ((*c == ']' || *c == '}') && --depth == 0)
+            return c + 1;
+
+        c++;
+    }
+
+    return c;
+}
+
+/* The string value of key in the JSON object between c and end, or NULL */
+static char *nobita_json_string(const char *c, const char *end, const char *key)
+{
+    size_t n = strlen(key);
+    for (; c < end && *c != 0; c++) {
+        if (*c != '"')
+            continue;
+
+        bool match = strncmp(c + 1, key, n) == 0 && c[n + 1] == '"';
+        c = nobita_json_skip(c) - 1;
+        if (!match)
+            continue;
+
+        const char *v = c + 1 + strspn(c + 1, " \t\r\n:");
+        if (*v != '"')
+            return NULL;
+
+        char *s = malloc(nobita_json_skip(v) - v);
+        size_t len = 0;
+        for (v++; s != NULL && *v != 0 && *v != '"'; v++) {
+            if (*v == '\\' && v[1] != 0)
+                v++;
+
+            s[len++] = *v;
+        }
+
+        if (s != NULL)
+            s[len] = 0;
+
+        return s;
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads what a source provides and imports from it's P1689 file, header
+ * units (the ones with a lookup method) are left to the compiler
+ */
+static void
+nobita_module_p1689(const char *text, struct nobita_module_unit *m)
+{
+    const char *keys[] = {"\"provides\"", "\"requires\""};
+    for (size_t k = 0; k < 2; k++) {
+        const char *c = strstr(text, keys[k]);
+        c = (c != NULL) ? strchr(c, '[') : NULL;
+        const char *end = (c != NULL) ? nobita_json_end(c) : NULL;
+        while (c != NULL && (c = strchr(c + 1, '{')) != NULL && c < end) {
+            const char *obj_end = nobita_json_end(c);
+            char *name = nobita_json_string(c, obj_end, "logical-name");
+            char *lookup = nobita_json_string(c, obj_end, "lookup-method");
+            if (name != NULL && lookup == NULL && k == 0 && m->name == NULL)
+                m->name = name;
+            else if (name != NULL && lookup == NULL && k == 1)
+                vector_append(m, imports, name);
+            else
+                free(name);
+
+            free(lookup);
+            c = obj_end - 1;
+        }
+    }
+}
+
+/* Takes word off the front of c when it's a whole word */
+static bool nobita_module_word(const char **c, const char *word)
+{
+    size_t n = strlen(word);
+    if (strncmp(*c, word, n) != 0 || strchr(" \t", (*c)[n]) == NULL)
+        return false;
+
+    *c += n + strspn(*c + n, " \t");
+    return true;
+}
+
+/* The module name a declaration or import starts with, NULL if none */
+static char *nobita_module_name(const char *c)
+{
+    size_t n = strspn(
+        c, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.:"
+    );
+
+    if (n == 0 || c[n + strspn(c + n, " \t")] != ';')
+        return NULL;
+
+    char *name = malloc(n + 1);
+    if (name != NULL) {
+        memcpy(name, c, n);
+        name[n] = 0;
+    }
+
+    return name;
+}
+
+/*
+ * Reads the module declaration and imports of a source line by line, for
+ * compilers without a scanner, ones made by the preprocessor or sitting in
+ * an included file are not seen
+ */
+static void nobita_module_text(const char *text, struct nobita_module_unit *m)
+{
+    char *own = NULL;
+    bool comment = false;
+    for (const char *line = text; line != NULL && *line != 0;) {
+        const char *c = line + strspn(line, " \t");
+        line = strchr(line, '\n');
+        line = (line != NULL) ? line + 1 : NULL;
+        const char *close = strstr(c, "*/");
+        if (comment || strncmp(c, "/*", 2) == 0) {
+            comment = close == NULL || (line != NULL && close > line);
+            continue;
+        }
+
+        bool exported = nobita_module_word(&c, "export");
+        char *name = NULL;
+        if (nobita_module_word(&c, "module")) {
+            name = nobita_module_name(c);
+            if (name == NULL || *name == ':') {
+                free(name);
+                continue;
+            }
+
+            free(own);
+            own = nobita_strdup(name);
+            if (exported || strchr(name, ':') != NULL) {
+                free(m->name);
+                m->name = name;
+            } else {
+                vector_append(m, imports, name);
+            }
+        } else if (nobita_module_word(&c, "import") &&
+                (name = nobita_module_name(c)) != NULL) {
+            /* A partition is named after the module that imports it */
+            size_t n = (own != NULL) ? strcspn(own, ":") : 0;
+            char *full = (*name == ':' && own != NULL)
+                ? malloc(n + strlen(name) + 1) : NULL;
+
+            if (full != NULL) {
+                memcpy(full, own, n);
+                strcpy(full + n, name);
+                free(name);
+                name = full;
+            }
+
+            vector_append(m, imports, name);
+        }
+    }
+
+    free(own);
+}
+
+static void nobita_modules_collate(struct nobita_job *j);
+
+/*
+ * The compile that provides a module to u, one with the same flags in the
+ * target c collates for or else from the targets that one depends on,
+ * there the last one (the one that's linked, not one for PGO) is taken
+ */
+static struct nobita_job *nobita_module_provider(
+    struct nobita_job *c, struct nobita_job *u, const char *name
+)
+{
+    struct nobita_job *found = NULL;
+    for (size_t i = 0; i < c->users_used; i++) {
+        struct nobita_module_unit *m = c->users[i]->unit;
+        if (m == NULL || m->name == NULL || strcmp(m->name, name) != 0)
+            continue;
+
+        if (strcmp(m->bmi_dir, u->unit->bmi_dir) == 0)
+            return c->users[i];
+
+        found = c->users[i];
+    }
+
+    for (size_t i = 0; i < c->deps_used && found == NULL; i++) {
+        struct nobita_job *d = c->deps[i];
+        if (d->fn == nobita_modules_collate && d->t != c->t)
+            found = nobita_module_provider(d, u, name);
+    }
+
+    return found;
+}
+
+/* Adds the providers of the modules m imports that seen doesn't have yet */
+static bool nobita_module_need(
+    struct nobita_job *c, struct nobita_job *u, struct nobita_module_unit *m,
+    struct nobita_job *seen
+)
+{
+    for (size_t i = 0; i < m->imports_used; i++) {
+        struct nobita_job *p = nobita_module_provider(c, u, m->imports[i]);
+        bool known = p == NULL;
+        for (size_t ii = 0; ii < seen->deps_used && !known; ii++)
+            known = seen->deps[ii] == p;
+
+        if (p == u) {
+            nobita_build_failed = true;
+            fprintf(
+                stderr, "\tNOBITA\tERROR: The module %s imports itself through "
+                "the modules it imports\n", m->imports[i]
+            );
+
+            return false;
+        } else if (!known) {
+            vector_append(seen, deps, p);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Makes u wait for the compiles of every module it imports, also the ones
+ * those import, and writes the file that tells the compiler where their
+ * BMIs are, a failed module takes u down with it
+ */
+static void nobita_module_wire(struct nobita_job *c, struct nobita_job *u)
+{
+    struct nobita_build *b = c->t->b->root;
+    struct nobita_module_unit *m = u->unit;
+    enum nobita_build_tool bt = u->t->comp_opts.bt;
+    struct nobita_job seen = {0};
+    struct nobita_rsp r;
+    vector_init(&seen, deps);
+    vector_init(&r, buf);
+    bool ok = nobita_module_need(c, u, m, &seen);
+    for (size_t i = 0; i < seen.deps_used && ok; i++)
+        ok = nobita_module_need(c, u, seen.deps[i]->unit, &seen);
+
+    for (size_t i = 0; i <= seen.deps_used && ok && !nobita_build_failed; i++) {
+        struct nobita_module_unit *pm = (i < seen.deps_used)
+            ? seen.deps[i]->unit : m;
+
+        if (pm->bmi == NULL)
+            continue;
+
+        char *arg = (bt == NOBITA_BT_GCC)
+            ? nobita_strjoinl(" ", pm->name, pm->bmi, NULL)
+            : (pm == m)
+            ? nobita_strjoinl("", "-fmodule-output=", pm->bmi, NULL)
+            : nobita_strjoinl("", "-fmodule-file=", pm->name, "=", pm->bmi,
+                NULL);
+
+        for (const char *ch = arg; bt == NOBITA_BT_GCC && ch != NULL && *ch;)
+            vector_append(&r, buf, *ch++);
+
+        if (bt == NOBITA_BT_GCC)
+            vector_append(&r, buf, '\n');
+        else if (arg != NULL)
+            nobita_rsp_quote(&r, arg, bt);
+
+        free(arg);
+    }
+
+    for (size_t i = 0; i < seen.deps_used && ok; i++) {
+        struct nobita_job *p = seen.deps[i];
+        bool waits = false;
+        for (size_t ii = 0; ii < u->deps_used; ii++)
+            waits = waits || u->deps[ii] == p;
+
+        if (!waits && !p->done)
+            nobita_job_add_dep(u, p);
+
+        if (!waits && p->failed && !u->failed) {
+            u->failed = true;
+            b->jobs_skipped += 1;
+            nobita_job_poison(b, u);
+        }
+
+        if (p->priority < p->cost + u->priority)
+            p->priority = p->cost + u->priority;
+
+        bool input = false;
+        for (size_t ii = 0; ii < u->inputs_used; ii++)
+            input = input || u->inputs[ii] == p->unit->bmi;
+
+        if (!input && p->unit->bmi != NULL)
+            vector_append(u, inputs, p->unit->bmi);
+    }
+
+    if (ok && !nobita_build_failed)
+        nobita_write_changed(m->modmap, r.buf, r.buf_used);
+
+    vector_free(&seen, deps);
+    vector_free(&r, buf);
+}
+
+/*
+ * Runs once every C++ source of a target with modules was scanned, reads
+ * what each compile provides and imports and only then adds the edges from
+ * the compiles of the modules to the ones importing them
+ */
+static void nobita_modules_collate(struct nobita_job *j)
+{
+    for (size_t i = 0; i < j->users_used; i++) {
+        struct nobita_job *u = j->users[i];
+        struct nobita_module_unit *m = u->unit;
+        if (m == NULL)
+            continue;
+
+        for (size_t ii = 0; ii < m->imports_used; ii++)
+            free(m->imports[ii]);
+
+        free(m->name);
+        free(m->bmi);
+        m->imports_used = 0;
+        m->name = NULL;
+        m->bmi = NULL;
+
+        const char *ddi = NULL;
+        for (size_t ii = 0; ii < j->deps_used; ii++)
+            if (j->deps[ii]->src != NULL &&
+                    strcmp(j->deps[ii]->src, u->src) == 0)
+                ddi = j->deps[ii]->out;
+
+        char *text = nobita_read_file((ddi != NULL) ? ddi : u->src, NULL);
+        if (text != NULL && ddi != NULL)
+            nobita_module_p1689(text, m);
+        else if (text != NULL)
+            nobita_module_text(text, m);
+
+        free(text);
+        if (m->name == NULL)
+            continue;
+
+        char *file = nobita_strdup(m->name);
+        for (char *c = file; c != NULL && *c != 0; c++)
+            *c = (*c == ':') ? '-' : *c;
+
+        m->bmi = nobita_strjoinl("", m->bmi_dir, NOBITA_PATHSEP, file,
+            (u->t->comp_opts.bt == NOBITA_BT_GCC) ? ".gcm" : ".pcm", NULL
+        );
+
+        free(file);
+    }
+
+    for (size_t i = 0; i < j->users_used && !nobita_build_failed; i++)
+        if (j->users[i]->unit != NULL)
+            nobita_module_wire(j, j->users[i]);
+}
+
+/*
+ * Adds the jobs that find out what each C++ source of a target with
+ * modules provides and imports and the one that puts it together, the
+ * compiles wait for that one as what they wait for is only known then
+ */
+static void nobita_plan_modules(struct nobita_target *t)
+{
+    if (!t->modules || nobita_build_failed)
+        return;
+
+    if (t->comp_opts.bt == NOBITA_BT_MSVC) {
+        fprintf(
+            stderr, "\tNOBITA\tWARNING: C++ modules are not supported with "
+            "MSVC, %s is built without them\n", t->name
+        );
+
+        return;
+    }
+
+    t->modules_job = nobita_job_new(t, NOBITA_ACT_CUSTOM_CMD, NULL, NULL);
+    if (t->modules_job == NULL)
+        return;
+
+    t->modules_job->fn = nobita_modules_collate;
+    nobita_job_add_dep(t->modules_job, t->gen);
+    for (size_t i = 0; i < t->deps_used; i++) {
+        struct nobita_target *d = t->deps[i];
+        if (d->modules_job != NULL)
+            nobita_job_add_dep(t->modules_job, d->modules_job);
+    }
+
+    enum nobita_scanner scanner = nobita_target_scanner(t);
+    for (size_t i = 0; i < t->sources_used && scanner != NOBITA_SCAN_TEXT;
+            i++) {
+        const char *ext = strrchr(t->sources[i], '.');
+        if (ext != NULL && nobita_is_cpp(ext))
+            nobita_plan_scan(t, scanner, t->sources[i], t->objects[i]);
+    }
+}
+
+/*
+ * Gives a C++ compile of a target with modules it's map file, the BMIs
+ * are kept apart per set of flags so compiles with other flags (the ones
+ * for PGO) never read each other's
+ */
+static void nobita_plan_module_unit(struct nobita_job *j, const char *ext)
+{
+    struct nobita_target *t = j->t;
+    bool gcc = t->comp_opts.bt == NOBITA_BT_GCC;
+    struct nobita_module_unit *m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Out of memory\n");
+        return;
+    }
+
+    vector_init(m, imports);
+    j->unit = m;
+    uint64_t h = NOBITA_HASH_INIT;
+    for (size_t i = 0; i < j->cmd_used; i++)
+        h = nobita_hash(h, j->cmd[i], strlen(j->cmd[i]) + 1);
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016" PRIx64, h);
+    m->bmi_dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+        nobita_cache_kind(t->target_type), "bmi", hash, NULL
+    );
+
+    m->modmap = nobita_strjoinl("", j->out, ".modmap", NULL);
+    char *flag = nobita_strjoinl(
+        "", (gcc) ? "-fmodule-mapper=" : "@", m->modmap, NULL
+    );
+
+    if (m->bmi_dir == NULL || m->modmap == NULL || flag == NULL) {
+        free(flag);
+        return;
+    }
+
+    Nobita_Free_Later(t->b, flag);
+    nobita_mkdir_recursive(m->bmi_dir);
+    if (gcc)
+        vector_append(j, cmd, "-fmodules-ts");
+
+    if (gcc && (strcmp(ext, ".cppm") == 0 || strcmp(ext, ".ixx") == 0)) {
+        vector_append(j, cmd, "-x");
+        vector_append(j, cmd, "c++");
+    } else if (!gcc && strcmp(ext, ".ixx") == 0) {
+        vector_append(j, cmd, "-x");
+        vector_append(j, cmd, "c++-module");
+    }
+
+    vector_append(j, cmd, flag);
+    vector_append(j, inputs, m->modmap);
+    nobita_job_add_dep(j, t->modules_job);
+}
+
+/*
+ * Adds the job that compiles a source of a target into obj, extra are
+ * more flags for sources that aren't assembly, lto leaves out the LTO flag
+ * when false
+ */
+static struct nobita_job *nobita_plan_object(
+    struct nobita_target *t, const char *src, const char *obj, char **extra,
+    bool lto
+)
+{
+    char *tool = NULL;
+    const char *label = NULL;
+    const char *ext = strrchr(src, '.');
+    ext = (ext != NULL) ? ext : "";
+    if (strcmp(ext, ".c") == 0) {
+        tool = t->comp_opts.cc;
+        label = "CC";
+    } else if (nobita_is_cpp(ext)) {
+        tool = t->comp_opts.cxx;
+        label = "CXX";
+        t->is_cpp = true;
+    } else if (strcasecmp(ext, ".s") == 0) {
+        tool = t->comp_opts.as;
+        label = "AS";
+    } else {
+        printf("\t???\t%s\n", obj);
+        return NULL;
+    }
+
+    struct nobita_job *j = nobita_job_new(t, NOBITA_ACT_COMPILE, label, obj);
+    if (j == NULL)
+        return NULL;
+
+    j->src = src;
+    vector_append(j, cmd, tool);
+    if (strcasecmp(ext, ".s") != 0)
+        vector_append_vector(j, cmd, t, cflags);
+
+    if (nobita_target_split_dwarf(t) && strcasecmp(ext, ".s") != 0)
+        vector_append(j, cmd, "-gsplit-dwarf");
+
+    if (lto && t->lto != NOBITA_LTO_NONE && strcasecmp(ext, ".s") != 0)
+        vector_append(j, cmd, (char *)nobita_lto_flag(t));
+
+    struct nobita_job *pch = (strcasecmp(ext, ".s") != 0)
+        ? t->pch_jobs[strcmp(ext, ".c") != 0] : NULL;
+
+    if (pch != NULL) {
+        bool gcc = t->comp_opts.bt == NOBITA_BT_GCC;
+        vector_append(j, cmd, (gcc) ? "-include" : "-include-pch");
+        vector_append(j, cmd, (gcc) ? (char *)pch->src : pch->out);
+        vector_append(j, inputs, pch->out);
+        nobita_job_add_dep(j, pch);
+    }
+
+    for (size_t ii = 0; extra != NULL && extra[ii] != NULL; ii++)
+        if (strcasecmp(ext, ".s") != 0)
+            vector_append(j, cmd, extra[ii]);
+
+    if (t->modules_job != NULL && nobita_is_cpp(ext))
+        nobita_plan_module_unit(j, ext);
+
+    for (size_t ii = 0; ii < t->deps_used && strcasecmp(ext, ".s") != 0; ii++) {
+        struct nobita_target *d = t->deps[ii];
+        if (d->config != NULL)
+            vector_append(j, inputs, d->config);
+
+        /* A command may write a header it includes */
+        vector_append_vector(j, inputs, d, cmd_outputs);
+    }
+
+    if (strcasecmp(ext, ".s") != 0)
+        vector_append_vector(j, inputs, t, compile_inputs);
+
+    switch (t->comp_opts.bt) {
+    case NOBITA_BT_GCC:
+    case NOBITA_BT_LLVM:
+        vector_append(j, cmd, t->comp_opts.to_exe);
+        break;
+    case NOBITA_BT_MSVC:
+        vector_append(j, cmd, t->comp_opts.rename_obj);
+        break;
+    }
+
+    vector_append(j, cmd, j->out);
+    vector_append(j, cmd, t->comp_opts.to_obj);
+    vector_append(j, cmd, (char *)src);
+    vector_append(j, cmd, NULL);
+    nobita_job_add_dep(j, t->gen);
+    return j;
+}
+
+/*
+ * How many seconds a source is expected to take to compile, from the
+ * last time it's object was made on it's own or from it's size
+ */
+static double
+nobita_source_cost(struct nobita_build *b, const char *obj, const char *src)
+{
+    const char *time = nobita_state_get(b, "time", obj);
+    double secs = 0;
+    if (time != NULL && sscanf(time, "%lf", &secs) == 1)
+        return secs;
+
+    return 0.05 + (double)nobita_file_size(src) / 100000.0;
+}
+
+struct nobita_unity_batch {
+    bool cpp;
+    size_t n;
+    double cost;
+
+    size_t members_used;
+    size_t members_size;
+    char **members;
+};
+
+struct nobita_unity {
+    size_t batches_used;
+    size_t batches_size;
+    struct nobita_unity_batch *batches;
+};
+
+static struct nobita_unity_batch *
+nobita_unity_batch(struct nobita_unity *u, bool cpp, size_t n)
+{
+    for (size_t i = 0; i < u->batches_used; i++)
+        if (u->batches[i].cpp == cpp && u->batches[i].n == n)
+            return &u->batches[i];
+
+    struct nobita_unity_batch batch = {.cpp = cpp, .n = n};
+    vector_append(u, batches, batch);
+    if (nobita_build_failed)
+        return NULL;
+
+    vector_init(&u->batches[u->batches_used - 1], members);
+    return (nobita_build_failed) ? NULL : &u->batches[u->batches_used - 1];
+}
+
+/* Writes a batch's source, including it's members in the target's order */
+static void nobita_unity_write(const char *path, struct nobita_unity_batch *u)
+{
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    for (size_t i = 0; i < u->members_used; i++) {
+        const char *line[] = {"#include \"", u->members[i], "\"\n"};
+        for (size_t ii = 0; ii < 3; ii++)
+            for (const char *c = line[ii]; *c != 0; c++)
+                vector_append(&r, buf, *c);
+    }
+
+    if (!nobita_build_failed)
+        nobita_write_changed(path, r.buf, r.buf_used);
+
+    vector_free(&r, buf);
+}
+
+/*
+ * Puts the C and C++ sources of a unity target in batches and adds the
+ * jobs that compile them, batched tells which sources it took
+ *
+ * A source stays in the batch it got the first time (it's kept in the
+ * state file), a new one goes to the first batch of it's language with
+ * room, batches are filled up to NOBITA_UNITY_BATCH seconds or less when
+ * that's needed for every process to get a batch
+ */
+static void nobita_plan_unity(struct nobita_target *t, bool *batched)
+{
+    struct nobita_build *b = t->b->root;
+    size_t *batch_of = calloc(t->objects_used + 1, sizeof(*batch_of));
+    double *costs = calloc(t->objects_used + 1, sizeof(*costs));
+    bool *known = calloc(t->objects_used + 1, sizeof(*known));
+    struct nobita_unity u;
+    vector_init(&u, batches);
+    if (batch_of == NULL || costs == NULL || known == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Out of memory\n");
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < t->objects_used && !nobita_build_failed; i++) {
+        const char *ext = strrchr(t->sources[i], '.');
+        ext = (ext != NULL) ? ext : "";
+        if (strcmp(ext, ".c") != 0 && strcmp(ext, ".cpp") != 0 &&
+                strcmp(ext, ".cc") != 0)
+            continue;
+
+        /* A module unit has to be compiled on it's own */
+        if (t->modules && strcmp(ext, ".c") != 0)
+            continue;
+
+        bool excluded = false;
+        for (size_t ii = 0; ii < t->unity_exclude_used; ii++)
+            excluded = excluded ||
+                strcmp(t->unity_exclude[ii], t->sources[i]) == 0;
+
+        if (excluded)
+            continue;
+
+        batched[i] = true;
+        costs[i] = nobita_source_cost(b, t->objects[i], t->sources[i]);
+        total += costs[i];
+
+        const char *n = nobita_state_get(b, "unity", t->sources[i]);
+        known[i] = n != NULL && sscanf(n, "%zu", &batch_of[i]) == 1;
+        struct nobita_unity_batch *batch = (known[i]) ? nobita_unity_batch(
+            &u, strcmp(ext, ".c") != 0, batch_of[i]
+        ) : NULL;
+
+        if (batch != NULL)
+            batch->cost += costs[i];
+    }
+
+    double budget = total / (double)nobita_max_proc_count;
+    budget = (budget < NOBITA_UNITY_BATCH) ? budget : NOBITA_UNITY_BATCH;
+    for (size_t i = 0; i < t->objects_used && !nobita_build_failed; i++) {
+        if (!batched[i] || known[i])
+            continue;
+
+        bool cpp = strcmp(strrchr(t->sources[i], '.'), ".c") != 0;
+        struct nobita_unity_batch *batch = NULL;
+        size_t next = 0;
+        for (size_t ii = 0; ii < u.batches_used; ii++) {
+            struct nobita_unity_batch *c = &u.batches[ii];
+            if (c->cpp != cpp)
+                continue;
+
+            next = (c->n + 1 > next) ? c->n + 1 : next;
+            if (c->cost + costs[i] <= budget &&
+                    (batch == NULL || c->n < batch->n))
+                batch = c;
+        }
+
+        if (batch == NULL)
+            batch = nobita_unity_batch(&u, cpp, next);
+
+        if (batch == NULL)
+            break;
+
+        batch->cost += costs[i];
+        batch_of[i] = batch->n;
+        nobita_state_setf(b, "unity", t->sources[i], "%zu", batch->n);
+    }
+
+    for (size_t i = 0; i < t->objects_used && !nobita_build_failed; i++) {
+        if (!batched[i])
+            continue;
+
+        bool cpp = strcmp(strrchr(t->sources[i], '.'), ".c") != 0;
+        struct nobita_unity_batch *batch = nobita_unity_batch(
+            &u, cpp, batch_of[i]
+        );
+        if (batch != NULL)
+            vector_append(batch, members, t->sources[i]);
+    }
+
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+        nobita_cache_kind(t->target_type), NULL
+    );
+    for (size_t i = 0; i < u.batches_used && dir != NULL; i++) {
+        struct nobita_unity_batch *batch = &u.batches[i];
+        char name[64];
+        snprintf(
+            name, sizeof(name), "unity-%s-%zu", (batch->cpp) ? "cpp" : "c",
+            batch->n
+        );
+
+        char *src = nobita_strjoinl("", dir, NOBITA_PATHSEP, name,
+            (batch->cpp) ? ".cpp" : ".c", NULL
+        );
+        char *obj = nobita_strjoinl("", dir, NOBITA_PATHSEP, name,
+#ifndef _WIN32
+            ".o", NULL
+#else
+            ".obj", NULL
+#endif /* _WIN32 */
+        );
+
+        Nobita_Free_Later(t->b, src);
+        if (src != NULL && obj != NULL && batch->members_used > 0) {
+            nobita_unity_write(src, batch);
+            struct nobita_job *j = nobita_plan_object(t, src, obj, NULL, true);
+            if (j != NULL)
+                vector_append_vector(j, inputs, batch, members);
+        }
+
+        free(obj);
+    }
+
+    for (size_t i = 0; i < u.batches_used; i++)
+        vector_free(&u.batches[i], members);
+
+    vector_free(&u, batches);
+    free(dir);
+    free(batch_of);
+    free(costs);
+    free(known);
+}
+
+/*
+ * Adds the jobs that compile a target's sources, with profile guided
+ * optimization they wait for the profiles and each one is looked at in
+ * the fingerprint of the object it's for
+ */
+static void nobita_plan_objects(struct nobita_target *t)
+{
+    bool *batched = calloc(t->objects_used + 1, sizeof(*batched));
+    if (batched == NULL) {
+        nobita_build_failed = true;
+        fprintf(stderr, "\tNOBITA\tERROR: Out of memory\n");
+        return;
+    }
+
+    if (t->unity && t->pgo == NULL)
+        nobita_plan_unity(t, batched);
+
+    for (size_t i = 0; i < t->objects_used; i++) {
+        if (batched[i])
+            continue;
+
+        struct nobita_job *j = nobita_plan_object(
+            t, t->sources[i], t->objects[i],
+            (t->pgo != NULL) ? t->pgo_use : NULL, true
+        );
+
+        if (j == NULL || t->pgo == NULL)
+            continue;
+
+        nobita_job_add_dep(j, t->pgo);
+        if (t->pgo_profile != NULL) {
+            j->profile = t->pgo_profile;
+        } else {
+            j->profile = nobita_gcda(t->objects[i]);
+            Nobita_Free_Later(t->b, (void *)j->profile);
+        }
+    }
+
+    free(batched);
+}
+
+static const char *nobita_linker_flags[] = {
+    [NOBITA_LD_DEFAULT] = NULL,
+    [NOBITA_LD_BFD] = "-fuse-ld=bfd",
+    [NOBITA_LD_GOLD] = "-fuse-ld=gold",
+    [NOBITA_LD_LLD] = "-fuse-ld=lld",
+    [NOBITA_LD_MOLD] = "-fuse-ld=mold",
+    [NOBITA_LD_AUTO] = NULL,
+};
+
+/* Whether the compiler can link with ld, only asked once per compiler */
+static bool nobita_linker_works(
+    struct nobita_build *b, const char *cc, enum nobita_linker ld
+)
+{
+    for (size_t i = 0; i < b->linker_probes_used; i++)
+        if (b->linker_probes[i].ld == ld &&
+                strcmp(b->linker_probes[i].cc, cc) == 0)
+            return b->linker_probes[i].works;
+
+    char *cmd[] = {
+        (char *)cc, (char *)nobita_linker_flags[ld], "-Wl,--version", NULL
+    };
+    struct nobita_linker_probe probe = {cc, ld, nobita_proc_probe(cmd)};
+    vector_append(b, linker_probes, probe);
+    return probe.works;
+}
+
+/*
+ * The linker a target links with, auto picks the fastest one that works
+ * and one picked by name has to work, marks the build as failed otherwise
+ */
+static enum nobita_linker
+nobita_target_linker(struct nobita_target *t, const char *cc)
+{
+    struct nobita_build *b = t->b->root;
+    enum nobita_linker ld = (t->linker != NOBITA_LD_DEFAULT)
+        ? t->linker : b->linker;
+
+    if (t->comp_opts.bt == NOBITA_BT_MSVC || ld == NOBITA_LD_DEFAULT)
+        return NOBITA_LD_DEFAULT;
+
+    if (ld == NOBITA_LD_AUTO) {
+        const enum nobita_linker fastest[] = {
+            NOBITA_LD_MOLD, NOBITA_LD_LLD, NOBITA_LD_GOLD
+        };
+
+        for (size_t i = 0; i < sizeof(fastest) / sizeof(*fastest); i++)
+            if (nobita_linker_works(b, cc, fastest[i]))
+                return fastest[i];
+
+        return NOBITA_LD_DEFAULT;
+    }
+
+    if (!nobita_linker_works(b, cc, ld)) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr, "\tNOBITA\tERROR: %s can't link with '%s' for target %s\n",
+            cc, nobita_linker_flags[ld], t->name
+        );
+    }
+
+    return ld;
+}
+
+/*
+ * Adds the LTO options of a link, GCC runs it's LTO jobs through the
+ * jobserver if there is one, otherwise the link takes as many threads as
+ * it's allowed and counts as that many processes, ThinLTO gets a cache
+ * that lld takes it's own way and the LLVM plugin of other linkers another,
+ * it can't take jobserver tokens so it gets one thread under a jobserver
+ */
+static void nobita_set_lto(struct nobita_job *j, enum nobita_linker ld)
+{
+    struct nobita_target *t = j->t;
+    struct nobita_build *b = t->b->root;
+    if (t->lto == NOBITA_LTO_NONE || t->comp_opts.bt == NOBITA_BT_MSVC)
+        return;
+
+    j->threads = (t->lto_jobs == 0 || t->lto_jobs > nobita_max_proc_count)
+        ? nobita_max_proc_count : t->lto_jobs;
+
+    if (t->comp_opts.bt == NOBITA_BT_GCC) {
+        if (b->js_read != -1) {
+            j->threads = 1;
+            snprintf(j->lto_jobs, sizeof(j->lto_jobs), "-flto=jobserver");
+        } else {
+            snprintf(j->lto_jobs, sizeof(j->lto_jobs), "-flto=%zu", j->threads);
+        }
+
+        vector_append(j, cmd, j->lto_jobs);
+        return;
+    }
+
+    vector_append(j, cmd, (char *)nobita_lto_flag(t));
+    if (t->lto == NOBITA_LTO_FULL) {
+        j->threads = 1;
+        return;
+    }
+
+    /* Only one token is held for the link, the others are someone else's */
+    if (b->js_read != -1)
+        j->threads = 1;
+
+    char *cache = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+        nobita_cache_kind(t->target_type), "thinlto", NULL
+    );
+    char *opt = nobita_strjoinl("", (ld == NOBITA_LD_LLD)
+        ? "-Wl,--thinlto-cache-dir=" : "-Wl,-plugin-opt,cache-dir=",
+        cache, NULL
+    );
+
+    free(cache);
+    if (opt == NULL)
+        return;
+
+    Nobita_Free_Later(t->b, opt);
+    snprintf(j->lto_jobs, sizeof(j->lto_jobs), "%s%zu", (ld == NOBITA_LD_LLD)
+        ? "-Wl,--thinlto-jobs=" : "-Wl,-plugin-opt,jobs=", j->threads
+    );
+
+    vector_append(j, cmd, opt);
+    vector_append(j, cmd, j->lto_jobs);
+}
+
+/*
+ * Adds the linker of a target to it's link, plus the gdb index if wanted,
+ * and it's LTO options which depend on the linker
+ */
+static void nobita_set_linker(struct nobita_job *j, const char *cc)
+{
+    enum nobita_linker ld = nobita_target_linker(j->t, cc);
+    if (ld != NOBITA_LD_DEFAULT)
+        vector_append(j, cmd, (char *)nobita_linker_flags[ld]);
+
+    if (ld != NOBITA_LD_DEFAULT && ld != NOBITA_LD_BFD &&
+            nobita_target_split_dwarf(j->t))
+        vector_append(j, cmd, "-Wl,--gdb-index");
+
+    nobita_set_lto(j, ld);
+}
+
+/* Adds the objects of a link or archive, whatever it's compile jobs make */
+static void nobita_set_objects(struct nobita_job *j)
+{
+    for (size_t i = 0; i < j->deps_used; i++)
+        if (j->deps[i]->action == NOBITA_ACT_COMPILE)
+            vector_append(j, cmd, j->deps[i]->out);
+}
+
+static void nobita_set_exe(struct nobita_job *j, const char *output)
+{
+    struct nobita_target *t = j->t;
+    char *comp = (t->is_cpp) ? t->comp_opts.cxx : t->comp_opts.cc;
+    switch (t->comp_opts.bt) {
+    case NOBITA_BT_GCC:
+    case NOBITA_BT_LLVM:
+    case NOBITA_BT_MSVC:
+        vector_append(j, cmd, comp);
+        vector_append_vector(j, cmd, t, cflags);
+        nobita_set_linker(j, comp);
+        vector_append(j, cmd, t->comp_opts.to_exe);
+        vector_append(j, cmd, (char *)output);
+        nobita_set_objects(j);
+        vector_append_vector(j, cmd, t, ldflags);
+        break;
+    }
+}
+
+static void nobita_set_sharedlib(struct nobita_job *j, const char *output)
+{
+    struct nobita_target *t = j->t;
+    char *comp = (t->is_cpp) ? t->comp_opts.cxx : t->comp_opts.cc;
+    switch (t->comp_opts.bt) {
+    case NOBITA_BT_GCC:
+    case NOBITA_BT_LLVM:
+    case NOBITA_BT_MSVC:
+        vector_append(j, cmd, comp);
+        vector_append_vector(j, cmd, t, cflags);
+        nobita_set_linker(j, comp);
+        vector_append(j, cmd, t->comp_opts.to_lib);
+        vector_append(j, cmd, t->comp_opts.to_exe);
+        vector_append(j, cmd, (char *)output);
+        nobita_set_objects(j);
+        vector_append_vector(j, cmd, t, ldflags);
+        break;
+    }
+}
+
+static void nobita_set_staticlib(struct nobita_job *j, const char *output)
+{
+    struct nobita_target *t = j->t;
+    switch (t->comp_opts.bt) {
+    case NOBITA_BT_GCC:
+    case NOBITA_BT_LLVM:
+        /* Plain ar may not know how to index GCC's LTO objects */
+        vector_append(j, cmd,
+            (t->lto != NOBITA_LTO_NONE && t->comp_opts.bt == NOBITA_BT_GCC)
+            ? "gcc-ar" : t->comp_opts.ar
+        );
+        vector_append(j, cmd, (t->thin_archive)
+            ? t->comp_opts.ar_thin_opts : t->comp_opts.ar_opts
+        );
+        vector_append(j, cmd, (char *)output);
+        nobita_set_objects(j);
+        break;
+    case NOBITA_BT_MSVC:
+        Nobita_Target_Add_Fmt_Arg(
+            t, NOBITA_T_CFLAGS, "%s%s", t->comp_opts.ar_opts, output
+        );
+
+        vector_append(j, cmd, t->comp_opts.ar);
+        vector_append(j, cmd, t->cflags[t->cflags_used - 1]);
+        nobita_set_objects(j);
+        break;
+    }
+}
+
+/* Calls fn with every file matching a pattern */
+static void nobita_glob_each(
+    const char *pattern, void (*fn)(const char *path, void *arg), void *arg
+)
+{
+#ifndef _WIN32
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0)
+        return;
+
+    for (size_t i = 0; i < g.gl_pathc; i++)
+        fn(g.gl_pathv[i], arg);
+
+    globfree(&g);
+#else
+    WIN32_FIND_DATAA d = {0};
+    HANDLE f = FindFirstFileA(pattern, &d);
+    if (f == INVALID_HANDLE_VALUE)
+        return;
+
+    char *dir = nobita_strdup(pattern);
+    nobita_dirname(dir);
+    do {
+        char *path = nobita_strjoinl(NOBITA_PATHSEP, dir, d.cFileName, NULL);
+        if (path != NULL)
+            fn(path, arg);
+
+        free(path);
+    } while (FindNextFileA(f, &d));
+
+    FindClose(f);
+    free(dir);
+#endif /* _WIN32 */
+}
+
+static void nobita_remove_each(const char *path, void *arg)
+{
+    (void)arg;
+    remove(path);
+}
+
+static void nobita_list_each(const char *path, void *arg)
+{
+    fprintf(arg, "%s\n", path);
+}
+
+/* Where the LLVM profiles of the training runs go, as a glob pattern */
+static char *nobita_pgo_profraws(struct nobita_target *t)
+{
+    return nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "pgo", "profile",
+        "*.profraw", NULL
+    );
+}
+
+/*
+ * Runs before the training runs, if any of them has to run again (the
+ * instrumented build changed, the arguments changed or one never
+ * finished) the old profiles are thrown out and so are the marks of every
+ * run, the profiles would add up otherwise
+ */
+static void nobita_pgo_reset(struct nobita_job *j)
+{
+    struct nobita_target *t = j->t;
+    bool stale = t->b->root->force || j->deps[0]->ran;
+    for (size_t i = 0; i < j->users_used && !stale; i++)
+        stale = !nobita_file_exist(j->users[i]->out) ||
+            nobita_job_cmd_changed(j->users[i]);
+
+    if (!stale)
+        return;
+
+    for (size_t i = 0; i < j->users_used; i++)
+        remove(j->users[i]->out);
+
+    if (t->comp_opts.bt == NOBITA_BT_LLVM) {
+        char *pattern = nobita_pgo_profraws(t);
+        if (pattern != NULL)
+            nobita_glob_each(pattern, nobita_remove_each, NULL);
+
+        free(pattern);
+        return;
+    }
+
+    for (size_t i = 0; i < t->objects_used; i++) {
+        char *gen = nobita_pgo_object(t, t->objects[i]);
+        char *gcda = (gen != NULL) ? nobita_gcda(gen) : NULL;
+        if (gcda != NULL)
+            remove(gcda);
+
+        free(gen);
+        free(gcda);
+    }
+}
+
+/* Marks a training run as done */
+static void nobita_pgo_trained(struct nobita_job *j)
+{
+    FILE *f = fopen(j->out, "w");
+    if (f != NULL)
+        fclose(f);
+}
+
+/*
+ * Runs after the training runs, LLVM gets the list of profiles they left
+ * for llvm-profdata, GCC's profiles are already merged as the runs add to
+ * the same files so each one is copied next to the object that will use it,
+ * only if it changed so objects with the same profile aren't recompiled
+ */
+static void nobita_pgo_collect(struct nobita_job *j)
+{
+    struct nobita_target *t = j->t;
+    if (t->comp_opts.bt == NOBITA_BT_LLVM) {
+        char *pattern = nobita_pgo_profraws(t);
+        char *list = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "pgo",
+            "profraw.list", NULL
+        );
+
+        FILE *f = (list != NULL) ? fopen(list, "w") : NULL;
+        if (f != NULL && pattern != NULL)
+            nobita_glob_each(pattern, nobita_list_each, f);
+
+        if (f != NULL)
+            fclose(f);
+
+        free(pattern);
+        free(list);
+        return;
+    }
+
+    for (size_t i = 0; i < t->objects_used; i++) {
+        char *gen = nobita_pgo_object(t, t->objects[i]);
+        char *from = (gen != NULL) ? nobita_gcda(gen) : NULL;
+        char *to = nobita_gcda(t->objects[i]);
+        size_t from_len = 0;
+        size_t to_len = 0;
+        char *new = (from != NULL) ? nobita_read_file(from, &from_len) : NULL;
+        char *old = (to != NULL) ? nobita_read_file(to, &to_len) : NULL;
+        if (new == NULL && to != NULL) {
+            remove(to);
+        } else if (new != NULL && (old == NULL || from_len != to_len ||
+                memcmp(new, old, from_len) != 0)) {
+            FILE *f = fopen(to, "wb");
+            if (f != NULL) {
+                fwrite(new, 1, from_len, f);
+                fclose(f);
+            }
+        }
+
+        free(gen);
+        free(from);
+        free(to);
+        free(new);
+        free(old);
+    }
+}
+
+/*
+ * Plans profile guided optimization of an executable: an instrumented
+ * build of it in it's pgo dir, a job that starts the training over when
+ * it has to, the training runs, and a job that collects their profiles
+ * plus llvm-profdata for LLVM, the job that's last is where the real
+ * objects wait for their profiles
+ */
+static void nobita_plan_pgo(struct nobita_target *t)
+{
+    if (t->trainings_used == 0)
+        return;
+
+    if (t->comp_opts.bt == NOBITA_BT_MSVC) {
+        fprintf(
+            stderr, "\tNOBITA\tWARNING: Profile guided optimization is not "
+            "supported with MSVC, %s is built without it\n", t->name
+        );
+
+        return;
+    }
+
+    struct nobita_build *b = t->b->root;
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "pgo", NULL
+    );
+    char *name = nobita_strjoinl("", t->name, NOBITA_EXECUT_EXT, NULL);
+    char *exe = nobita_strjoinl(NOBITA_PATHSEP, dir, name, NULL);
+    char *gen[3] = {"-fprofile-generate", "-fprofile-update=atomic", NULL};
+    char *merged = NULL;
+    free(name);
+    if (dir == NULL || exe == NULL) {
+        free(dir);
+        free(exe);
+        return;
+    }
+
+    Nobita_Free_Later(t->b, dir);
+    Nobita_Free_Later(t->b, exe);
+    t->pgo_use[0] = "-fprofile-use";
+    t->pgo_use[1] = "-Wno-missing-profile";
+    if (t->comp_opts.bt == NOBITA_BT_LLVM) {
+        merged = nobita_strjoinl(NOBITA_PATHSEP, dir, "merged.profdata", NULL);
+        gen[0] = nobita_strjoinl(
+            "", "-fprofile-instr-generate=", dir, NOBITA_PATHSEP, "profile",
+            NOBITA_PATHSEP, "%p.profraw", NULL
+        );
+        gen[1] = NULL;
+        t->pgo_use[0] = nobita_strjoinl(
+            "", "-fprofile-instr-use=", merged, NULL
+        );
+        t->pgo_use[1] = NULL;
+        t->pgo_profile = merged;
+        Nobita_Free_Later(t->b, merged);
+        Nobita_Free_Later(t->b, gen[0]);
+        Nobita_Free_Later(t->b, t->pgo_use[0]);
+    }
+
+    size_t first = b->jobs_used;
+    for (size_t i = 0; i < t->objects_used; i++) {
+        char *obj = nobita_pgo_object(t, t->objects[i]);
+        if (obj == NULL)
+            continue;
+
+        nobita_dirname(obj);
+        nobita_mkdir_recursive(obj);
+        *strchr(obj, 0) = *NOBITA_PATHSEP;
+        nobita_plan_object(t, t->sources[i], obj, gen, false);
+        free(obj);
+    }
+
+    size_t last = b->jobs_used;
+    char *comp = (t->is_cpp) ? t->comp_opts.cxx : t->comp_opts.cc;
+    enum nobita_linker ld = nobita_target_linker(t, comp);
+    struct nobita_job *link = nobita_job_new(t, NOBITA_ACT_LINK, "LD", exe);
+    if (link == NULL)
+        return;
+
+    vector_append(link, cmd, comp);
+    vector_append_vector(link, cmd, t, cflags);
+    if (ld != NOBITA_LD_DEFAULT)
+        vector_append(link, cmd, (char *)nobita_linker_flags[ld]);
+
+    vector_append(link, cmd, gen[0]);
+    vector_append(link, cmd, t->comp_opts.to_exe);
+    vector_append(link, cmd, exe);
+    for (size_t i = first; i < last; i++)
+        vector_append(link, cmd, b->jobs[i]->out);
+
+    vector_append_vector(link, cmd, t, ldflags);
+    vector_append(link, cmd, NULL);
+    nobita_job_add_dep(link, t->gen);
+    for (size_t i = 0; i < t->deps_used; i++)
+        nobita_job_add_dep(link, ((struct nobita_target *)t->deps[i])->job);
+
+    for (size_t i = first; i < last; i++)
+        nobita_job_add_dep(link, b->jobs[i]);
+
+    struct nobita_job *reset = nobita_job_new(
+        t, NOBITA_ACT_CUSTOM_CMD, NULL, NULL
+    );
+    struct nobita_job *collect = nobita_job_new(
+        t, NOBITA_ACT_CUSTOM_CMD, NULL, NULL
+    );
+    if (reset == NULL || collect == NULL)
+        return;
+
+    reset->fn = nobita_pgo_reset;
+    collect->fn = nobita_pgo_collect;
+    nobita_job_add_dep(reset, link);
+    for (size_t i = 0; i < t->trainings_used; i++) {
+        char mark[32];
+        snprintf(mark, sizeof(mark), "train-%zu", i);
+        char *out = nobita_strjoinl(NOBITA_PATHSEP, dir, mark, NULL);
+        struct nobita_job *run = (out != NULL)
+            ? nobita_job_new(t, NOBITA_ACT_CUSTOM_CMD, "CMD", out) : NULL;
+
+        free(out);
+        if (run == NULL)
+            return;
+
+        t->trainings[i][0] = exe;
+        for (char **arg = t->trainings[i]; *arg != NULL; arg++)
+            vector_append(run, cmd, *arg);
+
+        vector_append(run, cmd, NULL);
+        run->fn = nobita_pgo_trained;
+        nobita_job_add_dep(run, reset);
+        nobita_job_add_dep(collect, run);
+    }
+
+    t->pgo = collect;
+    if (merged == NULL)
+        return;
+
+    char *list = nobita_strjoinl("", "--input-files=", dir, NOBITA_PATHSEP,
+        "profraw.list", NULL
+    );
+    t->pgo = nobita_job_new(t, NOBITA_ACT_CUSTOM_CMD, "CMD", merged);
+    if (list == NULL || t->pgo == NULL) {
+        free(list);
+        return;
+    }
+
+    Nobita_Free_Later(t->b, list);
+    vector_append(t->pgo, cmd, "llvm-profdata");
+    vector_append(t->pgo, cmd, "merge");
+    vector_append(t->pgo, cmd, "-o");
+    vector_append(t->pgo, cmd, merged);
+    vector_append(t->pgo, cmd, list);
+    vector_append(t->pgo, cmd, NULL);
+    nobita_job_add_dep(t->pgo, collect);
+}
+
+/* A file's size and modification time, zeroes if it isn't there */
+static void nobita_file_stamp(const char *path, int64_t stamp[3])
+{
+#ifndef _WIN32
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    stat(path, &st);
+    stamp[0] = (int64_t)st.st_size;
+    stamp[1] = (int64_t)st.NOBITA_MTIM.tv_sec;
+    stamp[2] = (int64_t)st.NOBITA_MTIM.tv_nsec;
+#else
+    WIN32_FILE_ATTRIBUTE_DATA st;
+    memset(&st, 0, sizeof(st));
+    GetFileAttributesExA(path, GetFileExInfoStandard, &st);
+    stamp[0] = (int64_t)st.nFileSizeLow;
+    stamp[1] = (int64_t)st.ftLastWriteTime.dwLowDateTime;
+    stamp[2] = (int64_t)st.ftLastWriteTime.dwHighDateTime;
+#endif /* _WIN32 */
+}
+
+/*
+ * Hashes where a tool is found in PATH with it's size and modification
+ * time into h, so what's cached for it is dropped once it's updated or
+ * another one comes first in PATH
+ */
+static uint64_t nobita_tool_identity(uint64_t h, const char *tool)
+{
+#ifndef _WIN32
+    const char *sep = ":";
+    const char *ext = "";
+#else
+    const char *sep = ";";
+    const char *ext = (strchr(tool, '.') == NULL) ? ".exe" : "";
+#endif /* _WIN32 */
+
+    bool relative = strchr(tool, *NOBITA_PATHSEP) == NULL;
+    const char *path = (relative) ? getenv("PATH") : NULL;
+    h = nobita_hash(h, tool, strlen(tool) + 1);
+    for (const char *dir = (path != NULL) ? path : ""; dir != NULL;) {
+        size_t n = strcspn(dir, sep);
+        char *d = malloc(n + 1);
+        if (d == NULL)
+            break;
+
+        memcpy(d, dir, n);
+        d[n] = 0;
+        char *full = (relative)
+            ? nobita_strjoinl("", d, NOBITA_PATHSEP, tool, ext, NULL)
+            : nobita_strjoinl("", tool, ext, NULL);
+
+        free(d);
+        dir = (dir[n] != 0) ? dir + n + 1 : NULL;
+        if (full == NULL || !nobita_file_exist(full)) {
+            free(full);
+            continue;
+        }
+
+        int64_t stamp[3];
+        nobita_file_stamp(full, stamp);
+        h = nobita_hash(h, full, strlen(full) + 1);
+        h = nobita_hash(h, stamp, sizeof(stamp));
+        free(full);
+        break;
+    }
+
+    return h;
+}
+
+static const char *nobita_probe_names[] = {
+    [NOBITA_PROBE_HEADER] = "header",
+    [NOBITA_PROBE_SYMBOL] = "symbol",
+    [NOBITA_PROBE_COMPILE] = "compile",
+    [NOBITA_PROBE_PKG_CFLAGS] = "pkg-cflags",
+    [NOBITA_PROBE_PKG_LIBS] = "pkg-libs",
+};
+
+/* What a check's result is cached by in the state file */
+static void nobita_probe_key(struct nobita_target *t, struct nobita_probe *p)
+{
+    const char *strs[] = {nobita_probe_names[p->kind], p->arg, p->symbol};
+    uint64_t h = NOBITA_HASH_INIT;
+    for (size_t i = 0; i < 3; i++)
+        if (strs[i] != NULL)
+            h = nobita_hash(h, strs[i], strlen(strs[i]) + 1);
+
+    if (p->kind == NOBITA_PROBE_PKG_CFLAGS ||
+            p->kind == NOBITA_PROBE_PKG_LIBS) {
+        const char *dirs = getenv("PKG_CONFIG_PATH");
+        h = nobita_tool_identity(h, "pkg-config");
+        if (dirs != NULL)
+            h = nobita_hash(h, dirs, strlen(dirs) + 1);
+    } else {
+        h = nobita_tool_identity(h, t->comp_opts.cc);
+        for (size_t i = 0; i < t->cflags_used; i++)
+            h = nobita_hash(h, t->cflags[i], strlen(t->cflags[i]) + 1);
+
+        for (size_t i = 0; i < t->ldflags_used; i++)
+            h = nobita_hash(h, t->ldflags[i], strlen(t->ldflags[i]) + 1);
+    }
+
+    snprintf(p->key, sizeof(p->key), "%016" PRIx64, h);
+}
+
+static void nobita_rsp_puts(struct nobita_rsp *r, const char *s)
+{
+    for (; s != NULL && *s != 0; s++)
+        vector_append(r, buf, *s);
+}
+
+/* Writes the source a check compiles, only if it changed */
+static void nobita_probe_source(struct nobita_probe *p, const char *path)
+{
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    if (p->kind == NOBITA_PROBE_COMPILE) {
+        nobita_rsp_puts(&r, p->arg);
+        nobita_rsp_puts(&r, "\n");
+    } else if (p->arg != NULL) {
+        nobita_rsp_puts(&r, "#include <");
+        nobita_rsp_puts(&r, p->arg);
+        nobita_rsp_puts(&r, ">\n");
+    }
+
+    /* Without a header there's nothing declaring it, so it's done here */
+    if (p->kind == NOBITA_PROBE_SYMBOL && p->arg == NULL) {
+        const char *lines[] = {
+            "#ifdef __cplusplus\nextern \"C\"\n#endif\nchar ", p->symbol,
+            "(void);\n\nint main(void)\n{\n    return ", p->symbol,
+            "();\n}\n"
+        };
+
+        for (size_t i = 0; i < sizeof(lines) / sizeof(*lines); i++)
+            nobita_rsp_puts(&r, lines[i]);
+    }
+
+    /* Taking it's address works for functions and variables alike */
+    if (p->kind == NOBITA_PROBE_SYMBOL && p->arg != NULL) {
+        const char *lines[] = {
+            "\nint main(int argc, char **argv)\n{\n    (void)argv;\n#ifndef ",
+            p->symbol, "\n    return ((int *)(&", p->symbol,
+            "))[argc];\n#else\n    return argc - 1;\n#endif\n}\n"
+        };
+
+        for (size_t i = 0; i < sizeof(lines) / sizeof(*lines); i++)
+            nobita_rsp_puts(&r, lines[i]);
+    }
+
+    if (!nobita_build_failed)
+        nobita_write_changed(path, r.buf, r.buf_used);
+
+    vector_free(&r, buf);
+}
+
+/*
+ * Adds a job for every check of a config without a result for the tools
+ * and flags it's made with, the others take theirs from the state file
+ */
+static void nobita_plan_probes(struct nobita_target *t)
+{
+    if (t->config == NULL)
+        return;
+
+    struct nobita_build *b = t->b->root;
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "probe", NULL
+    );
+
+    char *pkg = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, "pkg", NULL
+    );
+
+    nobita_mkdir_recursive(dir);
+    nobita_mkdir_recursive(pkg);
+    for (size_t i = 0; i < t->probes_used && dir != NULL; i++) {
+        struct nobita_probe *p = &t->probes[i];
+        nobita_probe_key(t, p);
+        const char *known = nobita_state_get(b, "probe", p->key);
+        if (!b->recheck && known != NULL && (*known == '0' || *known == '1')) {
+            p->found = *known == '1';
+            p->output = nobita_strdup((known[1] == ' ') ? known + 2 : "");
+            continue;
+        }
+
+        struct nobita_job *j = nobita_job_new(
+            t, NOBITA_ACT_CUSTOM_CMD, "PROBE", NULL
+        );
+
+        if (j == NULL)
+            break;
+
+        j->probe = p;
+        if (p->kind == NOBITA_PROBE_PKG_CFLAGS ||
+                p->kind == NOBITA_PROBE_PKG_LIBS) {
+            vector_append(j, cmd, "pkg-config");
+            vector_append(j, cmd,
+                (p->kind == NOBITA_PROBE_PKG_LIBS) ? "--libs" : "--cflags"
+            );
+
+            vector_append(j, cmd, (char *)p->arg);
+            vector_append(j, cmd, NULL);
+            continue;
+        }
+
+        char *src = nobita_strjoinl(
+            "", dir, NOBITA_PATHSEP, p->key, ".c", NULL
+        );
+
+        char *out = nobita_strjoinl("", dir, NOBITA_PATHSEP, p->key,
+            (p->kind == NOBITA_PROBE_SYMBOL) ? NOBITA_EXECUT_EXT : ".o", NULL
+        );
+
+        Nobita_Free_Later(t->b, src);
+        Nobita_Free_Later(t->b, out);
+        if (src == NULL || out == NULL)
+            break;
+
+        nobita_probe_source(p, src);
+        vector_append(j, cmd, t->comp_opts.cc);
+        vector_append_vector(j, cmd, t, cflags);
+        if (p->kind == NOBITA_PROBE_SYMBOL) {
+            vector_append(j, cmd, t->comp_opts.to_exe);
+            vector_append(j, cmd, out);
+            vector_append(j, cmd, src);
+            vector_append_vector(j, cmd, t, ldflags);
+        } else {
+            vector_append(j, cmd, (t->comp_opts.bt == NOBITA_BT_MSVC)
+                ? t->comp_opts.rename_obj : t->comp_opts.to_exe
+            );
+
+            vector_append(j, cmd, out);
+            vector_append(j, cmd, t->comp_opts.to_obj);
+            vector_append(j, cmd, src);
+        }
+
+        vector_append(j, cmd, NULL);
+    }
+
+    free(dir);
+    free(pkg);
+}
+
+/*
+ * Keeps what a check found out, pkg-config's output has it's line breaks
+ * turned into spaces so it fits on it's line of the state file
+ */
+static void nobita_probe_done(
+    struct nobita_build *b, struct nobita_probe *p, bool found,
+    const char *output, size_t n
+)
+{
+    bool pkg = p->kind == NOBITA_PROBE_PKG_CFLAGS ||
+        p->kind == NOBITA_PROBE_PKG_LIBS;
+
+    n = (pkg && found) ? n : 0;
+    while (n > 0 && strchr(" \t\r\n", output[n - 1]) != NULL)
+        n--;
+
+    free(p->output);
+    p->output = malloc(n + 1);
+    p->found = found;
+    if (p->output == NULL)
+        return;
+
+    for (size_t i = 0; i < n; i++)
+        p->output[i] = (strchr("\t\r\n", output[i]) != NULL) ? ' ' : output[i];
+
+    p->output[n] = 0;
+    nobita_state_setf(
+        b, "probe", p->key, "%d%s%s", found, (n > 0) ? " " : "", p->output
+    );
+}
+
+/*
+ * Writes a config's header and pkg-config flags once every check is done,
+ * each file only if it changed so nothing is recompiled for nothing, and
+ * the config only counts as ran when one did
+ */
+static void nobita_config_write(struct nobita_job *j)
+{
+    struct nobita_target *t = j->t;
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    nobita_rsp_puts(&r, "/* Written by nobita from the checks of ");
+    nobita_rsp_puts(&r, t->name);
+    nobita_rsp_puts(&r, " */\n");
+    for (size_t i = 0; i < t->probes_used; i++) {
+        struct nobita_probe *p = &t->probes[i];
+        if (p->define == NULL)
+            continue;
+
+        nobita_rsp_puts(&r, (p->found) ? "#define " : "/* #undef ");
+        nobita_rsp_puts(&r, p->define);
+        nobita_rsp_puts(&r, (p->found) ? " 1\n" : " */\n");
+    }
+
+    char *dir = nobita_strdup(t->config);
+    nobita_dirname(dir);
+    nobita_mkdir_recursive(dir);
+    free(dir);
+    j->ran = false;
+    if (!nobita_build_failed)
+        j->ran = nobita_write_changed(t->config, r.buf, r.buf_used);
+
+    for (size_t i = 0; i < t->probes_used; i++) {
+        struct nobita_probe *p = &t->probes[i];
+        bool libs = p->kind == NOBITA_PROBE_PKG_LIBS;
+        if (p->kind != NOBITA_PROBE_PKG_CFLAGS && !libs)
+            continue;
+
+        char *path = nobita_config_pkg_file(t, p->arg, libs);
+        const char *flags = (p->output != NULL) ? p->output : "";
+        if (path != NULL && nobita_write_changed(path, flags, strlen(flags)))
+            j->ran = true;
+
+        free(path);
+    }
+
+    vector_free(&r, buf);
+}
+
+/*
+ * The name a resource's symbols are made from, it's path with anything but
+ * letters and digits as '_', and a leading '_' if it starts with a digit
+ */
+static char *nobita_resource_name(const char *path)
+{
+    bool digit = isdigit((unsigned char)path[0]);
+    char *name = nobita_strjoinl("", (digit) ? "_" : "", path, NULL);
+    for (char *c = name; c != NULL && *c != 0; c++)
+        if (!isalnum((unsigned char)*c))
+            *c = '_';
+
+    return name;
+}
+
+/*
+ * A hash of a resource's contents, only read again when it's size or time
+ * changed since the last build, they're kept in the state file with it
+ */
+static void
+nobita_resource_hash(struct nobita_build *b, const char *path, char hash[17])
+{
+    int64_t stamp[3];
+    char known[64];
+    nobita_file_stamp(path, stamp);
+    snprintf(known, sizeof(known), "%" PRId64 " %" PRId64 " %" PRId64 " ",
+        stamp[0], stamp[1], stamp[2]
+    );
+
+    const char *last = nobita_state_get(b, "resource", path);
+    size_t n = strlen(known);
+    if (last != NULL && strncmp(last, known, n) == 0 &&
+            strlen(last) == n + 16) {
+        memcpy(hash, last + n, 17);
+        return;
+    }
+
+    uint64_t h = NOBITA_HASH_INIT;
+    char buf[65536];
+    FILE *f = fopen(path, "rb");
+    for (size_t got = 1; f != NULL && got > 0;) {
+        got = fread(buf, 1, sizeof(buf), f);
+        h = nobita_hash(h, buf, got);
+    }
+
+    if (f != NULL)
+        fclose(f);
+
+    snprintf(hash, 17, "%016" PRIx64, h);
+    nobita_state_setf(b, "resource", path, "%s%s", known, hash);
+}
+
+/* Adds a path to an assembly file as a string */
+static void nobita_rsp_quoted(struct nobita_rsp *r, const char *s)
+{
+    vector_append(r, buf, '"');
+    for (; *s != 0; s++) {
+        if (*s == '"' || *s == '\\')
+            vector_append(r, buf, '\\');
+
+        vector_append(r, buf, *s);
+    }
+
+    vector_append(r, buf, '"');
+}
+
+/*
+ * Writes the assembly that embeds a resource, only if it changed, it has
+ * the hash of the resource in it so a new one is only assembled again
+ * when it's contents did
+ */
+static void nobita_resource_source(
+    const char *path, const char *res, const char *name, const char *hash
+)
+{
+#if defined(__APPLE__)
+    const char *prefix = "_";
+    const char *section = "__TEXT,__const";
+    bool elf = false;
+#elif defined(_WIN32)
+    const char *prefix = (sizeof(void *) == 4) ? "_" : "";
+    const char *section = ".rdata,\"dr\"";
+    bool elf = false;
+#else
+    const char *prefix = "";
+    const char *section = ".rodata";
+    bool elf = true;
+#endif
+
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    nobita_rsp_puts(&r, "/* Written by nobita, contents ");
+    nobita_rsp_puts(&r, hash);
+    nobita_rsp_puts(&r, " */\n\t.section ");
+    nobita_rsp_puts(&r, section);
+    for (size_t i = 0; i < 2; i++) {
+        const char *end = (i == 0) ? "" : "_end";
+        nobita_rsp_puts(&r, "\n\t.global ");
+        nobita_rsp_puts(&r, prefix);
+        nobita_rsp_puts(&r, name);
+        nobita_rsp_puts(&r, end);
+        if (i == 0)
+            nobita_rsp_puts(&r, "\n\t.balign 16");
+
+        if (i == 0 && elf) {
+            nobita_rsp_puts(&r, "\n\t.type ");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, ", %object");
+        }
+
+        nobita_rsp_puts(&r, "\n");
+        nobita_rsp_puts(&r, prefix);
+        nobita_rsp_puts(&r, name);
+        nobita_rsp_puts(&r, end);
+        nobita_rsp_puts(&r, (i == 0) ? ":\n\t.incbin " : ":\n\t.byte 0\n");
+        if (i == 0)
+            nobita_rsp_quoted(&r, res);
+    }
+
+    if (elf) {
+        nobita_rsp_puts(&r, "\t.size ");
+        nobita_rsp_puts(&r, name);
+        nobita_rsp_puts(&r, ", ");
+        nobita_rsp_puts(&r, name);
+        nobita_rsp_puts(&r, "_end - ");
+        nobita_rsp_puts(&r, name);
+        nobita_rsp_puts(&r, "\n\t.section .note.GNU-stack,\"\",%progbits\n");
+    }
+
+    if (!nobita_build_failed)
+        nobita_write_changed(path, r.buf, r.buf_used);
+
+    vector_free(&r, buf);
+}
+
+/*
+ * Plans an object for each of a target's resources, they're linked like
+ * it's other objects, and writes the header that declares them
+ */
+static void nobita_plan_resources(struct nobita_target *t)
+{
+    if (t->resources_used == 0 || nobita_build_failed)
+        return;
+
+    if (t->comp_opts.cc == NULL || t->comp_opts.bt == NOBITA_BT_MSVC) {
+        nobita_build_failed = true;
+        fprintf(stderr,
+            "\tNOBITA\tERROR: The resources of target %s need the GCC or "
+            "LLVM build tool\n", t->name
+        );
+
+        return;
+    }
+
+    struct nobita_build *b = t->b->root;
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+        nobita_cache_kind(t->target_type), "resources", NULL
+    );
+    nobita_mkdir_recursive(dir);
+
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    nobita_rsp_puts(&r, "/* Written by nobita from the resources of ");
+    nobita_rsp_puts(&r, t->name);
+    nobita_rsp_puts(&r, " */\n#pragma once\n\n#include <stddef.h>\n\n");
+    nobita_rsp_puts(&r, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n");
+    for (size_t i = 0; i < t->resources_used && !nobita_build_failed; i++) {
+        char hash[17];
+        char *name = nobita_resource_name(t->resources[i]);
+        char *res = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->ced, t->resources[i], NULL
+        );
+        char *src = nobita_strjoinl("", dir, NOBITA_PATHSEP, name, ".s", NULL);
+        char *obj = nobita_strjoinl("", dir, NOBITA_PATHSEP, name, ".o", NULL);
+        Nobita_Free_Later(t->b, src);
+        struct nobita_job *j = (obj != NULL && src != NULL && res != NULL)
+            ? nobita_job_new(t, NOBITA_ACT_COMPILE, "RES", obj) : NULL;
+
+        if (j != NULL) {
+            nobita_resource_hash(b, res, hash);
+            nobita_resource_source(src, res, name, hash);
+            j->src = src;
+            vector_append(j, cmd, t->comp_opts.cc);
+            vector_append_vector(j, cmd, t, cflags);
+            vector_append(j, cmd, t->comp_opts.to_exe);
+            vector_append(j, cmd, j->out);
+            vector_append(j, cmd, t->comp_opts.to_obj);
+            vector_append(j, cmd, src);
+            vector_append(j, cmd, NULL);
+            nobita_job_add_dep(j, t->gen);
+
+            nobita_rsp_puts(&r, "\nextern const unsigned char ");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, "[];\nextern const unsigned char ");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, "_end[];\n#define ");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, "_size ((size_t)(");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, "_end - ");
+            nobita_rsp_puts(&r, name);
+            nobita_rsp_puts(&r, "))\n");
+        }
 
-        arg = va_arg(va, char *);
+        free(name);
+        free(res);
+        free(obj);
     }
 
-    va_end(va);
+    nobita_rsp_puts(&r, "\n#ifdef __cplusplus\n}\n#endif\n");
+    char *header = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->include, t->res_header, NULL
+    );
+    char *hdir = nobita_strdup(header);
+    nobita_dirname(hdir);
+    nobita_mkdir_recursive(hdir);
+    if (header != NULL && !nobita_build_failed)
+        nobita_write_changed(header, r.buf, r.buf_used);
+
+    free(hdir);
+    free(header);
+    free(dir);
+    vector_free(&r, buf);
 }
 
-void Nobita_Target_Add_LDflags(struct nobita_target *t, ...)
+/*
+ * The library that's preloaded into traced commands, it writes a line for
+ * each file opened to the file in NOBITA_TRACE, 'r <path>' if it's only
+ * read or 'w <path>' otherwise
+ */
+static const char *nobita_trace_src[] = {
+    "#define _GNU_SOURCE\n",
+    "#include <dlfcn.h>\n",
+    "#include <fcntl.h>\n",
+    "#include <limits.h>\n",
+    "#include <stdarg.h>\n",
+    "#include <stdio.h>\n",
+    "#include <stdlib.h>\n",
+    "#include <string.h>\n",
+    "#include <sys/syscall.h>\n",
+    "#include <unistd.h>\n",
+    "\n",
+    "#ifndef O_TMPFILE\n",
+    "#define O_TMPFILE 0\n",
+    "#endif\n",
+    "\n",
+    "#define REAL(type, name) \\\n",
+    "    static type real; \\\n",
+    "    if (real == NULL) \\\n",
+    "        real = (type)dlsym(RTLD_NEXT, name)\n",
+    "\n",
+    "typedef int (*open_fn)(const char *, int, ...);\n",
+    "typedef int (*openat_fn)(int, const char *, int, ...);\n",
+    "typedef int (*open2_fn)(const char *, int);\n",
+    "typedef int (*openat2_fn)(int, const char *, int);\n",
+    "typedef FILE *(*fopen_fn)(const char *, const char *);\n",
+    "\n",
+    "static void trace(int dir, const char *path, int w)\n",
+    "{\n",
+    "    const char *log = getenv(\"NOBITA_TRACE\");\n",
+    "    char base[PATH_MAX] = \"\";\n",
+    "    char line[PATH_MAX * 2 + 4];\n",
+    "    char fd[64];\n",
+    "    if (log == NULL || path == NULL || path[0] == 0)\n",
+    "        return;\n",
+    "\n",
+    "    while (path[0] == '.' && path[1] == '/')\n",
+    "        path += 2;\n",
+    "\n",
+    "    if (path[0] != '/' && dir == AT_FDCWD) {\n",
+    "        if (getcwd(base, sizeof(base)) == NULL)\n",
+    "            return;\n",
+    "    } else if (path[0] != '/') {\n",
+    "        snprintf(fd, sizeof(fd), \"/proc/self/fd/%d\", dir);\n",
+    "        ssize_t len = readlink(fd, base, sizeof(base) - 1);\n",
+    "        if (len < 0)\n",
+    "            return;\n",
+    "\n",
+    "        base[len] = 0;\n",
+    "    }\n",
+    "\n",
+    "    const char *sep = (base[0] != 0) ? \"/\" : \"\";\n",
+    "    char c = (w) ? 'w' : 'r';\n",
+    "    int n = snprintf(\n",
+    "        line, sizeof(line), \"%c %s%s%s\\n\", c, base, sep, path\n",
+    "    );\n",
+    "    if (n <= 0 || (size_t)n >= sizeof(line))\n",
+    "        return;\n",
+    "\n",
+    "    int flags = O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;\n",
+    "    int f = (int)syscall(SYS_openat, AT_FDCWD, log, flags, 0644);\n",
+    "    if (f < 0)\n",
+    "        return;\n",
+    "\n",
+    "    if (write(f, line, (size_t)n) < 0) {}\n",
+    "    close(f);\n",
+    "}\n",
+    "\n",
+    "/* O_TMPFILE has O_DIRECTORY's bit in it */\n",
+    "static int creates(int flags)\n",
+    "{\n",
+    "    return (flags & O_CREAT) != 0 ||\n",
+    "        (O_TMPFILE != 0 && (flags & O_TMPFILE) == O_TMPFILE);\n",
+    "}\n",
+    "\n",
+    "static int writes(int flags)\n",
+    "{\n",
+    "    return (flags & O_ACCMODE) != O_RDONLY ||\n",
+    "        (flags & O_TRUNC) != 0 || creates(flags);\n",
+    "}\n",
+    "\n",
+    "static mode_t mode_of(int flags, va_list va)\n",
+    "{\n",
+    "    return creates(flags) ? va_arg(va, mode_t) : 0;\n",
+    "}\n",
+    "\n",
+    "int open(const char *path, int flags, ...)\n",
+    "{\n",
+    "    REAL(open_fn, \"open\");\n",
+    "    va_list va;\n",
+    "    va_start(va, flags);\n",
+    "    mode_t mode = mode_of(flags, va);\n",
+    "    va_end(va);\n",
+    "    trace(AT_FDCWD, path, writes(flags));\n",
+    "    return real(path, flags, mode);\n",
+    "}\n",
+    "\n",
+    "int openat(int dir, const char *path, int flags, ...)\n",
+    "{\n",
+    "    REAL(openat_fn, \"openat\");\n",
+    "    va_list va;\n",
+    "    va_start(va, flags);\n",
+    "    mode_t mode = mode_of(flags, va);\n",
+    "    va_end(va);\n",
+    "    trace(dir, path, writes(flags));\n",
+    "    return real(dir, path, flags, mode);\n",
+    "}\n",
+    "\n",
+    "FILE *fopen(const char *path, const char *mode)\n",
+    "{\n",
+    "    REAL(fopen_fn, \"fopen\");\n",
+    "    trace(AT_FDCWD, path, mode[0] != 'r' || strchr(mode, '+') != NULL);\n",
+    "    return real(path, mode);\n",
+    "}\n",
+    "\n",
+    "#ifdef __GLIBC__\n",
+    "int open64(const char *path, int flags, ...)\n",
+    "{\n",
+    "    REAL(open_fn, \"open64\");\n",
+    "    va_list va;\n",
+    "    va_start(va, flags);\n",
+    "    mode_t mode = mode_of(flags, va);\n",
+    "    va_end(va);\n",
+    "    trace(AT_FDCWD, path, writes(flags));\n",
+    "    return real(path, flags, mode);\n",
+    "}\n",
+    "\n",
+    "int openat64(int dir, const char *path, int flags, ...)\n",
+    "{\n",
+    "    REAL(openat_fn, \"openat64\");\n",
+    "    va_list va;\n",
+    "    va_start(va, flags);\n",
+    "    mode_t mode = mode_of(flags, va);\n",
+    "    va_end(va);\n",
+    "    trace(dir, path, writes(flags));\n",
+    "    return real(dir, path, flags, mode);\n",
+    "}\n",
+    "\n",
+    "int __open_2(const char *path, int flags)\n",
+    "{\n",
+    "    REAL(open2_fn, \"__open_2\");\n",
+    "    trace(AT_FDCWD, path, writes(flags));\n",
+    "    return real(path, flags);\n",
+    "}\n",
+    "\n",
+    "int __open64_2(const char *path, int flags)\n",
+    "{\n",
+    "    REAL(open2_fn, \"__open64_2\");\n",
+    "    trace(AT_FDCWD, path, writes(flags));\n",
+    "    return real(path, flags);\n",
+    "}\n",
+    "\n",
+    "int __openat_2(int dir, const char *path, int flags)\n",
+    "{\n",
+    "    REAL(openat2_fn, \"__openat_2\");\n",
+    "    trace(dir, path, writes(flags));\n",
+    "    return real(dir, path, flags);\n",
+    "}\n",
+    "\n",
+    "FILE *fopen64(const char *path, const char *mode)\n",
+    "{\n",
+    "    REAL(fopen_fn, \"fopen64\");\n",
+    "    trace(AT_FDCWD, path, mode[0] != 'r' || strchr(mode, '+') != NULL);\n",
+    "    return real(path, mode);\n",
+    "}\n",
+    "#endif\n",
+    NULL
+};
+
+/* Where a traced command's files go, it's time is when it last ran */
+static char *nobita_trace_log(struct nobita_target *t)
 {
-    if (nobita_build_failed)
-        return;
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name, NULL
+    );
 
-    va_list va;
-    va_start(va, t);
+    nobita_mkdir_recursive(dir);
+    char *log = nobita_strjoinl(NOBITA_PATHSEP, dir, "trace", NULL);
+    free(dir);
+    return log;
+}
 
-    char *arg = va_arg(va, char *);
-    while (arg != NULL) {
-        vector_append(t, ldflags, arg);
-        arg = va_arg(va, char *);
-    }
+/* Builds the library for traced commands once per build */
+static struct nobita_job *nobita_plan_trace_lib(struct nobita_target *t)
+{
+    struct nobita_build *b = t->b->root;
+    if (b->trace_job != NULL)
+        return b->trace_job;
 
-    va_end(va);
+    char *dir = nobita_strjoinl(
+        NOBITA_PATHSEP, b->ced, "nobita-cache", "trace", NULL
+    );
+    nobita_mkdir_recursive(dir);
+    char *src = nobita_strjoinl(NOBITA_PATHSEP, dir, "nobita-trace.c", NULL);
+    char *lib = nobita_strjoinl(NOBITA_PATHSEP, dir, "nobita-trace.so", NULL);
+    free(dir);
+    Nobita_Free_Later(b, src);
+
+    struct nobita_rsp r;
+    vector_init(&r, buf);
+    for (size_t i = 0; nobita_trace_src[i] != NULL; i++)
+        nobita_rsp_puts(&r, nobita_trace_src[i]);
+
+    if (src != NULL && !nobita_build_failed)
+        nobita_write_changed(src, r.buf, r.buf_used);
+
+    vector_free(&r, buf);
+    b->trace_job = nobita_job_new(t, NOBITA_ACT_COMPILE, "CC", lib);
+    free(lib);
+    struct nobita_job *j = b->trace_job;
+    if (j == NULL)
+        return NULL;
+
+    j->src = src;
+    bool gnu = t->comp_opts.cc != NULL && t->comp_opts.bt != NOBITA_BT_MSVC;
+    vector_append(j, cmd, (gnu) ? t->comp_opts.cc : "cc");
+    vector_append(j, cmd, "-shared");
+    vector_append(j, cmd, "-fPIC");
+    vector_append(j, cmd, "-O2");
+    vector_append(j, cmd, "-o");
+    vector_append(j, cmd, j->out);
+    vector_append(j, cmd, src);
+    vector_append(j, cmd, "-ldl");
+    vector_append(j, cmd, NULL);
+    return j;
 }
 
-void Nobita_Target_Add_Deps(struct nobita_target *t, ...)
+/*
+ * Makes a command run with the tracing library preloaded, what it read
+ * the last time it ran is added to it's inputs
+ */
+static void nobita_plan_trace(struct nobita_target *t)
 {
-    if (nobita_build_failed)
+    struct nobita_job *j = t->job;
+    struct nobita_job *lib = nobita_plan_trace_lib(t);
+    if (lib == NULL)
         return;
 
-    va_list va;
-    va_start(va, t);
+    nobita_job_add_dep(j, lib);
+    const char *preload = getenv("LD_PRELOAD");
+    j->trace = nobita_trace_log(t);
+    j->env[0] = nobita_strjoinl(
+        "", "LD_PRELOAD=", lib->out, (preload != NULL) ? ":" : "",
+        (preload != NULL) ? preload : "", NULL
+    );
+    j->env[1] = nobita_strjoinl("", "NOBITA_TRACE=", j->trace, NULL);
+    j->traced_from = j->inputs_used;
+
+    const char *known = nobita_state_get(t->b, "trace", nobita_job_key(j));
+    char *files = (known != NULL) ? nobita_strdup(known) : NULL;
+    Nobita_Free_Later(t->b, files);
+    for (char *f = files; f != NULL && *f != 0;) {
+        char *end = f + strcspn(f, "\t");
+        bool last = *end == 0;
+        *end = 0;
+        vector_append(j, inputs, f);
+        f = (last) ? end : end + 1;
+    }
+}
 
-    struct nobita_target *arg = va_arg(va, struct nobita_target *);
-    while (arg != NULL) {
-        vector_append(t, deps, arg);
-        arg = va_arg(va, struct nobita_target *);
+#ifndef _WIN32
+static int nobita_trace_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sorts paths and drops the ones that come up more than once */
+static size_t nobita_trace_unique(char **paths, size_t n, bool owned)
+{
+    qsort(paths, n, sizeof(*paths), nobita_trace_cmp);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (kept > 0 && strcmp(paths[kept - 1], paths[i]) == 0) {
+            if (owned)
+                free(paths[i]);
+        } else {
+            paths[kept++] = paths[i];
+        }
     }
 
-    va_end(va);
+    return kept;
 }
 
-void Nobita_CMD_Add_Args(Nobita_CMD *c, ...)
+/*
+ * Whether the traced path is one to keep as an input of j, what it wrote
+ * itself and it's outputs (all in wrote, sorted) are not
+ */
+static bool nobita_trace_keep(
+    struct nobita_job *j, const char *path, char **wrote, size_t n
+)
 {
-    if (nobita_build_failed)
-        return;
+    if (strncmp(path, "/proc/", 6) == 0 || strncmp(path, "/sys/", 5) == 0 ||
+            strncmp(path, "/dev/", 5) == 0 || strchr(path, '\t') != NULL ||
+            strcmp(path, j->trace) == 0 || !nobita_file_exist(path))
+        return false;
 
-    va_list va;
-    va_start(va, c);
+    return n == 0 ||
+        bsearch(&path, wrote, n, sizeof(*wrote), nobita_trace_cmp) == NULL;
+}
+#endif /* _WIN32 */
 
-    char *arg = va_arg(va, char *);
+/*
+ * A traced command is done, the files it read replace the ones from it's
+ * last run, they're kept in the state file and written back to it's trace
+ * so that's time is when it ran
+ */
+static void nobita_trace_done(struct nobita_build *b, struct nobita_job *j)
+{
 #ifndef _WIN32
-    while (arg != NULL) {
-        glob_t g;
-        if (glob(arg, GLOB_NOCHECK, NULL, &g) != 0) {
-            nobita_build_failed = true;
-            va_end(va);
-            fprintf(stderr,
-                "\tNOBITA\tERROR: The glob pattern %s for custom command %s is "
-                "invalid!\n", arg, c->name
-            );
+    if (nobita_build_failed)
+        return;
 
-            return;
-        }
+    struct {
+        size_t lines_used;
+        size_t lines_size;
+        char **lines;
+        size_t wrote_used;
+        size_t wrote_size;
+        char **wrote;
+        size_t read_used;
+        size_t read_size;
+        char **read;
+    } l = {0};
+
+    /* The same files are opened over and over, so the log is deduped first */
+    char *log = nobita_read_file(j->trace, NULL);
+    vector_init(&l, lines);
+    vector_init(&l, wrote);
+    vector_init(&l, read);
+    for (char *line = log; line != NULL && *line != 0;) {
+        char *end = line + strcspn(line, "\n");
+        bool last = *end == 0;
+        *end = 0;
+        if ((line[0] == 'r' || line[0] == 'w') && line[1] == ' ')
+            vector_append(&l, lines, line);
+
+        line = (last) ? end : end + 1;
+    }
 
-        for (size_t i = 0; i < g.gl_pathc; i++)
-            vector_append(c, custom_cmd, g.gl_pathv[i]);
+    l.lines_used = nobita_trace_unique(l.lines, l.lines_used, false);
+    for (size_t i = 0; i < l.lines_used; i++) {
+        char *path = realpath(l.lines[i] + 2, NULL);
+        if (path != NULL && l.lines[i][0] == 'w')
+            vector_append(&l, wrote, path);
+        else if (path != NULL)
+            vector_append(&l, read, path);
+    }
 
-        free(g.gl_pathv);
-        arg = va_arg(va, char *);
+    for (size_t i = 0; i < j->t->cmd_outputs_used; i++) {
+        char *path = realpath(j->t->cmd_outputs[i], NULL);
+        if (path != NULL)
+            vector_append(&l, wrote, path);
     }
-#else
-    while (arg != NULL) {
-        WIN32_FIND_DATAA d = {0};
-        HANDLE f = FindFirstFileA(arg, &d);
-        if (f == INVALID_HANDLE_VALUE) {
-            vector_append(c, custom_cmd, nobita_strdup(arg));
-            arg = va_arg(va, char *);
-            continue;
+
+    l.wrote_used = nobita_trace_unique(l.wrote, l.wrote_used, true);
+    l.read_used = nobita_trace_unique(l.read, l.read_used, true);
+    j->inputs_used = j->traced_from;
+    for (size_t i = 0; i < l.read_used; i++) {
+        char *path = l.read[i];
+        if (nobita_trace_keep(j, path, l.wrote, l.wrote_used)) {
+            vector_append(j, inputs, path);
+            Nobita_Free_Later(j->t->b, path);
         } else {
-            char *argdir = nobita_strdup(arg);
-            nobita_dirname(argdir);
-            vector_append(
-                c, custom_cmd,
-                nobita_strjoinl(NOBITA_PATHSEP, argdir, d.cFileName, NULL)
-            );
-            free(argdir);
+            free(path);
         }
+    }
 
-        char *argdir = nobita_strdup(arg);
-        nobita_dirname(argdir);
-        while (FindNextFileA(f, &d))
-            vector_append(
-                c, custom_cmd,
-                nobita_strjoinl(NOBITA_PATHSEP, argdir, d.cFileName, NULL)
-            );
+    vector_append(j, inputs, NULL);
+    char *files = (!nobita_build_failed)
+        ? nobita_strjoinv("\t", j->inputs + j->traced_from) : NULL;
 
-        free(argdir);
-        CloseHandle(f);
-        arg = va_arg(va, char *);
-    }
+    j->inputs_used -= (!nobita_build_failed) ? 1 : 0;
+    if (files != NULL)
+        nobita_state_set(b, "trace", nobita_job_key(j), files);
+
+    FILE *f = fopen(j->trace, "wb");
+    for (size_t i = j->traced_from; f != NULL && i < j->inputs_used; i++)
+        fprintf(f, "%s\n", j->inputs[i]);
+
+    if (f != NULL)
+        fclose(f);
+
+    free(files);
+    free(log);
+    for (size_t i = 0; i < l.wrote_used; i++)
+        free(l.wrote[i]);
+
+    vector_free(&l, lines);
+    vector_free(&l, wrote);
+    vector_free(&l, read);
+#else
+    (void)b;
+    (void)j;
 #endif /* _WIN32 */
+}
 
-    va_end(va);
+/*
+ * What a target a command with outputs depends on makes is one of it's
+ * inputs too, e.g. a generator that's built in the same build
+ */
+static void
+nobita_cmd_dep_inputs(struct nobita_job *j, struct nobita_target *d)
+{
+    if (d->target_type != NOBITA_CUSTOM_CMD && d->sources_used > 0 &&
+            d->job != NULL && d->job->out != NULL)
+        vector_append(j, inputs, d->job->out);
+
+    if (d->config != NULL)
+        vector_append(j, inputs, d->config);
+
+    vector_append_vector(j, inputs, d, cmd_outputs);
 }
 
-void Nobita_Target_Add_Fmt_Arg(
-        struct nobita_target *t, enum nobita_argtype a, const char *fmt, ...
-)
+/*
+ * Adds the jobs of a target and the targets it depends on to the graph,
+ * a target gets a job that copies it's headers once the targets it depends
+ * on are done (and generators have ran), a job for each of it's objects
+ * after that and a final job that links, archives or runs it's command
+ */
+static void nobita_plan_target(struct nobita_target *t)
 {
-    if (nobita_build_failed)
+    if (t->job != NULL || nobita_build_failed)
         return;
 
-    va_list va;
-    va_start(va, fmt);
-    int64_t arglen = vsnprintf(NULL, 0, fmt, va) + 1;
-    va_end(va);
-
-    char *arg = malloc(arglen * sizeof(char));
-    if (arg == NULL) {
+    if (t->planning) {
         nobita_build_failed = true;
-        fprintf(stderr,
-            "\tNOBITA\tERROR: Failed to add formatted arg to target %s\n",
-            t->name
+        fprintf(
+            stderr, "\tNOBITA\tERROR: Target %s depends on itself\n", t->name
         );
+
         return;
     }
 
-    va_start(va, fmt);
-    vsprintf(arg, fmt, va);
-    va_end(va);
+    t->planning = true;
+    for (size_t i = 0; i < t->deps_used; i++)
+        nobita_plan_target(t->deps[i]);
 
-    switch (a) {
-    case NOBITA_T_CFLAGS:
-        vector_append(t, cflags, arg);
-        Nobita_Free_Later(t->b, arg);
+    struct nobita_build *b = t->b->root;
+    t->gen = nobita_job_new(t, NOBITA_ACT_CUSTOM_CMD, NULL, NULL);
+    if (t->gen == NULL)
+        return;
+
+    t->gen->fn = nobita_copy_headers;
+    for (size_t i = 0; i < t->deps_used; i++) {
+        struct nobita_target *d = t->deps[i];
+        nobita_job_add_dep(
+            t->gen, (d->target_type == NOBITA_CUSTOM_CMD) ? d->job : d->gen
+        );
+    }
+
+    for (size_t i = 0; i < t->sources_used && t->pch != NULL; i++) {
+        const char *ext = strrchr(t->sources[i], '.');
+        if (ext != NULL && strcmp(ext, ".c") == 0 && t->pch_jobs[0] == NULL)
+            nobita_plan_pch(t, false);
+        else if (ext != NULL && nobita_is_cpp(ext) && t->pch_jobs[1] == NULL)
+            nobita_plan_pch(t, true);
+    }
+
+    nobita_plan_modules(t);
+    nobita_plan_pgo(t);
+    size_t first = b->jobs_used;
+    nobita_plan_objects(t);
+    nobita_plan_resources(t);
+    nobita_plan_probes(t);
+    size_t last = b->jobs_used;
+
+    char *name = NULL;
+    char *output = NULL;
+    const char *label = NULL;
+    enum nobita_action action = NOBITA_ACT_LINK;
+    switch (t->target_type) {
+    case NOBITA_EXECUTABLE:
+        name = nobita_strjoinl("", t->name, NOBITA_EXECUT_EXT, NULL);
+        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->bin, name, NULL);
+        label = "LD";
         break;
-    case NOBITA_T_LDFLAGS:
-        vector_append(t, ldflags, arg);
-        Nobita_Free_Later(t->b, arg);
+    case NOBITA_SHARED_LIB:
+        name = nobita_strjoinl("", "lib", t->name, NOBITA_SHARED_EXT, NULL);
+        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->lib, name, NULL);
+        label = "LD";
         break;
-    case NOBITA_T_CUSTOM_CMD:
-        vector_append(t, custom_cmd, arg);
+    case NOBITA_STATIC_LIB:
+        name = nobita_strjoinl("", "lib", t->name, NOBITA_STATIC_EXT, NULL);
+        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->lib, name, NULL);
+        label = "AR";
+        action = NOBITA_ACT_ARCHIVE;
         break;
-    default:
-      break;
+    case NOBITA_CUSTOM_CMD:
+        label = "CMD";
+        action = NOBITA_ACT_CUSTOM_CMD;
+        if (t->cmd_outputs_used > 0)
+            output = nobita_strdup(t->cmd_outputs[0]);
+        else if (t->trace)
+            output = nobita_trace_log(t);
+
+        break;
+    }
+
+    /* Without sources or arguments it only groups it's deps */
+    if (t->target_type == NOBITA_CUSTOM_CMD && t->custom_cmd_used == 0)
+        label = NULL;
+    else if (t->target_type != NOBITA_CUSTOM_CMD && t->sources_used == 0 &&
+            t->resources_used == 0)
+        label = NULL;
+
+    t->job = nobita_job_new(t, action, label, output);
+    nobita_job_add_dep(t->job, t->gen);
+    if (t->job != NULL && t->config != NULL)
+        t->job->fn = nobita_config_write;
+
+    if (t->job != NULL) {
+        vector_append_vector(t->job, inputs, t, link_inputs);
+        vector_append_vector(t->job, inputs, t, cmd_inputs);
+    }
+
+    for (size_t i = 0; i < t->deps_used; i++) {
+        struct nobita_target *d = t->deps[i];
+        nobita_job_add_dep(t->job, d->job);
+        if (t->job != NULL && (t->cmd_outputs_used > 0 || t->trace))
+            nobita_cmd_dep_inputs(t->job, d);
+
+        /* A library from a sub build is in that build's directory */
+        if (action == NOBITA_ACT_LINK && d->b->lib != t->b->lib &&
+                (d->target_type == NOBITA_SHARED_LIB ||
+                 d->target_type == NOBITA_STATIC_LIB))
+            Nobita_Target_Add_Fmt_Arg(
+                t, NOBITA_T_LDFLAGS, "%s%s",
+                (t->comp_opts.bt == NOBITA_BT_MSVC) ? "/LIBPATH:" : "-L",
+                d->b->lib
+            );
+    }
+
+    if (t->job != NULL && t->trace && label != NULL)
+        nobita_plan_trace(t);
+
+    for (size_t i = first; i < last && t->job != NULL; i++)
+        nobita_job_add_dep(t->job, b->jobs[i]);
+
+    if (t->job != NULL && label != NULL) {
+        switch (t->target_type) {
+        case NOBITA_EXECUTABLE:
+            nobita_set_exe(t->job, t->job->out);
+            break;
+        case NOBITA_SHARED_LIB:
+            nobita_set_sharedlib(t->job, t->job->out);
+            break;
+        case NOBITA_STATIC_LIB:
+            nobita_set_staticlib(t->job, t->job->out);
+            break;
+        case NOBITA_CUSTOM_CMD:
+            vector_append_vector(t->job, cmd, t, custom_cmd);
+            break;
+        }
+
+        vector_append(t->job, cmd, NULL);
     }
+
+    t->planning = false;
+    free(name);
+    free(output);
 }
 
-void Nobita_Try_Rebuild(Nobita_Build *b, const char *build_file)
+/*
+ * How many seconds a job is expected to take, from the last time it ran
+ * or from the size of it's source if it never ran before
+ */
+static double nobita_job_cost(struct nobita_build *b, struct nobita_job *j)
 {
-#ifdef _WIN32
-    printf("Self-rebuilds are not supported on windows...\n");
-    return;
-#endif
+    const char *time = nobita_state_get(b, "time", nobita_job_key(j));
+    double secs = 0;
+    if (time != NULL && sscanf(time, "%lf", &secs) == 1)
+        return secs;
+
+    switch (j->action) {
+    case NOBITA_ACT_COMPILE:
+        return 0.05 + (double)nobita_file_size(j->src) / 100000.0;
+    case NOBITA_ACT_LINK:
+        return 0.5 + 0.01 * (double)j->t->objects_used;
+    case NOBITA_ACT_ARCHIVE:
+        return 0.1 + 0.001 * (double)j->t->objects_used;
+    case NOBITA_ACT_CUSTOM_CMD:
+        return 0.5;
+    }
 
-    char *build_exe = b->argv[0];
-    char *nobita = __FILE__;
-    if (nobita_is_a_newer(build_exe, (char *)build_file) &&
-            nobita_is_a_newer(build_exe, nobita))
+    return 0;
+}
+
+/*
+ * Hashes a profile's contents into h, LLVM has one profile for all of a
+ * target's objects so it's read once and kept, it's only looked at once
+ * the job merging it is done and isn't written again in the same run
+ */
+static uint64_t
+nobita_profile_hash(struct nobita_build *b, uint64_t h, const char *path)
+{
+    for (size_t i = 0; i < b->profile_hashes_used; i++)
+        if (strcmp(b->profile_hashes[i].path, path) == 0)
+            return nobita_hash(h, &b->profile_hashes[i].hash, sizeof(h));
+
+    size_t len = 0;
+    char *data = nobita_read_file(path, &len);
+    struct nobita_profile_hash p = {
+        .path = nobita_strdup(path),
+        .hash = (data != NULL)
+            ? nobita_hash(NOBITA_HASH_INIT, data, len) : NOBITA_HASH_INIT,
+    };
+
+    free(data);
+    vector_append(b, profile_hashes, p);
+    if (nobita_build_failed)
+        free(p.path);
+
+    return nobita_hash(h, &p.hash, sizeof(h));
+}
+
+/*
+ * A hash of the whole command that makes a job's output, so a change to
+ * it's flags, linker or list of objects is seen even if no file changed,
+ * the number of LTO jobs is left out as it doesn't change the output and
+ * the profile it's compiled with is in it, it's worked out once a run
+ */
+static void nobita_job_fingerprint(struct nobita_job *j)
+{
+    if (j->fingerprint[0] != 0)
         return;
 
-    struct nobita_target e = {0};
-    vector_init(&e, full_cmd);
-#if defined(__clang__)
-    vector_append(&e, full_cmd, "clang");
-    vector_append(&e, full_cmd, "-Wall");
-    vector_append(&e, full_cmd, "-Wpedantic");
-    vector_append(&e, full_cmd, "-Wextra");
-    vector_append(&e, full_cmd, "-O3");
-    vector_append(&e, full_cmd, "-g");
-    vector_append(&e, full_cmd, "-fsanitize=address");
-    vector_append(&e, full_cmd, "-o");
-#elif defined(__GNUC__)
-    vector_append(&e, full_cmd, "gcc");
-    vector_append(&e, full_cmd, "-Wall");
-    vector_append(&e, full_cmd, "-Wpedantic");
-    vector_append(&e, full_cmd, "-Wextra");
-    vector_append(&e, full_cmd, "-O3");
-    vector_append(&e, full_cmd, "-g");
-    vector_append(&e, full_cmd, "-fsanitize=address");
-    vector_append(&e, full_cmd, "-o");
-#else
-    vector_append(&e, full_cmd, "cl");
-    vector_append(&e, full_cmd, "/Wall");
-    vector_append(&e, full_cmd, "/O2");
-    vector_append(&e, full_cmd, "/Zi");
-    vector_append(&e, full_cmd, "/fsanitize=address");
-    vector_append(&e, full_cmd, "/Fe:");
-#endif
+    uint64_t h = NOBITA_HASH_INIT;
+    for (size_t i = 0; i < j->cmd_used && j->cmd[i] != NULL; i++)
+        if (j->cmd[i] != j->lto_jobs)
+            h = nobita_hash(h, j->cmd[i], strlen(j->cmd[i]) + 1);
+
+    /* A step's code is the build's own, so it's rerun once that's rebuilt */
+    if (j == j->t->job && j->t->fn != NULL)
+        h = nobita_tool_identity(h, j->t->b->root->argv[0]);
+
+    if (j->profile != NULL)
+        h = nobita_profile_hash(j->t->b->root, h, j->profile);
+
+    snprintf(j->fingerprint, sizeof(j->fingerprint), "%016" PRIx64, h);
+}
+
+/* Whether any of the other files a job reads changed since it last ran */
+static bool nobita_job_inputs_newer(struct nobita_job *j)
+{
+    for (size_t i = 0; i < j->inputs_used; i++)
+        if (!nobita_is_a_newer(j->out, j->inputs[i]))
+            return true;
+
+    return false;
+}
+
+/* A hash of the contents of a job's inputs, so a rewrite of the same is seen */
+static void nobita_job_inputs_hash(struct nobita_job *j, char hash[17])
+{
+    uint64_t h = NOBITA_HASH_INIT;
+    for (size_t i = 0; i < j->inputs_used; i++) {
+        size_t len = 0;
+        char *data = nobita_read_file(j->inputs[i], &len);
+        h = nobita_hash(h, j->inputs[i], strlen(j->inputs[i]) + 1);
+        h = nobita_hash(h, &len, sizeof(len));
+        if (data != NULL)
+            h = nobita_hash(h, data, len);
+
+        free(data);
+    }
+
+    snprintf(hash, 17, "%016" PRIx64, h);
+}
+
+/*
+ * What a source is made of with it's comments and whitespace left out, so
+ * an edit to only those doesn't recompile it, the lines tokens are on are
+ * in the hash too when __LINE__ puts them in the object, their columns as
+ * well for debug info or a sanitizer, the headers it includes found in it's
+ * own directory or an include directory are hashed along, system ones are
+ * not as an object isn't recompiled for them either, inside a directive
+ * whether there's whitespace before a token is kept as it decides between
+ * '#define F(x)' and '#define F (x)'
+ */
+struct nobita_tokens {
+    uint64_t hash;
+    uint64_t lines;
+    bool by_line;
+    bool by_column;
+    bool never;
+    size_t quote_used;
+    size_t quote_size;
+    const char **quote;
+    size_t dirs_used;
+    size_t dirs_size;
+    const char **dirs;
+    size_t seen_used;
+    size_t seen_size;
+    char **seen;
+};
+
+static void nobita_tokens_file(struct nobita_tokens *tk, const char *path);
+
+static void nobita_tokens_add(
+    struct nobita_tokens *tk, const char *s, size_t n, size_t line,
+    size_t column
+)
+{
+    tk->hash = nobita_hash(tk->hash, s, n);
+    tk->hash = nobita_hash(tk->hash, &n, sizeof(n));
+    tk->lines = nobita_hash(tk->lines, s, n);
+    tk->lines = nobita_hash(tk->lines, &n, sizeof(n));
+    tk->lines = nobita_hash(tk->lines, &line, sizeof(line));
+    if (tk->by_column)
+        tk->lines = nobita_hash(tk->lines, &column, sizeof(column));
+}
+
+static bool nobita_tokens_is(const char *s, size_t n, const char *word)
+{
+    return strlen(word) == n && memcmp(s, word, n) == 0;
+}
+
+/* Where a string, character literal or header name starting at i ends */
+static size_t nobita_tokens_quoted(const char *s, size_t len, size_t i)
+{
+    char end = (s[i] == '<') ? '>' : s[i];
+    for (i++; i < len && s[i] != end && s[i] != '\n'; i++)
+        if (s[i] == '\\' && end != '>' && i + 1 < len)
+            i++;
 
-    vector_append(&e, full_cmd, build_exe);
-    vector_append(&e, full_cmd, (char *)build_file);
-    vector_append(&e, full_cmd, NULL);
+    return (i < len && s[i] == end) ? i + 1 : i;
+}
 
-    printf("\tLD\t%s\n", build_exe);
-    nobita_proc_append(b, e.full_cmd);
-    nobita_proc_wait_all(b);
-    e.full_cmd_used = 0;
-    for (int i = 0; i < b->argc; i++)
-        vector_append(&e, full_cmd, b->argv[i]);
+/* Where a C++ raw string starting at the quote at i ends */
+static size_t
+nobita_tokens_raw(const char *s, size_t len, size_t i, size_t *line)
+{
+    size_t open = i + 1;
+    while (open < len && s[open] != '(' && open - i <= 17)
+        open++;
+
+    for (size_t ii = open; ii < len; ii++) {
+        *line += (s[ii] == '\n') ? 1 : 0;
+        if (s[ii] == ')' && ii + open - i < len &&
+                memcmp(s + ii + 1, s + i + 1, open - i - 1) == 0 &&
+                s[ii + open - i] == '"')
+            return ii + open - i + 1;
+    }
 
-    vector_append(&e, full_cmd, NULL);
-    printf("\tCMD\t%s\n", e.full_cmd[0]);
-    nobita_proc_append(b, e.full_cmd);
-    nobita_proc_wait_all(b);
+    return len;
+}
 
-    vector_free(&e, full_cmd);
-    b->was_self_rebuilt = true;
+/* Where an operator or other punctuation starting at i ends */
+static size_t nobita_tokens_punct(const char *s, size_t len, size_t i)
+{
+    static const char *ops[] = {
+        ">>=", "<<=", "...", "->*", "<=>", "->", "++", "--", "<<", ">>",
+        "<=", ">=", "==", "!=", "&&", "||", "*=", "/=", "%=", "+=", "-=",
+        "&=", "^=", "|=", "##", "::", ".*", "<:", ":>", "<%", "%>", "%:",
+    };
+
+    for (size_t ii = 0; ii < sizeof(ops) / sizeof(*ops); ii++) {
+        size_t n = strlen(ops[ii]);
+        if (i + n <= len && memcmp(s + i, ops[ii], n) == 0)
+            return i + n;
+    }
+
+    return i + 1;
 }
 
-void Nobita_Target_Add_Headers(
-    struct nobita_target *t, const char *parent, ...
-)
+/* Hashes the file an include directive names, if it's one that's found */
+static void nobita_tokens_include(
+    struct nobita_tokens *tk, const char *from, const char *s, size_t n)
 {
-    if (nobita_build_failed)
+    if (n < 2 || (s[0] != '"' && s[0] != '<') ||
+            s[n - 1] != ((s[0] == '"') ? '"' : '>')) {
+        /* One named by a macro could be anything */
+        tk->never = true;
         return;
+    }
 
-    if (parent == NULL) {
-        nobita_build_failed = true;
-        fprintf(stderr,
-            "\tNOBITA\tERROR: When adding header files to a target, the parent "
-            "dir should not be NULL (target: %s)\n", t->name
-        );
-
+    char *name = malloc(n - 1);
+    char *dir = nobita_strdup(from);
+    if (name == NULL || dir == NULL) {
+        free(name);
+        free(dir);
+        tk->never = true;
         return;
     }
 
-    struct nobita_header h;
-    h.parent = (char *)parent;
+    memcpy(name, s + 1, n - 2);
+    name[n - 2] = 0;
+    nobita_dirname(dir);
+    size_t count = (s[0] == '"') ? tk->quote_used + tk->dirs_used + 1
+        : tk->dirs_used;
 
-    va_list va;
-    va_start(va, parent);
-    char *arg = va_arg(va, char *);
-    while (arg != NULL) {
-        h.header = arg;
-        vector_append(t, headers, h);
-        arg = va_arg(va, char *);
+    for (size_t i = 0; i < count; i++) {
+        const char *d = (s[0] == '<') ? tk->dirs[i]
+            : (i == 0) ? dir
+            : (i <= tk->quote_used) ? tk->quote[i - 1]
+            : tk->dirs[i - 1 - tk->quote_used];
+
+        char *path = (name[0] == '/' || name[0] == '\\' || name[0] == 0 ||
+                name[1] == ':') ? nobita_strdup(name)
+            : nobita_strjoinl(NOBITA_PATHSEP, d, name, NULL);
+
+        bool found = path != NULL && nobita_file_exist(path);
+        if (found)
+            nobita_tokens_file(tk, path);
+
+        free(path);
+        if (found)
+            break;
     }
 
-    va_end(va);
+    free(dir);
+    free(name);
 }
 
-char *Nobita_GetCwd(Nobita_Build *b)
+static void nobita_tokens_file(struct nobita_tokens *tk, const char *path)
 {
-    return b->cwd;
+    /* A header included again is the same as the first time around */
+    for (size_t i = 0; i < tk->seen_used; i++)
+        if (strcmp(tk->seen[i], path) == 0) {
+            nobita_tokens_add(tk, path, strlen(path) + 1, 0, 0);
+            return;
+        }
+
+    char *copy = nobita_strdup(path);
+    vector_append(tk, seen, copy);
+    if (nobita_build_failed) {
+        free(copy);
+        return;
+    }
+
+    size_t len = 0;
+    char *s = nobita_read_file(path, &len);
+    if (s == NULL) {
+        tk->never = true;
+        return;
+    }
+
+    nobita_tokens_add(tk, path, strlen(path) + 1, 0, 0);
+    size_t line = 1;
+    size_t bol_at = 0;
+    bool bol = true;
+    bool directive = false;
+    bool space = false;
+    int include = 0;
+    for (size_t i = 0; i < len;) {
+        if (s[i] == '\\' && (s[i + 1] == '\n' ||
+                (s[i + 1] == '\r' && s[i + 2] == '\n'))) {
+            i += (s[i + 1] == '\r') ? 3 : 2;
+            bol_at = i;
+            line++;
+            continue;
+        }
+
+        /* The end of a directive is where the next one can start */
+        if (s[i] == '\n') {
+            if (directive)
+                nobita_tokens_add(tk, "\n", 1, line, i - bol_at);
+
+            directive = false;
+            include = 0;
+            bol = true;
+            line++;
+            i++;
+            bol_at = i;
+            continue;
+        }
+
+        if (isspace((unsigned char)s[i])) {
+            space = true;
+            i++;
+            continue;
+        }
+
+        if (s[i] == '/' && s[i + 1] == '/') {
+            while (i < len && s[i] != '\n') {
+                line += (s[i] == '\\' && s[i + 1] == '\n') ? 1 : 0;
+                i += (s[i] == '\\' && s[i + 1] == '\n') ? 2 : 1;
+            }
+
+            continue;
+        }
+
+        if (s[i] == '/' && s[i + 1] == '*') {
+            for (i += 2; i < len && !(s[i] == '*' && s[i + 1] == '/'); i++)
+                if (s[i] == '\n') {
+                    bol_at = i + 1;
+                    line++;
+                }
+
+            i = (i < len) ? i + 2 : len;
+            space = true;
+            continue;
+        }
+
+        if (directive && space)
+            nobita_tokens_add(tk, " ", 1, line, i - bol_at);
+
+        space = false;
+        size_t start = i;
+        size_t at = line;
+        size_t column = i - bol_at;
+        unsigned char c = (unsigned char)s[i];
+        if (include == 2 && c == '<') {
+            i = nobita_tokens_quoted(s, len, i);
+        } else if (c == '"' || c == '\'') {
+            i = nobita_tokens_quoted(s, len, i);
+        } else if (isdigit(c) ||
+                (c == '.' && isdigit((unsigned char)s[i + 1]))) {
+            for (i++; i < len; i++) {
+                char p = s[i - 1];
+                if (!isalnum((unsigned char)s[i]) && s[i] != '_' &&
+                        s[i] != '.' && s[i] != '\'' &&
+                        !((s[i] == '+' || s[i] == '-') &&
+                          strchr("eEpP", p) != NULL))
+                    break;
+            }
+        } else if (isalpha(c) || c == '_' || c == '$' || c >= 0x80) {
+            while (i < len && (isalnum((unsigned char)s[i]) || s[i] == '_' ||
+                    s[i] == '$' || (unsigned char)s[i] >= 0x80))
+                i++;
+
+            size_t n = i - start;
+            const char *w = s + start;
+            if (s[i] == '"' && n <= 3 && w[n - 1] == 'R' &&
+                    strchr("LuU8", w[0]) != NULL)
+                i = nobita_tokens_raw(s, len, i, &line);
+            else if (s[i] == '"' && nobita_tokens_is(w, n, "R"))
+                i = nobita_tokens_raw(s, len, i, &line);
+            else if ((s[i] == '"' || s[i] == '\'') &&
+                    (nobita_tokens_is(w, n, "L") ||
+                     nobita_tokens_is(w, n, "u") ||
+                     nobita_tokens_is(w, n, "U") ||
+                     nobita_tokens_is(w, n, "u8")))
+                i = nobita_tokens_quoted(s, len, i);
+
+            if (nobita_tokens_is(w, n, "__LINE__") ||
+                    nobita_tokens_is(w, n, "__builtin_LINE") ||
+                    nobita_tokens_is(w, n, "assert"))
+                tk->by_line = true;
+
+            /* Columns are only known from the flags, dates never match */
+            if (nobita_tokens_is(w, n, "source_location") ||
+                    nobita_tokens_is(w, n, "__builtin_COLUMN") ||
+                    nobita_tokens_is(w, n, "__DATE__") ||
+                    nobita_tokens_is(w, n, "__TIME__") ||
+                    nobita_tokens_is(w, n, "__TIMESTAMP__"))
+                tk->never = true;
+        } else {
+            i = nobita_tokens_punct(s, len, i);
+        }
+
+        const char *w = s + start;
+        size_t n = i - start;
+        nobita_tokens_add(tk, w, n, at, column);
+        if (bol && c == '#') {
+            directive = true;
+            include = 1;
+        } else if (include == 1) {
+            include = (nobita_tokens_is(w, n, "include") ||
+                nobita_tokens_is(w, n, "include_next") ||
+                nobita_tokens_is(w, n, "import")) ? 2 : 0;
+        } else if (include == 2) {
+            nobita_tokens_include(tk, path, w, n);
+            include = 0;
+        }
+
+        bol = false;
+    }
+
+    free(s);
 }
 
-char *Nobita_GetCed(Nobita_Build *b)
+/* Whether a job's source is looked at by it's tokens instead of it's time */
+static bool nobita_job_tokens_wanted(struct nobita_job *j)
 {
-    return b->ced;
+    const char *ext = (j->src != NULL) ? strrchr(j->src, '.') : NULL;
+    return j->t->token_hash && j->action == NOBITA_ACT_COMPILE &&
+        j->depfile == NULL && j->unit == NULL && ext != NULL &&
+        (strcmp(ext, ".c") == 0 || nobita_is_cpp(ext));
 }
 
-char *Nobita_GetPrefix(Nobita_Build *b)
+/*
+ * The token hash of a job's source and headers, with the include
+ * directories and the flags that put lines and columns in the object
+ * taken from it's command, a '-' when it can't be told apart from an edit
+ */
+static void nobita_job_tokens_hash(struct nobita_job *j, char hash[18])
 {
-    return b->prefix;
+    struct nobita_tokens tk = {
+        .hash = NOBITA_HASH_INIT,
+        .lines = NOBITA_HASH_INIT,
+    };
+
+    vector_init(&tk, quote);
+    vector_init(&tk, dirs);
+    vector_init(&tk, seen);
+    const char *forced[8];
+    size_t forced_used = 0;
+    for (size_t i = 0; i < j->cmd_used && j->cmd[i] != NULL; i++) {
+        const char *a = j->cmd[i];
+        const char *next = j->cmd[i + 1];
+        if ((a[0] == '-' || a[0] == '/') && a[1] == 'I') {
+            const char *dir = (a[2] != 0) ? a + 2 : next;
+            i += (a[2] != 0 || next == NULL) ? 0 : 1;
+            if (dir != NULL)
+                vector_append(&tk, dirs, dir);
+        } else if (strcmp(a, "-iquote") == 0 && next != NULL) {
+            vector_append(&tk, quote, next);
+            i++;
+        } else if ((strcmp(a, "-include") == 0 || strcmp(a, "/FI") == 0) &&
+                next != NULL && forced_used < 8) {
+            forced[forced_used++] = next;
+            i++;
+        } else if ((strncmp(a, "-g", 2) == 0 && strcmp(a, "-g0") != 0) ||
+                strncmp(a, "-fsanitize", 10) == 0 ||
+                strcmp(a, "--coverage") == 0 || strcmp(a, "/Zi") == 0 ||
+                strcmp(a, "/Z7") == 0 || strcmp(a, "/ZI") == 0) {
+            tk.by_line = true;
+            tk.by_column = true;
+        }
+    }
+
+    for (size_t i = 0; i < forced_used; i++)
+        if (nobita_file_exist(forced[i]))
+            nobita_tokens_file(&tk, forced[i]);
+
+    nobita_tokens_file(&tk, j->src);
+    if (tk.never || nobita_build_failed)
+        snprintf(hash, 18, "-");
+    else
+        snprintf(hash, 18, "%c%016" PRIx64,
+            (tk.by_column) ? 'c' : (tk.by_line) ? 'l' : 't',
+            (tk.by_line) ? tk.lines : tk.hash);
+
+    for (size_t i = 0; i < tk.seen_used; i++)
+        free(tk.seen[i]);
+
+    vector_free(&tk, quote);
+    vector_free(&tk, dirs);
+    vector_free(&tk, seen);
 }
 
-char *Nobita_GetInclude(Nobita_Build *b)
+/*
+ * Whether a job's object is older than it's source only because of edits
+ * to comments or whitespace since it was compiled
+ */
+static bool nobita_job_tokens_same(struct nobita_job *j)
 {
-    return b->include;
+    if (!nobita_job_tokens_wanted(j) || !nobita_file_exist(j->out))
+        return false;
+
+    char hash[18];
+    nobita_job_tokens_hash(j, hash);
+    const char *last = nobita_state_get(j->t->b->root, "tokens", j->out);
+    return hash[0] != '-' && last != NULL && strcmp(last, hash) == 0;
 }
 
-char *Nobita_GetBin(Nobita_Build *b)
+/* Whether a job's command is not the one it's output was last made with */
+static bool nobita_job_cmd_changed(struct nobita_job *j)
 {
-    return b->bin;
+    nobita_job_fingerprint(j);
+    const char *last = nobita_state_get(j->t->b->root, "cmd", j->out);
+    return last == NULL || strcmp(last, j->fingerprint) != 0;
 }
 
-char *Nobita_GetLib(Nobita_Build *b)
+/*
+ * Whether a command with declared outputs or a trace has to run, when an
+ * input is newer than one of them the contents of the inputs are compared
+ * with the ones it last ran with first
+ */
+static bool nobita_cmd_is_dirty(struct nobita_job *j)
 {
-    return b->lib;
+    struct nobita_target *t = j->t;
+    size_t n = (t->cmd_outputs_used > 0) ? t->cmd_outputs_used : 1;
+    bool newer = false;
+    for (size_t i = 0; i < n; i++) {
+        const char *out = (t->cmd_outputs_used > 0)
+            ? t->cmd_outputs[i] : j->out;
+
+        if (!nobita_file_exist(out))
+            return true;
+
+        for (size_t ii = 0; ii < j->inputs_used && !newer; ii++)
+            newer = !nobita_is_a_newer(out, j->inputs[ii]);
+    }
+
+    if (nobita_job_cmd_changed(j))
+        return true;
+
+    /* Without any inputs all it can go by is what it depends on */
+    for (size_t i = 0; i < j->deps_used && j->inputs_used == 0; i++)
+        if (j->deps[i]->ran)
+            return true;
+
+    if (!newer)
+        return false;
+
+    char hash[17];
+    nobita_job_inputs_hash(j, hash);
+    const char *last = nobita_state_get(t->b->root, "inputs", j->out);
+    return last == NULL || strcmp(last, hash) != 0;
 }
 
-static struct nobita_target *
-nobita_build_add_target(struct nobita_build *b, const char *name)
+/*
+ * Whether a job has to run, looked at once everything it depends on is
+ * done as generators may have touched it's inputs in the meantime
+ */
+static bool nobita_job_is_dirty(struct nobita_job *j)
 {
-    if (nobita_build_failed)
-        return NULL;
+    if (j->cmd_used == 0)
+        return false;
 
-    if (name == NULL) {
-        nobita_build_failed = true;
-        fprintf(
-            stderr, "\tNOBITA\tERROR: A target's name should not be NULL\n"
-        );
+    /* It's recorded once the job is done, whether it's looked at or not */
+    if (j->out != NULL)
+        nobita_job_fingerprint(j);
 
-        return NULL;
+    if (j->t->b->root->force)
+        return true;
+
+    switch (j->action) {
+    case NOBITA_ACT_COMPILE:
+        if (nobita_job_inputs_newer(j) || nobita_job_cmd_changed(j) ||
+                (j->depfile != NULL &&
+                 nobita_depfile_is_newer(j->depfile, j->out)) ||
+                (j->unit != NULL && j->unit->bmi != NULL &&
+                 !nobita_file_exist(j->unit->bmi)))
+            return true;
+
+        return !nobita_is_a_newer(j->out, j->src) &&
+            !nobita_job_tokens_same(j);
+    case NOBITA_ACT_LINK:
+    case NOBITA_ACT_ARCHIVE:
+        if (!nobita_file_exist(j->out) || nobita_job_inputs_newer(j))
+            return true;
+
+        for (size_t i = 0; i < j->deps_used; i++)
+            if (j->deps[i]->ran)
+                return true;
+
+        for (size_t i = 0; i < j->deps_used; i++)
+            if (j->deps[i]->action == NOBITA_ACT_COMPILE &&
+                    nobita_is_a_newer(j->deps[i]->out, j->out))
+                return true;
+
+        return nobita_job_cmd_changed(j);
+    case NOBITA_ACT_CUSTOM_CMD:
+        if (j == j->t->job && (j->t->cmd_outputs_used > 0 || j->trace))
+            return nobita_cmd_is_dirty(j);
+
+        if (j->out == NULL || !nobita_file_exist(j->out))
+            return true;
+
+        for (size_t i = 0; i < j->deps_used; i++)
+            if (j->deps[i]->ran)
+                return true;
+
+        return nobita_job_cmd_changed(j);
     }
 
-    struct nobita_target *t = calloc(1, sizeof(*t));
-    if (t == NULL) {
-        nobita_build_failed = true;
-        fprintf(stderr, "\tNOBITA\tERROR: Could not create target %s\n", name);
-        return NULL;
+    return true;
+}
+
+/*
+ * Guesses which jobs will run from the timestamps as they are now, then
+ * gives each job the length of the longest chain of work that's left from
+ * it to the end of the build, jobs are made after the jobs they depend on
+ * so walking them backwards sees every user of a job before the job itself
+ */
+static void nobita_plan_priorities(struct nobita_build *b)
+{
+    for (size_t i = 0; i < b->jobs_used; i++) {
+        struct nobita_job *j = b->jobs[i];
+        bool dirty = j->cmd_used > 0 && j->out == NULL;
+        /* A profile isn't final yet, so it's time goes instead of a hash */
+        if (j->cmd_used > 0 && j->action == NOBITA_ACT_COMPILE)
+            dirty = !nobita_is_a_newer(j->out, j->src) ||
+                nobita_job_inputs_newer(j) ||
+                ((j->profile != NULL)
+                    ? !nobita_is_a_newer(j->out, j->profile)
+                    : nobita_job_cmd_changed(j)) ||
+                (j->depfile != NULL &&
+                 nobita_depfile_is_newer(j->depfile, j->out));
+        else if (j->cmd_used > 0 && j->out != NULL)
+            dirty = !nobita_file_exist(j->out) ||
+                nobita_job_inputs_newer(j) || nobita_job_cmd_changed(j);
+
+        for (size_t ii = 0; ii < j->deps_used && j->cmd_used > 0; ii++)
+            dirty = dirty || (j->action != NOBITA_ACT_COMPILE &&
+                j->deps[ii]->cost > 0);
+
+        j->cost = (dirty) ? nobita_job_cost(b, j) : 0;
+        j->rss = nobita_mem_predict(b, j->action, nobita_job_key(j));
     }
 
-    t->name = (char *)name;
-    vector_init(t, cflags);
-    vector_init(t, sources);
-    vector_init(t, objects);
-    vector_init(t, ldflags);
-    vector_init(t, full_cmd);
-    vector_init(t, custom_cmd);
-    vector_init(t, headers);
-    vector_init(t, deps);
+    for (size_t i = b->jobs_used; i > 0; i--) {
+        struct nobita_job *j = b->jobs[i - 1];
+        double longest = 0;
+        for (size_t ii = 0; ii < j->users_used; ii++)
+            if (j->users[ii]->priority > longest)
+                longest = j->users[ii]->priority;
 
-    vector_append(b, deps, t);
-    t->b = b;
-    return t;
+        j->priority = j->cost + longest;
+    }
 }
 
-static nobita_pid nobita_proc_exec(char **cmd, char *joined_cmd)
+static void
+nobita_job_done(struct nobita_build *b, struct nobita_job *j, bool ran)
 {
-    nobita_pid id = (nobita_pid)-1;
-    if (nobita_build_failed)
-        return id;
+    j->ran = ran;
+    j->done = true;
 
-#ifndef _WIN32
-    id = fork();
-    if (id == -1) {
-        nobita_build_failed = true;
-        fprintf(
-            stderr, "\tNOBITA\tERROR: Creating the process\n'%s'\nFailed!\n",
-            joined_cmd
-        );
+    /* What's kept for it is still in use even when it wasn't looked at */
+    const char *kinds[] = {"cmd", "inputs", "tokens", "time", "rss", "trace"};
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(*kinds); i++)
+        nobita_state_find(b, kinds[i], nobita_job_key(j));
 
-        return id;
+    if (j->fn != NULL)
+        j->fn(j);
+
+    if (ran && j->dirty && j->out != NULL)
+        nobita_state_set(b, "cmd", j->out, j->fingerprint);
+
+    if (ran && j->dirty && j == j->t->job &&
+            (j->t->cmd_outputs_used > 0 || j->trace != NULL)) {
+        char hash[17];
+        nobita_job_inputs_hash(j, hash);
+        nobita_state_set(b, "inputs", j->out, hash);
     }
 
-    if (id == 0) {
-        execvp(*cmd, cmd);
-        exit(errno);
-    } else {
-        return id;
+    /*
+     * Recorded after every compile, an old hash left over from before
+     * could match an edit that's undone later
+     */
+    if (ran && j->dirty && j->action == NOBITA_ACT_COMPILE &&
+            j->out != NULL && (j->tokens[0] != '-' ||
+                nobita_state_get(b, "tokens", j->out) != NULL))
+        nobita_state_set(b, "tokens", j->out, j->tokens);
+
+    for (size_t i = 0; i < j->users_used; i++) {
+        struct nobita_job *u = j->users[i];
+        u->waiting -= 1;
+        if (u->waiting == 0)
+            vector_append(b, ready, u);
     }
-#else
-    STARTUPINFO s = {0};
-    PROCESS_INFORMATION p = {0};
-    s.cb = sizeof(s);
+}
 
-    if (!CreateProcessA(
-            NULL, joined_cmd, NULL, NULL, false, 0, NULL, NULL, &s, &p
-         )
-       ) {
-        nobita_build_failed = true;
-        fprintf(
-            stderr, "\tNOBITA\tERROR: Creating the process\n'%s'\nFailed!\n",
-            joined_cmd
-        );
+/* Marks everything that needs j as never going to run */
+static void nobita_job_poison(struct nobita_build *b, struct nobita_job *j)
+{
+    for (size_t i = 0; i < j->users_used; i++) {
+        struct nobita_job *u = j->users[i];
+        if (u->failed)
+            continue;
 
-        return id;
-    } else {
-        return p.hProcess;
+        u->failed = true;
+        b->jobs_skipped += (u->cmd_used > 0) ? 1 : 0;
+        nobita_job_poison(b, u);
     }
-#endif /* _WIN32 */
 }
 
-static int nobita_proc_wait(nobita_pid pid, bool pause)
+/*
+ * A job's process failed, what it wrote is removed so the next run can't
+ * take a half written object as up to date, and only the jobs that need
+ * it are given up on while everything else keeps going
+ */
+static void nobita_job_failed(struct nobita_build *b, struct nobita_job *j)
 {
-    int status = -1;
-#ifndef _WIN32
-    waitpid(pid, &status, (pause) ? 0 : WNOHANG);
-#else
-    status = WaitForSingleObject(pid, (pause) ? INFINITE : 0);
-#endif /* _WIN32 */
+    j->failed = true;
+    b->jobs_failed += 1;
+    if (j->out != NULL)
+        remove(j->out);
+
+    for (size_t i = 0; j == j->t->job && i < j->t->cmd_outputs_used; i++)
+        remove(j->t->cmd_outputs[i]);
 
-    return status;
+    nobita_job_poison(b, j);
 }
 
-static void nobita_proc_append(struct nobita_build *b, char **cmd)
+/* Whether enough jobs failed to stop starting new ones, see -k */
+static bool nobita_jobs_stopped(struct nobita_build *b)
 {
-    if (nobita_build_failed)
-        return;
+    return b->keep_going > 0 && b->jobs_failed >= b->keep_going;
+}
 
-    if (b->proc_queue_used >= nobita_max_proc_count)
-        nobita_proc_wait_one(b);
+/*
+ * Whether a compile can share a process with others, which needs it's
+ * object to be named after it's source the way the compiler names it
+ */
+static bool nobita_job_groupable(struct nobita_job *j)
+{
+    if (!j->t->batch_compile || j->action != NOBITA_ACT_COMPILE ||
+            !j->dirty || j->unit != NULL || j->profile != NULL ||
+            j->depfile != NULL || j->cmd_used < 5)
+        return false;
 
-    if (nobita_build_failed)
-        return;
+    const char *ext = strrchr(j->src, '.');
+    if (ext == NULL || (strcmp(ext, ".c") != 0 && !nobita_is_cpp(ext)))
+        return false;
 
-    char *c = nobita_strjoinv(" ", cmd);
-    if (c == NULL)
-        nobita_build_failed = true;
+    const char *src = strrchr(j->src, *NOBITA_PATHSEP);
+    const char *out = strrchr(j->out, *NOBITA_PATHSEP);
+    src = (src != NULL) ? src + 1 : j->src;
+    out = (out != NULL) ? out + 1 : j->out;
+    size_t n = (size_t)(ext - src);
+    return strncmp(src, out, n) == 0 && out[n] == '.' &&
+        strchr(out + n + 1, '.') == NULL;
+}
+
+/* Whether r can be compiled in the same process as j */
+static bool nobita_job_groups_with(struct nobita_job *j, struct nobita_job *r)
+{
+    if (r == j || !nobita_job_groupable(r) || r->t->b != j->t->b ||
+            r->cmd_used != j->cmd_used)
+        return false;
 
-    nobita_pid pid = nobita_proc_exec(cmd, c);
-    vector_append(b, proc_queue, pid);
-    vector_append(b, proc_names, c);
+    /* Everything but '-o obj -c src' and the NULL at the end */
+    for (size_t i = 0; i < j->cmd_used - 5; i++)
+        if (strcmp(j->cmd[i], r->cmd[i]) != 0)
+            return false;
 
-    if (nobita_build_failed)
-        free(c);
+    const char *jd = strrchr(j->out, *NOBITA_PATHSEP);
+    const char *rd = strrchr(r->out, *NOBITA_PATHSEP);
+    return jd != NULL && rd != NULL && jd - j->out == rd - r->out &&
+        strncmp(j->out, r->out, (size_t)(jd - j->out)) == 0;
 }
 
-static void nobita_proc_wait_one(struct nobita_build *b)
+/*
+ * Takes the ready compiles that can share j's process off the ready list,
+ * the ready compiles are spread over the free process slots so each slot
+ * still gets some
+ */
+static void nobita_job_group(struct nobita_build *b, struct nobita_job *j)
 {
-    bool continue_loop = !nobita_build_failed;
-    while (continue_loop) {
-        for (size_t i = 0; i < b->proc_queue_used; i++) {
-            int status = nobita_proc_wait(b->proc_queue[i], false);
-#ifndef _WIN32
-            if (status != -1 && WIFEXITED(status)) {
-#else
-            if (status != WAIT_FAILED && status == WAIT_OBJECT_0) {
-                CloseHandle(b->proc_queue[i]);
-#endif /* _WIN32 */
-                b->proc_queue[i] = b->proc_queue[b->proc_queue_used - 1];
-                b->proc_queue_used -= 1;
+    j->group_used = 0;
+    if (!nobita_job_groupable(j))
+        return;
 
-#ifndef _WIN32
-                if (WEXITSTATUS(status) != EXIT_SUCCESS) {
-#else
-                if (status == WAIT_FAILED) {
-#endif /* _WIN32 */
-                  nobita_build_failed = true;
-                  fprintf(
-                      stderr,
-                      "\tNOBITA\tERROR: A process did not exit sucessfully, "
-                      "marking build as failed\n"
-                  );
-
-                  fprintf(stderr, "\tNOBITA\tCmd: %s\n", b->proc_names[i]);
-                }
+    size_t n = 1;
+    for (size_t i = 0; i < b->ready_used; i++) {
+        struct nobita_job *r = b->ready[i];
+        if (!r->checked) {
+            r->dirty = nobita_job_is_dirty(r);
+            r->checked = true;
+        }
 
-                free(b->proc_names[i]);
-                b->proc_names[i] = b->proc_names[b->proc_names_used - 1];
-                b->proc_names_used -= 1;
-                continue_loop = false;
-                break;
-            }
+        n += nobita_job_groupable(r) ? 1 : 0;
+    }
+
+    size_t slots = (b->procs_used < nobita_max_proc_count)
+        ? nobita_max_proc_count - b->procs_used : 1;
+    size_t size = (n + slots - 1) / slots;
+    size = (size < NOBITA_COMPILE_GROUP) ? size : NOBITA_COMPILE_GROUP;
+    for (size_t i = 0; i < b->ready_used && j->group_used + 1 < size;) {
+        struct nobita_job *r = b->ready[i];
+        if (!nobita_job_groups_with(j, r)) {
+            i++;
+            continue;
         }
+
+        vector_append(j, group, r);
+        b->ready[i] = b->ready[b->ready_used - 1];
+        b->ready_used -= 1;
     }
 }
 
-static void nobita_proc_wait_all(struct nobita_build *b)
+/*
+ * Takes the ready job with the longest chain of work after it that may
+ * start right now, jobs that have nothing to run are taken first as they
+ * don't need a process, token is set if a jobserver token is all it lacks
+ */
+static struct nobita_job *nobita_job_pick(struct nobita_build *b, bool *token)
 {
-    for (size_t i = 0; i < b->proc_queue_used; i++) {
-        int status = nobita_proc_wait(b->proc_queue[i], true);
-#ifndef _WIN32
-        if (!WIFEXITED(status)) {
-            nobita_build_failed = true;
-            fprintf(stderr, "\tNOBITA\tERROR: A process did not exit\n");
-            fprintf(stderr, "\tNOBITA\tCmd: %s\n", b->proc_names[i]);
+    bool slots = b->procs_used < nobita_max_proc_count &&
+        !nobita_load_too_high(b);
+    size_t threads = 0;
+    for (size_t i = 0; i < b->procs_used; i++)
+        threads += b->procs[i].threads;
+
+    struct nobita_job *best = NULL;
+    size_t best_i = 0;
+    for (size_t i = 0; i < b->ready_used; i++) {
+        struct nobita_job *j = b->ready[i];
+        if (!j->checked) {
+            j->dirty = nobita_job_is_dirty(j);
+            j->checked = true;
         }
 
-        if (WEXITSTATUS(status) != EXIT_SUCCESS) {
-            nobita_build_failed = true;
-            fprintf(
-                stderr, "\tNOBITA\tERROR: A process did not exit successfully\n"
-            );
-            fprintf(stderr, "\tNOBITA\tCmd: %s\n", b->proc_names[i]);
-        }
-#else
-        if (status == WAIT_FAILED) {
-            nobita_build_failed = true;
-            fprintf(stderr, "\tNOBITA\tERROR: A process did not exit\n");
-            fprintf(stderr, "\tNOBITA\tCmd: %s\n", b->proc_names[i]);
+        if (!j->dirty) {
+            best = j;
+            best_i = i;
+            break;
         }
 
-        if (status != WAIT_OBJECT_0) {
-            nobita_build_failed = true;
-            fprintf(
-                stderr, "\tNOBITA\tERROR: A process did not exit successfully\n"
-            );
-            fprintf(stderr, "\tNOBITA\tCmd: %s\n", b->proc_names[i]);
+        struct nobita_pool *pool = nobita_target_pool(j->t, j->action);
+        if (!slots || (pool != NULL && pool->running >= pool->depth) ||
+                !nobita_mem_admit(b, j->rss) ||
+                (b->procs_used > 0 &&
+                 threads + j->threads > nobita_max_proc_count))
+            continue;
+
+        if (best == NULL || j->priority > best->priority ||
+                (j->priority == best->priority && j->index < best->index)) {
+            best = j;
+            best_i = i;
         }
+    }
 
-        CloseHandle(b->proc_queue[i]);
-#endif /* _WIN32 */
+    if (best == NULL)
+        return NULL;
 
-        free(b->proc_names[i]);
+    if (best->dirty && !nobita_jobserver_acquire(b)) {
+        *token = true;
+        return NULL;
     }
 
-    b->proc_queue_used = 0;
-    b->proc_names_used = 0;
+    b->ready[best_i] = b->ready[b->ready_used - 1];
+    b->ready_used -= 1;
+    nobita_job_group(b, best);
+    return best;
 }
 
-void nobita_mkdir_recursive(const char *path)
+/*
+ * Adds an argument to a response file, one per line and quoted the way
+ * gcc and ar read them (a backslash before anything special) or the way
+ * MSVC does (in double quotes)
+ */
+static void nobita_rsp_quote(
+    struct nobita_rsp *r, const char *arg, enum nobita_build_tool bt
+)
 {
-    if (nobita_build_failed)
-        return;
-
-    char *p2 = nobita_strdup(path);
-    if (p2 == NULL) {
-        nobita_build_failed = true;
-        fprintf(
-            stderr,
-            "\tNOBITA\tERROR: Could not copy path '%s' for mkdir recursive\n",
-            path
-        );
-        return;
-    }
-
-    size_t len = strlen(p2);
-    for (size_t i = 1; i < len; i++) {
-        if (p2[i] == *NOBITA_PATHSEP) {
-            p2[i] = 0;
+    if (bt == NOBITA_BT_MSVC) {
+        size_t slashes = 0;
+        vector_append(r, buf, '"');
+        for (const char *c = arg; *c != 0; c++) {
+            if (*c == '"')
+                for (size_t i = 0; i < slashes + 1; i++)
+                    vector_append(r, buf, '\\');
+
+            slashes = (*c == '\\') ? slashes + 1 : 0;
+            vector_append(r, buf, *c);
+        }
 
-            if (!nobita_dir_exist(p2)) {
-                printf("\tMKDIR\t%s\n", p2);
-                mkdir(p2, 0777);
-            }
+        for (size_t i = 0; i < slashes; i++)
+            vector_append(r, buf, '\\');
 
-            p2[i] = *NOBITA_PATHSEP;
+        vector_append(r, buf, '"');
+    } else {
+        if (*arg == 0) {
+            vector_append(r, buf, '\'');
+            vector_append(r, buf, '\'');
         }
-    }
 
-    if (!nobita_dir_exist(p2)) {
-        printf("\tMKDIR\t%s\n", p2);
-        mkdir(p2, 0777);
+        for (const char *c = arg; *c != 0; c++) {
+            if (strchr(" \t\n\r\v\f\\'\"", *c) != NULL)
+                vector_append(r, buf, '\\');
+
+            vector_append(r, buf, *c);
+        }
     }
 
-    free(p2);
+    vector_append(r, buf, '\n');
 }
 
-bool nobita_is_a_newer(const char *a, const char *b)
+/*
+ * Moves everything but the program into a response file once a command
+ * gets too long, gcc, ar and lib.exe all read '@file' arguments, the file
+ * sits in the target's cache directory and is only rewritten if it changed
+ */
+static void nobita_job_rsp(struct nobita_job *j)
 {
-    if (!nobita_file_exist(b))
-        return true;
-    else if (!nobita_file_exist(a))
-        return false;
+    free(j->rsp);
+    j->rsp = NULL;
+    if (j->action == NOBITA_ACT_CUSTOM_CMD || j->cmd_used < 3)
+        return;
 
-#ifndef _WIN32
-    struct stat s_a, s_b;
-    memset(&s_a, 0, sizeof(s_a));
-    memset(&s_b, 0, sizeof(s_b));
-    stat(a, &s_a);
-    stat(b, &s_b);
-    return (s_a.st_mtime > s_b.st_mtime);
-#else
-    WIN32_FILE_ATTRIBUTE_DATA s_a, s_b;
-    memset(&s_a, 0, sizeof(s_a));
-    memset(&s_b, 0, sizeof(s_b));
-    GetFileAttributesExA(a, GetFileExInfoStandard, &s_a);
-    GetFileAttributesExA(b, GetFileExInfoStandard, &s_b);
-    return CompareFileTime(&s_a.ftLastWriteTime, &s_b.ftLastWriteTime) == 1;
-#endif /* _WIN32 */
-}
+    size_t len = 0;
+    for (size_t i = 0; i + 1 < j->cmd_used; i++)
+        len += strlen(j->cmd[i]) + 1;
 
-bool nobita_file_exist(const char *path)
-{
-#ifndef _WIN32
-    struct stat buf;
-    if (stat(path, &buf) == -1)
-        return false;
+    if (len < NOBITA_RSP_THRESHOLD)
+        return;
 
-    return !S_ISDIR(buf.st_mode);
-#else
-    WIN32_FILE_ATTRIBUTE_DATA s;
-    memset(&s, 0, sizeof(s));
-    if (GetFileAttributesExA(path, GetFileExInfoStandard, &s) == 0)
-        return false;
+    struct nobita_target *t = j->t;
+    struct nobita_rsp r;
+    char *path = NULL;
+    vector_init(&r, buf);
+    for (size_t i = 1; i + 1 < j->cmd_used; i++)
+        nobita_rsp_quote(&r, j->cmd[i], t->comp_opts.bt);
 
-    return !(s.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
-#endif /* _WIN32 */
+    if (j->action == NOBITA_ACT_COMPILE) {
+        path = nobita_strjoinl("", j->out, ".rsp", NULL);
+    } else {
+        const char *base = strrchr(j->out, *NOBITA_PATHSEP);
+        base = (base != NULL) ? base + 1 : j->out;
+        char *dir = nobita_strjoinl(
+            NOBITA_PATHSEP, t->b->ced, "nobita-cache", t->name,
+            nobita_cache_kind(t->target_type), NULL
+        );
+
+        nobita_mkdir_recursive(dir);
+        path = nobita_strjoinl("", dir, NOBITA_PATHSEP, base, ".rsp", NULL);
+        free(dir);
+    }
+
+    if (nobita_build_failed) {
+        vector_free(&r, buf);
+        free(path);
+        return;
+    }
+
+    size_t old_len = 0;
+    char *old = nobita_read_file(path, &old_len);
+    bool same = old != NULL && old_len == r.buf_used &&
+        memcmp(old, r.buf, old_len) == 0;
+    FILE *f = (same) ? NULL : fopen(path, "wb");
+    if (f != NULL) {
+        same = fwrite(r.buf, 1, r.buf_used, f) == r.buf_used;
+        same = fclose(f) == 0 && same;
+    }
+
+    /* The command still works as it is if the file can't be written */
+    if (same) {
+        j->rsp = nobita_strjoinl("", "@", path, NULL);
+        j->rsp_cmd[0] = j->cmd[0];
+        j->rsp_cmd[1] = j->rsp;
+        j->rsp_cmd[2] = NULL;
+    }
+
+    free(old);
+    free(path);
+    vector_free(&r, buf);
 }
 
-bool nobita_dir_exist(const char *path)
+/* Whether two objects would get the same member name in an archive */
+static bool nobita_members_clash(struct nobita_job *j)
 {
-#ifndef _WIN32
-    struct stat buf;
-    if (stat(path, &buf) == -1)
-        return false;
+    for (size_t i = 0; i < j->deps_used; i++) {
+        if (j->deps[i]->action != NOBITA_ACT_COMPILE)
+            continue;
 
-    return S_ISDIR(buf.st_mode);
-#else
-    WIN32_FILE_ATTRIBUTE_DATA s;
-    memset(&s, 0, sizeof(s));
-    if (GetFileAttributesExA(path, GetFileExInfoStandard, &s) == 0)
-        return false;
+        const char *a = strrchr(j->deps[i]->out, *NOBITA_PATHSEP);
+        a = (a != NULL) ? a + 1 : j->deps[i]->out;
+        for (size_t ii = i + 1; ii < j->deps_used; ii++) {
+            if (j->deps[ii]->action != NOBITA_ACT_COMPILE)
+                continue;
 
-    return (s.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
-#endif /* _WIN32 */
+            const char *b = strrchr(j->deps[ii]->out, *NOBITA_PATHSEP);
+            b = (b != NULL) ? b + 1 : j->deps[ii]->out;
+            if (strcmp(a, b) == 0)
+                return true;
+        }
+    }
+
+    return false;
 }
 
-static bool nobita_build_objects(struct nobita_target *t)
+/*
+ * Updating an archive only hands ar the objects newer than it, they
+ * replace their old members, but it's made from scratch when it's command
+ * changed (the list of objects or the thin option) so objects that are
+ * gone don't linger, or when two objects share a member name as ar can't
+ * tell which one to replace
+ */
+static void nobita_job_archive(struct nobita_build *b, struct nobita_job *j)
 {
-    bool rebuild = false;
-    bool is_known = true;
-    for (size_t i = 0; i < t->objects_used; i++) {
-        if (!nobita_is_a_newer(t->objects[i], t->sources[i]) || rebuild) {
-            char *ext = strrchr(t->sources[i], '.');
-            if (strcmp(ext, ".c") == 0)
-                vector_append(t, full_cmd, t->comp_opts.cc);
-            else if (strcmp(ext, ".cpp") == 0 || strcmp(ext, ".cc") == 0)
-                vector_append(t, full_cmd, t->comp_opts.cxx);
-            else if (strcasecmp(ext, ".s") == 0)
-                vector_append(t, full_cmd, t->comp_opts.as);
-            else
-                is_known = false;
+    struct nobita_target *t = j->t;
+    if (j->action != NOBITA_ACT_ARCHIVE || t->comp_opts.bt == NOBITA_BT_MSVC ||
+            j->cmd_used < 4)
+        return;
 
-            if (strcasecmp(ext, ".s") != 0)
-                vector_append_vector(t, full_cmd, t, cflags);
+    bool full = b->force || nobita_job_cmd_changed(j) ||
+        !nobita_file_exist(j->out) ||
+        (!t->thin_archive && nobita_members_clash(j));
 
-            switch (t->comp_opts.bt) {
-            case NOBITA_BT_GCC:
-            case NOBITA_BT_LLVM:
-                vector_append(t, full_cmd, t->comp_opts.to_exe);
-                break;
-            case NOBITA_BT_MSVC:
-                vector_append(t, full_cmd, t->comp_opts.rename_obj);
-                break;
-            }
+    if (full)
+        remove(j->out);
 
-            vector_append(t, full_cmd, t->objects[i]);
-            vector_append(t, full_cmd, t->comp_opts.to_obj);
-            vector_append(t, full_cmd, t->sources[i]);
-            vector_append(t, full_cmd, NULL);
-
-            if (!nobita_build_failed) {
-                if (strcmp(ext, ".c") == 0)
-                    printf("\tCC\t%s\n", t->objects[i]);
-                else if (strcmp(ext, ".cpp") == 0 || strcmp(ext, ".cc")){
-                    printf("\tCXX\t%s\n", t->objects[i]);
-                    t->is_cpp = true;
-                }
-                else if (strcasecmp(ext, ".s") == 0)
-                    printf("\tAS\t%s\n", t->objects[i]);
-                else
-                    printf("\t???\t%s\n", t->objects[i]);
-            }
+    j->cmd_used = 3;
+    for (size_t i = 0; i < j->deps_used; i++)
+        if (j->deps[i]->action == NOBITA_ACT_COMPILE &&
+                (full || nobita_is_a_newer(j->deps[i]->out, j->out)))
+            vector_append(j, cmd, j->deps[i]->out);
 
-            if (is_known)
-                nobita_proc_append(t->b, t->full_cmd);
+    vector_append(j, cmd, NULL);
+}
 
-            t->full_cmd_used = 0;
-            rebuild = true;
-        }
+/*
+ * Whether arg is a flag naming a file or directory to include from, n is
+ * set to the flag's length so what's after it is the path, if there is one
+ */
+static bool nobita_group_flag(const char *arg, size_t *n)
+{
+    static const char *flags[] = {
+        "-I", "-iquote", "-isystem", "-idirafter", "-include", "-imacros"
+    };
+
+    for (size_t i = 0; i < sizeof(flags) / sizeof(*flags); i++) {
+        *n = strlen(flags[i]);
+        if (strncmp(arg, flags[i], *n) == 0)
+            return true;
     }
 
-    nobita_proc_wait_all(t->b);
-    return rebuild;
+    *n = 0;
+    return false;
 }
 
-static void nobita_set_exe(struct nobita_target *t, const char *output)
+/*
+ * The path in arg after it's first n characters made absolute against
+ * base, as a group's compiler runs in the object directory instead, returns
+ * NULL when it already is
+ */
+static char *nobita_group_path(const char *arg, size_t n, const char *base)
 {
-    char *comp = (t->is_cpp) ? t->comp_opts.cxx : t->comp_opts.cc;
-    switch (t->comp_opts.bt) {
-    case NOBITA_BT_GCC:
-    case NOBITA_BT_LLVM:
-    case NOBITA_BT_MSVC:
-        vector_append(t, full_cmd, comp);
-        vector_append_vector(t, full_cmd, t, cflags);
-        vector_append(t, full_cmd, t->comp_opts.to_exe);
-        vector_append(t, full_cmd, (char *)output);
-        vector_append_vector(t, full_cmd, t, objects);
-        vector_append_vector(t, full_cmd, t, ldflags);
-        break;
-    }
+    const char *path = arg + n;
+    if (path[0] == 0 || path[0] == '/' || path[0] == '\\' || path[1] == ':')
+        return NULL;
+
+    size_t len = n + strlen(base) + strlen(path) + 2;
+    char *ret = malloc(len);
+    if (ret != NULL)
+        snprintf(ret, len, "%.*s%s%s%s", (int)n, arg, base, NOBITA_PATHSEP,
+            path);
 
-    printf("\tLD\t%s\n", output);
+    return ret;
 }
 
-static void nobita_set_sharedlib(struct nobita_target *t, const char *output)
+/*
+ * Compiles j and it's group with one process, the objects are removed
+ * first so the ones that are there afterwards are known to be new
+ */
+static void nobita_group_start(struct nobita_build *b, struct nobita_job *j)
 {
-    char *comp = (t->is_cpp) ? t->comp_opts.cxx : t->comp_opts.cc;
-    switch (t->comp_opts.bt) {
-    case NOBITA_BT_GCC:
-    case NOBITA_BT_LLVM:
-    case NOBITA_BT_MSVC:
-        vector_append(t, full_cmd, comp);
-        vector_append_vector(t, full_cmd, t, cflags);
-        vector_append(t, full_cmd, t->comp_opts.to_lib);
-        vector_append(t, full_cmd, t->comp_opts.to_exe);
-        vector_append(t, full_cmd, (char *)output);
-        vector_append_vector(t, full_cmd, t, objects);
-        vector_append_vector(t, full_cmd, t, ldflags);
-        break;
+    struct nobita_target *t = j->t;
+    bool msvc = t->comp_opts.bt == NOBITA_BT_MSVC;
+    const char *base = (t->b != b) ? t->b->ced : b->cwd;
+    char *dir = nobita_strdup(j->out);
+    struct nobita_job tmp = {0};
+    size_t rss = j->rss;
+    vector_init(&tmp, cmd);
+    bool next = false;
+    for (size_t i = 0; i < j->cmd_used - 5; i++) {
+        char *path = NULL;
+        size_t n = 0;
+        if (next)
+            path = nobita_group_path(j->cmd[i], 0, base);
+        else if (!msvc && i > 0 && nobita_group_flag(j->cmd[i], &n))
+            path = nobita_group_path(j->cmd[i], n, base);
+
+        next = !next && n > 0 && j->cmd[i][n] == 0;
+        vector_append(&tmp, cmd, (path != NULL) ? path : j->cmd[i]);
     }
 
-    printf("\tLD\t%s\n", output);
-}
+    nobita_dirname(dir);
+    char *fo = (msvc) ? nobita_strjoinl("", dir, NOBITA_PATHSEP, NULL) : NULL;
+    vector_append(&tmp, cmd, t->comp_opts.to_obj);
+    if (msvc) {
+        vector_append(&tmp, cmd, t->comp_opts.rename_obj);
+        vector_append(&tmp, cmd, fo);
+    }
 
-static void nobita_set_staticlib(struct nobita_target *t, const char *output)
-{
-    switch (t->comp_opts.bt) {
-    case NOBITA_BT_GCC:
-    case NOBITA_BT_LLVM:
-        vector_append(t, full_cmd, t->comp_opts.ar);
-        vector_append(t, full_cmd, t->comp_opts.ar_opts);
-        vector_append(t, full_cmd, (char *)output);
-        vector_append_vector(t, full_cmd, t, objects);
-        break;
-    case NOBITA_BT_MSVC:
-        Nobita_Target_Add_Fmt_Arg(
-            t, NOBITA_T_CFLAGS, "%s%s", t->comp_opts.ar_opts, output
-        );
+    for (size_t i = 0; i <= j->group_used; i++) {
+        struct nobita_job *m = (i == 0) ? j : j->group[i - 1];
+        if (i > 0)
+            printf("\t%s\t%s\n", m->label, m->out);
 
-        vector_append(t, full_cmd, t->comp_opts.ar);
-        vector_append(t, full_cmd, t->cflags[t->cflags_used - 1]);
-        vector_append_vector(t, full_cmd, t, objects);
-        break;
+        remove(m->out);
+        rss = (m->rss > rss) ? m->rss : rss;
+        vector_append(&tmp, cmd, (char *)m->src);
     }
 
-    printf("\tAR\t%s\n", output);
+    vector_append(&tmp, cmd, NULL);
+    nobita_proc_start(
+        b, tmp.cmd, (msvc) ? ((t->b != b) ? t->b->ced : NULL) : dir,
+        j->action, nobita_target_pool(t, j->action), rss, NULL, j
+    );
+
+    for (size_t i = 0; i < j->cmd_used - 5 && i < tmp.cmd_used; i++)
+        if (tmp.cmd[i] != j->cmd[i])
+            free(tmp.cmd[i]);
+
+    vector_free(&tmp, cmd);
+    free(dir);
+    free(fo);
 }
 
-static void nobita_build_target(struct nobita_target *t)
+/*
+ * A group's process is done, each compile in it is done if it's object
+ * was made, took is shared between them as the time they're known by,
+ * when it was killed the object it was writing could be cut short so none
+ * of them are kept
+ */
+static void nobita_group_done(
+    struct nobita_build *b, struct nobita_job *j, double took, bool killed
+)
 {
-    if (t->built || nobita_build_failed)
-        return;
-
-    bool rebuild = false;
-    for (size_t i = 0; i < t->deps_used; i++) {
-        nobita_build_target(t->deps[i]);
-        rebuild = (!rebuild)
-            ? ((struct nobita_target *)t->deps[i])->rebuilt
-            : true;
+    size_t n = j->group_used + 1;
+    j->group_used = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct nobita_job *m = (i == 0) ? j : j->group[i - 1];
+        if (killed) {
+            remove(m->out);
+            nobita_job_failed(b, m);
+        } else if (nobita_file_exist(m->out)) {
+            nobita_state_setf(b, "time", m->out, "%.3f", took / n);
+            nobita_job_done(b, m, true);
+        } else {
+            nobita_job_failed(b, m);
+        }
     }
+}
 
-    if (t->deps_used > 0)
-        nobita_proc_wait_all(t->b);
+static void nobita_job_start(struct nobita_build *b, struct nobita_job *j)
+{
+    if (!j->dirty) {
+        bool ran = false;
+        for (size_t i = 0; i < j->deps_used && j->cmd_used == 0; i++)
+            ran = ran || j->deps[i]->ran;
 
-    for (size_t i = 0; i < t->headers_used; i++) {
-        char *parent = t->headers[i].parent;
-        char *header = t->headers[i].header;
-        char *src = nobita_strjoinl(NOBITA_PATHSEP, parent, header, NULL);
-        char *dest = nobita_strjoinl(
-            NOBITA_PATHSEP, t->b->include, header, NULL
-        );
+        nobita_job_done(b, j, ran);
+        return;
+    }
 
-        nobita_dirname(dest);
-        nobita_mkdir_recursive(dest);
-        *strchr(dest, 0) = *NOBITA_PATHSEP;
+    if (j->probe != NULL) {
+        printf("\tPROBE\t%s\n",
+            (j->probe->define != NULL) ? j->probe->define : j->probe->arg
+        );
+    } else if (j == j->t->job && j->t->fn != NULL) {
+        printf("\tFN\t%s\n", j->t->name);
+    } else if (j->action == NOBITA_ACT_CUSTOM_CMD) {
+        printf("\tCMD\t");
+        for (size_t i = 0; i < j->cmd_used - 1; i++)
+            printf("%s ", j->cmd[i]);
 
-        if (nobita_is_a_newer(src, dest))
-            nobita_cp(dest, src);
+        printf("\n");
+    } else {
+        printf("\t%s\t%s\n", j->label, j->out);
+    }
 
-        free(src);
-        free(dest);
+    /* Taken before it runs, an edit made while it does is seen next time */
+    for (size_t i = 0; i <= j->group_used; i++) {
+        struct nobita_job *m = (i == 0) ? j : j->group[i - 1];
+        strcpy(m->tokens, "-");
+        if (nobita_job_tokens_wanted(m))
+            nobita_job_tokens_hash(m, m->tokens);
     }
 
-    rebuild = nobita_build_objects(t);
-    char *name = NULL;
-    char *output = NULL;
+    struct nobita_target *t = j->t;
+    if (j->group_used > 0) {
+        nobita_group_start(b, j);
+        return;
+    }
 
-    switch (t->target_type) {
-    case NOBITA_EXECUTABLE:
-        name = nobita_strjoinl("", t->name, NOBITA_EXECUT_EXT, NULL);
-        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->bin, name, NULL);
-        break;
-    case NOBITA_SHARED_LIB:
-        name = nobita_strjoinl("", "lib", t->name, NOBITA_SHARED_EXT, NULL);
-        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->lib, name, NULL);
-        break;
-    case NOBITA_STATIC_LIB:
-        name = nobita_strjoinl("", "lib", t->name, NOBITA_STATIC_EXT, NULL);
-        output = nobita_strjoinl(NOBITA_PATHSEP, t->b->lib, name, NULL);
-        break;
-    case NOBITA_CUSTOM_CMD:
-        break;
+    if (j == t->job && t->fn != NULL) {
+        nobita_fn_start(b, j, nobita_target_pool(t, j->action));
+        return;
     }
 
-    if (!rebuild)
-        for (size_t i = 0; i < t->objects_used; i++)
-            rebuild = (!rebuild)
-                ? nobita_is_a_newer(t->objects[i], output)
-                : true;
+    if (j->trace != NULL)
+        remove(j->trace);
 
-    if (!rebuild && t->target_type != NOBITA_CUSTOM_CMD)
-        goto end;
+    nobita_job_archive(b, j);
+    nobita_job_rsp(j);
+    nobita_proc_start(
+        b, (j->rsp != NULL) ? j->rsp_cmd : j->cmd,
+        (t->b != b) ? t->b->ced : NULL, j->action,
+        nobita_target_pool(t, j->action), j->rss, nobita_job_key(j), j
+    );
+}
 
-    switch (t->target_type) {
-    case NOBITA_EXECUTABLE:
-        nobita_set_exe(t, output);
-        break;
-    case NOBITA_SHARED_LIB:
-        nobita_set_sharedlib(t, output);
-        break;
-    case NOBITA_STATIC_LIB:
-        nobita_set_staticlib(t, output);
-        break;
-    case NOBITA_CUSTOM_CMD:
-        vector_append_vector(t, full_cmd, t, custom_cmd);
-        break;
+/* Runs the planned jobs until they're all done or something failed */
+static void nobita_run_jobs(struct nobita_build *b)
+{
+    b = b->root;
+    nobita_plan_priorities(b);
+    for (size_t i = 0; i < b->jobs_used; i++)
+        if (b->jobs[i]->waiting == 0)
+            vector_append(b, ready, b->jobs[i]);
+
+    while (!nobita_build_failed && !nobita_jobs_stopped(b) &&
+            (b->ready_used > 0 || b->procs_used > 0)) {
+        bool token = false;
+        struct nobita_job *j = nobita_job_pick(b, &token);
+        if (j != NULL)
+            nobita_job_start(b, j);
+        else if (token)
+            nobita_jobserver_wait(b);
+        else if (b->procs_used > 0)
+            nobita_proc_wait_one(b);
+        else
+            break;
     }
 
-    vector_append(t, full_cmd, NULL);
-    if (t->sources_used > 0 || t->target_type == NOBITA_CUSTOM_CMD)
-        nobita_proc_append(t->b, t->full_cmd);
+    nobita_proc_wait_all(b);
+    if (b->jobs_failed > 0) {
+        nobita_build_failed = true;
+        fprintf(
+            stderr,
+            "\tNOBITA\tERROR: %zu job(s) failed, %zu job(s) that need them "
+            "were not run\n", b->jobs_failed, b->jobs_skipped
+        );
+    }
 
-    if (t->target_type == NOBITA_CUSTOM_CMD) {
-        printf("\tCMD\t");
-        for (size_t i = 0; i < t->full_cmd_used - 1; i++)
-            printf("%s ", t->full_cmd[i]);
+    /* Only a build that got to every job knows what's no longer needed */
+    b->state_prune = !nobita_build_failed;
+    for (size_t i = 0; i < b->jobs_used; i++)
+        b->state_prune = b->state_prune && b->jobs[i]->done;
+}
 
-        printf("\n");
-        nobita_proc_wait_all(t->b);
+/*
+ * Runs every planned job as if they were all out of date, alternating
+ * between rounds without and with pinning, then prints how long each took,
+ * a first round that isn't counted warms the caches up and which of the two
+ * goes first swaps every round so neither always runs after the other
+ */
+static void nobita_run_bench(struct nobita_build *b, size_t rounds)
+{
+    enum nobita_pin pin = b->pin;
+    double took[2] = {0, 0};
+    size_t procs = 0;
+    for (size_t i = 0; i < b->jobs_used; i++)
+        procs += (b->jobs[i]->cmd_used > 0) ? 1 : 0;
+
+    b->force = true;
+    for (size_t r = 0; r <= rounds * 2 && !nobita_build_failed; r++) {
+        size_t pinned = (r == 0) ? 0 : ((r - 1) % 2) ^ (((r - 1) / 2) % 2);
+        b->pin = (pinned == 0) ? NOBITA_PIN_NONE : pin;
+        for (size_t i = 0; i < b->jobs_used; i++) {
+            b->jobs[i]->waiting = b->jobs[i]->deps_used;
+            b->jobs[i]->checked = false;
+            b->jobs[i]->ran = false;
+            b->jobs[i]->done = false;
+        }
+
+        b->ready_used = 0;
+        double start = nobita_now();
+        nobita_run_jobs(b);
+        if (r > 0)
+            took[pinned] += nobita_now() - start;
     }
 
-    t->rebuilt = true;
-end:
-    t->built = true;
-    free(name);
-    free(output);
+    b->force = false;
+    b->pin = pin;
+    if (nobita_build_failed)
+        return;
+
+    for (size_t i = 0; i < 2; i++)
+        printf(
+            "\tBENCH\t%-8s %.3fs per build, %.2f processes/s\n",
+            (i == 0) ? "unpinned" : "pinned", took[i] / rounds,
+            (took[i] > 0) ? procs * rounds / took[i] : 0
+        );
 }
 
 void nobita_cp(const char *dest, const char *src) 
@@ -1797,72 +9040,174 @@ static void nobita_dirname(char *p)
     *s = 0;
 }
 
+static void nobita_usage(const char *argv0)
+{
+    printf("nobita build usage: %s [options] [proc_count] [prefix]\n", argv0);
+    printf("options:\n");
+    printf("  -h, --help          show this help\n");
+    printf("  -j N                same as proc_count, defaults to the CPUs\n"
+           "                      this process may use (affinity and cgroup\n"
+           "                      quota), the prefix is then the only\n"
+           "                      argument left\n");
+    printf("  -k N                keep going until N jobs failed, 0 for no\n"
+           "                      limit, only jobs that need a failed one\n"
+           "                      are skipped\n");
+    printf("  -l LOAD             don't start more processes while the load\n"
+           "                      average is above LOAD\n");
+    printf("  --jobserver[=STYLE] be the make jobserver for child processes,\n"
+           "                      STYLE is pipe (the default) or fifo\n");
+    printf("  --no-mem-check      start processes without checking if their\n"
+           "                      last peak memory use still fits\n");
+    printf("  --output-on-failure only print what processes wrote when they\n"
+           "                      fail\n");
+    printf("  --pin=POLICY        pin each process to a set of CPUs, POLICY is\n"
+           "                      numa (the least busy NUMA node), core (the\n"
+           "                      least busy CPU) or link (links get the last\n"
+           "                      NUMA node to themselves)\n");
+    printf("  --pin-bench[=N]     rebuild everything N times (1 by default)\n"
+           "                      without and with pinning and print how\n"
+           "                      long it took, after one build to warm up\n");
+    printf("  --recheck           run every config check again instead of\n"
+           "                      taking the result it had last time\n");
+}
+
 int main(int argc, char **argv)
 {
     struct nobita_build b;
     char *prefix = NULL;
-    if (argc >= 2) {
-        if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
-            printf("nobita build usage: %s proc_count prefix\n", argv[0]);
+    char *pos[2] = {NULL, NULL};
+    size_t pos_used = 0;
+    const char *jobserver = NULL;
+    const char *jobs = NULL;
+    const char *load = NULL;
+    const char *keep = NULL;
+    bool mem_check = true;
+    bool output_on_failure = false;
+    bool recheck = false;
+    enum nobita_pin pin = NOBITA_PIN_NONE;
+    size_t bench = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            nobita_usage(argv[0]);
             return EXIT_SUCCESS;
-        } else {
-            if (sscanf(argv[1], "%" SCNu64, &nobita_max_proc_count) != 1) {
-                fprintf(
-                    stderr, "\tNOBITA\tERROR: Invalid number for proc_count\n"
-                );
-                printf(
-                    "\tNOBITA\tnobita build usage: %s proc_count prefix\n",
-                    argv[0]
-                );
-
+        } else if (strncmp(argv[i], "-j", 2) == 0 ||
+                strncmp(argv[i], "-l", 2) == 0 ||
+                strncmp(argv[i], "-k", 2) == 0) {
+            const char **opt = (argv[i][1] == 'j') ? &jobs
+                : (argv[i][1] == 'l') ? &load : &keep;
+            if (argv[i][2] != 0)
+                *opt = argv[i] + 2;
+            else if (i + 1 < argc)
+                *opt = argv[++i];
+            else
+                *opt = "";
+        } else if (strcmp(argv[i], "--no-mem-check") == 0) {
+            mem_check = false;
+        } else if (strcmp(argv[i], "--output-on-failure") == 0) {
+            output_on_failure = true;
+        } else if (strcmp(argv[i], "--recheck") == 0) {
+            recheck = true;
+        } else if (strcmp(argv[i], "--pin=numa") == 0) {
+            pin = NOBITA_PIN_NUMA;
+        } else if (strcmp(argv[i], "--pin=core") == 0) {
+            pin = NOBITA_PIN_CORE;
+        } else if (strcmp(argv[i], "--pin=link") == 0) {
+            pin = NOBITA_PIN_LINK;
+        } else if (strcmp(argv[i], "--pin-bench") == 0) {
+            bench = 1;
+        } else if (strncmp(argv[i], "--pin-bench=", 12) == 0) {
+            if (sscanf(argv[i] + 12, "%zu", &bench) != 1 || bench == 0) {
+                fprintf(stderr, "\tNOBITA\tERROR: Invalid number of rounds\n");
+                nobita_usage(argv[0]);
                 return EXIT_FAILURE;
             }
+        } else if (strcmp(argv[i], "--jobserver") == 0) {
+            jobserver = "pipe";
+        } else if (strncmp(argv[i], "--jobserver=", 12) == 0) {
+            jobserver = argv[i] + 12;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "\tNOBITA\tERROR: Unknown option %s\n", argv[i]);
+            nobita_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else if (pos_used < 2) {
+            pos[pos_used++] = argv[i];
+        } else {
+            fprintf(stderr, "\tNOBITA\tERROR: Too many arguments\n");
+            nobita_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* With -j the process count isn't given in it's place, the prefix is */
+    const char *where = (jobs != NULL) ? pos[0] : pos[1];
+    if (jobs != NULL && pos[1] != NULL) {
+        fprintf(stderr, "\tNOBITA\tERROR: Too many arguments\n");
+        nobita_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    jobs = (jobs == NULL) ? pos[0] : jobs;
+    if (jobs != NULL) {
+        if (sscanf(jobs, "%zu", &nobita_max_proc_count) != 1 ||
+                nobita_max_proc_count == 0) {
+            fprintf(
+                stderr, "\tNOBITA\tERROR: Invalid number for proc_count\n"
+            );
+            nobita_usage(argv[0]);
+            return EXIT_FAILURE;
         }
+    } else {
+        nobita_max_proc_count = nobita_default_proc_count();
+    }
+
+    size_t keep_going = 1;
+    if (keep != NULL && sscanf(keep, "%zu", &keep_going) != 1) {
+        fprintf(stderr, "\tNOBITA\tERROR: Invalid number for -k\n");
+        nobita_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    double max_load = 0;
+    if (load != NULL && (sscanf(load, "%lf", &max_load) != 1 || max_load <= 0)) {
+        fprintf(stderr, "\tNOBITA\tERROR: Invalid number for the load\n");
+        nobita_usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
     char *ced = nobita_getced(argv[0]);
     char *cwd = nobita_getcwd();
-    if (argc >= 3) {
-        if (strlen(argv[2]) == 0) {
+    if (where != NULL) {
+        if (strlen(where) == 0) {
             fprintf(stderr, "\tNOBITA\tERROR: Invalid prefix length 0\n");
-            printf(
-                "\tNOBITA\tnobita build usage: %s proc_count prefix\n", argv[0]
-            );
-
+            nobita_usage(argv[0]);
             free(ced);
             free(cwd);
             return EXIT_FAILURE;
         }
 
 #ifndef _WIN32
-        if (argv[2][0] != '/') {
+        if (where[0] != '/') {
             fprintf(stderr,
                     "\tNOBITA\tERROR: Invalid prefix (not an absolute path)\n");
-            printf(
-                "\tNOBITA\tnobita build usage: %s proc_count prefix\n", argv[0]
-            );
-
+            nobita_usage(argv[0]);
             free(ced);
             free(cwd);
             return EXIT_FAILURE;
         }
 #else
-        if (argv[2][1] != ':' && argv[2][1] != '\\') {
+        if (where[1] != ':' && where[1] != '\\') {
             fprintf(
                 stderr,
                 "\tNOBITA\tERROR: Invalid prefix (not an absolute path)\n"
             );
-            printf(
-                "\tNOBITA\tnobita build usage: %s proc_count prefix\n", argv[0]
-            );
-
+            nobita_usage(argv[0]);
             free(ced);
             free(cwd);
             return EXIT_FAILURE;
         }
 #endif /* _WIN32 */
 
-        prefix = nobita_strdup(argv[2]);
+        prefix = nobita_strdup(where);
     } else {
         prefix = nobita_strjoinl(NOBITA_PATHSEP, cwd, "nobita-build", NULL);
     }
@@ -1871,7 +9216,9 @@ int main(int argc, char **argv)
     char *bin = nobita_strjoinl(NOBITA_PATHSEP, prefix, "bin", NULL);
     char *lib = nobita_strjoinl(NOBITA_PATHSEP, prefix, "lib", NULL);
 
-    printf("\tNOBITA\tPROC_COUNT = %" PRIu64 "\n", nobita_max_proc_count);
+    printf("\tNOBITA\tPROC_COUNT = %zu\n", nobita_max_proc_count);
+    if (max_load > 0)
+        printf("\tNOBITA\tMAX_LOAD   = %.2f\n", max_load);
     printf("\tNOBITA\tCACHE_DIR  = %s%s%s\n", ced, NOBITA_PATHSEP,
             "nobita-cache");
     printf("\tNOBITA\tPREFIX_DIR = %s\n", prefix);
@@ -1884,14 +9231,31 @@ int main(int argc, char **argv)
     nobita_mkdir_recursive(lib);
     nobita_mkdir_recursive(include);
 
+    memset(&b, 0, sizeof(b));
+    b.root = &b;
+    b.js_read = -1;
+    b.js_write = -1;
+    vector_init(&b, subbuilds);
     vector_init(&b, deps);
     vector_init(&b, free_later);
-    vector_init(&b, proc_queue);
-    vector_init(&b, proc_names);
+    vector_init(&b, procs);
+#ifndef _WIN32
+    vector_init(&b, polls);
+#endif /* _WIN32 */
+    vector_init(&b, jobs);
+    vector_init(&b, ready);
+    vector_init(&b, state);
+    vector_init(&b, pools);
+    vector_init(&b, cpu_sets);
+    vector_init(&b, linker_probes);
+    vector_init(&b, profile_hashes);
+    vector_init(&b, pchs);
+    vector_init(&b, scanner_probes);
+    vector_init(&b, js_tokens);
 
     b.argc = argc;
     b.argv = argv;
-    b.was_self_rebuilt = false;
+    b.rebuild_profile = NOBITA_RP_FAST;
 
     b.ced = ced;
     b.cwd = cwd;
@@ -1900,11 +9264,30 @@ int main(int argc, char **argv)
     b.bin = bin;
     b.lib = lib;
 
+    b.mem_check = mem_check;
+    b.max_load = max_load;
+    b.output_on_failure = output_on_failure;
+    b.recheck = recheck;
+    b.keep_going = keep_going;
+    b.pin = (bench > 0 && pin == NOBITA_PIN_NONE) ? NOBITA_PIN_NUMA : pin;
+    nobita_pin_init(&b);
+    nobita_state_load(&b);
+    nobita_jobserver_client_init(&b, jobs != NULL);
     build(&b);
 
-    if (!b.was_self_rebuilt)
-        for (size_t i = 0; i < b.deps_used; i++)
-            nobita_build_target(b.deps[i]);
+    if (jobserver != NULL)
+        nobita_jobserver_server_init(&b, jobserver);
+
+    for (size_t i = 0; i < b.deps_used; i++)
+        nobita_plan_target(b.deps[i]);
+
+    if (bench > 0)
+        nobita_run_bench(&b, bench);
+    else
+        nobita_run_jobs(&b);
+
+    for (size_t i = 0; i < b.jobs_used; i++)
+        nobita_job_free(b.jobs[i]);
 
     for (size_t i = 0; i < b.deps_used; i++) {
         struct nobita_target *t = b.deps[i];
@@ -1916,6 +9299,24 @@ int main(int argc, char **argv)
         for (size_t ii = 0; ii < t->custom_cmd_used; ii++)
             free(t->custom_cmd[ii]);
 
+        for (size_t ii = 0; ii < t->unity_exclude_used; ii++)
+            free(t->unity_exclude[ii]);
+
+        for (size_t ii = 0; ii < t->cmd_inputs_used; ii++)
+            free(t->cmd_inputs[ii]);
+
+        for (size_t ii = 0; ii < t->cmd_outputs_used; ii++)
+            free(t->cmd_outputs[ii]);
+
+        for (size_t ii = 0; ii < t->resources_used; ii++)
+            free(t->resources[ii]);
+
+        for (size_t ii = 0; ii < t->trainings_used; ii++)
+            free(t->trainings[ii]);
+
+        for (size_t ii = 0; ii < t->probes_used; ii++)
+            free(t->probes[ii].output);
+
         vector_free(t, cflags);
         vector_free(t, sources);
         vector_free(t, objects);
@@ -1924,17 +9325,50 @@ int main(int argc, char **argv)
         vector_free(t, custom_cmd);
         vector_free(t, headers);
         vector_free(t, deps);
+        vector_free(t, unity_exclude);
+        vector_free(t, trainings);
+        vector_free(t, probes);
+        vector_free(t, compile_inputs);
+        vector_free(t, link_inputs);
+        vector_free(t, cmd_inputs);
+        vector_free(t, cmd_outputs);
+        vector_free(t, resources);
         free(t);
     }
 
     nobita_proc_wait_all(&b);
+    nobita_jobserver_free(&b);
+    nobita_state_save(&b);
     for (size_t i = 0; i < b.free_later_used; i++)
         free(b.free_later[i]);
 
+#ifndef _WIN32
+    for (size_t i = 0; i < b.subbuilds_used; i++)
+        dlclose(b.subbuilds[i]);
+#endif /* _WIN32 */
+
+    vector_free(&b, subbuilds);
     vector_free(&b, deps);
     vector_free(&b, free_later);
-    vector_free(&b, proc_queue);
-    vector_free(&b, proc_names);
+    vector_free(&b, procs);
+#ifndef _WIN32
+    vector_free(&b, polls);
+#endif /* _WIN32 */
+    vector_free(&b, jobs);
+    vector_free(&b, ready);
+    nobita_state_free(&b);
+    for (size_t i = 0; i < b.pools_used; i++)
+        free(b.pools[i]);
+
+    vector_free(&b, pools);
+    vector_free(&b, cpu_sets);
+    vector_free(&b, linker_probes);
+    for (size_t i = 0; i < b.profile_hashes_used; i++)
+        free(b.profile_hashes[i].path);
+
+    vector_free(&b, profile_hashes);
+    vector_free(&b, pchs);
+    vector_free(&b, scanner_probes);
 
     free(ced);
     free(cwd);
@@ -1942,6 +9376,7 @@ int main(int argc, char **argv)
     free(include);
     free(bin);
     free(lib);
+    return (nobita_build_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 #endif /* NOBITA_IMPL */